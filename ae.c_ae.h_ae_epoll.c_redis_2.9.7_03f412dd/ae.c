@@ -76,6 +76,7 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->aftersleep = NULL;
     if (aeApiCreate(eventLoop) == -1) goto err;
 
     /* Events with mask == AE_NONE are not set. So let's initialize the
@@ -373,6 +374,7 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
 // 如果 flags 的 AE_FILE_EVENTS 被打开，那么文件事件会被处理
 // 如果 flags 的 AE_TIME_EVENTS 被打开，那么时间事件会被处理
 // 如果 flags 的 AE_DONT_WAIT 被打开，那么函数在处理完所有不须等待的事件后返回
+// 如果 flags 的 AE_CALL_AFTER_SLEEP 被打开，那么在等待之后调用 aftersleep 函数
 //
 // 函数的返回值为处理事件的个数
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
@@ -441,6 +443,12 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 
         // 处理文件事件
         numevents = aeApiPoll(eventLoop, tvp);
+
+        /* After sleep callback. */
+        // 等待之后，处理事件之前，执行 aftersleep 函数
+        if (eventLoop->aftersleep != NULL && flags & AE_CALL_AFTER_SLEEP)
+            eventLoop->aftersleep(eventLoop);
+
         for (j = 0; j < numevents; j++) {
             // 根据 fired 数组，从 events 数组中取出事件
             aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
@@ -508,7 +516,7 @@ void aeMain(aeEventLoop *eventLoop) {
         if (eventLoop->beforesleep != NULL)
             eventLoop->beforesleep(eventLoop);
         // 开始处理事件
-        aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+        aeProcessEvents(eventLoop, AE_ALL_EVENTS|AE_CALL_AFTER_SLEEP);
     }
 }
 
@@ -521,3 +529,8 @@ char *aeGetApiName(void) {
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
+
+// 设置等待文件事件之后执行的函数
+void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
+    eventLoop->aftersleep = aftersleep;
+}
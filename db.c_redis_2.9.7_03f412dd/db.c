@@ -2,45 +2,219 @@
 
 #include <signal.h>
 #include <ctype.h>
+#include <stddef.h>
 
 /* redis.h 中引用的结构
 
 typedef struct redisDb {
     // 保存 key 的字典
     dict *dict;                 // The keyspace for this DB
-    // 保存过期 key 的字典
-    dict *expires;              // Timeout of keys with a timeout set
+    // 带有过期时间的 key 的数量
+    // （过期时间保存在键空间字典节点附加数据指向的 dbExpireInfo 中，
+    // 原来的 expires 字典已经被移除）
+    unsigned long volatile_keys;
     // 保存被阻塞的 key 的字典
     dict *blocking_keys;        // Keys with clients waiting for data (BLPOP)
     // 保存被 WATCH 的 key 的字典
     dict *watched_keys;         // WATCHED keys for MULTI/EXEC CAS
+    // 按过期时间排序的过期 key 索引，没有启用或者没有带过期时间的 key 时为 NULL
+    struct expireIndex *expire_index;
     // 数据库 id
     int id;
 } redisDb;
 
+// maxmemory 策略
+#define REDIS_MAXMEMORY_VOLATILE_LRU 0
+#define REDIS_MAXMEMORY_VOLATILE_TTL 1
+#define REDIS_MAXMEMORY_VOLATILE_RANDOM 2
+#define REDIS_MAXMEMORY_ALLKEYS_LRU 3
+#define REDIS_MAXMEMORY_ALLKEYS_RANDOM 4
+#define REDIS_MAXMEMORY_NO_EVICTION 5
+#define REDIS_MAXMEMORY_VOLATILE_LFU 6
+#define REDIS_MAXMEMORY_ALLKEYS_LFU 7
+
+// redis.c 的 freeMemoryIfNeeded() 在使用 LRU 、 LFU 和 TTL 策略时，
+// 调用 dbEvictionCandidate() 选出要删除的 key ，
+// 每次采样的 key 数量由 server.maxmemory_samples 决定
+
+// 集群模式下，每个槽的 key 组成一个双向链表，
+// 链表的指针保存在键空间字典节点的附加数据里（见 dbEntryMetadata）
+typedef struct slotToKeys {
+    // 槽中第一个 key 的字典节点
+    dictEntry *head;
+    // 槽中 key 的数量
+    unsigned long count;
+} slotToKeys;
+
+// clusterState 中的 slots_to_keys 从跳跃表改为：
+//     slotToKeys slots_to_keys[REDIS_CLUSTER_SLOTS];
+//
+// redis.c 的 dbDictType 的 entryMetadataBytes 设置为 dbDictEntryMetadataSize ，
+// entryMetadataDestructor 设置为 dbDictEntryMetadataFree
+//
+// GetKeysInSlot() 返回的是键空间中的 sds key ，而不再是对象：
+//     unsigned int GetKeysInSlot(unsigned int hashslot, sds *keys, unsigned int count);
+// cluster.c 中 CLUSTER GETKEYSINSLOT 的 keys 数组改为 sds 数组，
+// 并用 addReplyBulkCBuffer(c,keys[j],sdslen(keys[j])) 回复，
+// 调用者不需要释放这些 key ，但它们在 key 被删除之后就会失效
+
+// 是否使用过期时间索引（expire-index 选项，默认为 yes ，只能在启动时设置）
+//     int expire_index;
+//
+// activeExpireCycle() 对设置了 db->expire_index 的数据库调用
+// dbReclaimExpiredKeys() ，其他数据库通过 dbSampleVolatileKeys() 取样，
+// INFO 的 expires 字段使用 db->volatile_keys
+
+// 缓存的时间（毫秒），每次事件循环只更新一次，并且不会倒退
+//     long long mstime;
+// 当前命令（事务或者脚本）开始执行时的时间，过期检查使用这个时间
+//     long long cmd_time_snapshot;
+// 正在执行的命令的嵌套层数，为 0 表示没有命令正在执行
+//     int execution_nesting;
+//
+// redis.c 的 updateCachedTime() 调用 updateCachedMstime() 更新 server.mstime ，
+// 并且通过 aeSetAfterSleepProc() 在每次等待文件事件之后调用 updateCachedTime() ，
+// call() 在执行命令前后调用 enterExecutionUnit() 和 exitExecutionUnit()
+
+// 是否在后台线程中释放大的值（lazyfree 选项，默认为 yes ）
+//     int lazyfree;
+//
+// 因为有后台线程释放内存， main() 需要调用 zmalloc_enable_thread_safeness() ，
+// serverCron() 调用 lazyfreeCron() ，
+// INFO 的 memory 部分通过 lazyfreeGetStats() 报告 lazyfree_pending_objects
+// 和 lazyfree_pending_bytes ，
+// freeMemoryIfNeeded() 将等待后台释放的内存视为已经释放
+// dbDelete() 在释放字典节点之前将值设为 NULL ，
+// 所以 redis.c 中 dbDictType 的 dictRedisObjectDestructor() 需要忽略 NULL 值
+
+// redis.c 的命令表中增加 SWAPDB 和 CLONEDB ：
+//     {"swapdb",swapdbCommand,3,"wF",0,NULL,0,0,0,0,0},
+//     {"clonedb",clonedbCommand,3,"wm",0,NULL,0,0,0,0,0},
+//
+// 交换或者克隆数据库之后，通过 t_list.c 的 signalListAsReady(db,key)
+// 唤醒阻塞在新出现的列表上的客户端。
+// 2.9.7 的 signalListAsReady() 的原型是 (redisClient *c, robj *key) ，
+// 但它只用到了 c->db ，所以改为直接接收数据库：
+//     void signalListAsReady(redisDb *db, robj *key);
+// t_list.c 中原有的调用 signalListAsReady(c,key) 相应地改为
+// signalListAsReady(c->db,key)
+//
+// CLONEDB 复制 src 的每一个字典节点（值是共享的），
+// 所以它的复杂度为 O(N) ，并且在执行期间会阻塞服务器，
+// N 为 src 中 key 的数量，对于很大的数据库应该谨慎使用
+
 */
 
-void SlotToKeyAdd(robj *key);
-void SlotToKeyDel(robj *key);
+void slotToKeyAddEntry(dictEntry *de);
+void slotToKeyDelEntry(dictEntry *de);
+void slotToKeyFlush(void);
+void expireIndexDel(redisDb *db, dictEntry *de);
+void expireIndexFlush(redisDb *db);
+static int expireEntryIfNeeded(redisDb *db, robj *key, dictEntry *de);
+static void expireIndexAdd(redisDb *db, dictEntry *de);
+robj *dbUnshareValue(redisDb *db, robj *key, robj *o);
+void dbReleaseValue(robj *val);
+dict *dbEmptyDict(dict *d);
 
 
 /*-----------------------------------------------------------------------------
  * C-level DB API
  *----------------------------------------------------------------------------*/
 
-// 查找给定 key
-robj *lookupKey(redisDb *db, robj *key) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+/* The expire of a volatile key, allocated the first time an expire is set
+ * and freed when the key is persisted or deleted, so persistent keys only
+ * pay for the pointer to it. The links of the deadline index are only
+ * allocated if expire-index is enabled. */
+// 带有过期时间的 key 的过期信息，只为带有过期时间的 key 分配
+typedef struct dbExpireInfo {
+    // 过期时间（毫秒）
+    long long expire;
+    // 过期时间索引中，桶的下一个节点
+    dictEntry *expire_next;
+    // 指向桶中指向本节点的指针，为 NULL 表示不在索引中
+    dictEntry **expire_pprev;
+} dbExpireInfo;
+
+/* Metadata stored at the end of every entry of the keyspace dictionary.
+ * The expire time of the key is found from here instead of in a second
+ * dictionary, so finding the key also finds its expire. Only the fields
+ * needed by the enabled features are allocated: the links of the list of
+ * keys of the hash slot only exist in cluster mode (see
+ * dbDictEntryMetadataSize()). */
+// 键空间字典节点的附加数据，
+// 只有启用的功能所需的字段会被分配
+typedef struct dbEntryMetadata {
+    // 过期信息，为 NULL 表示没有过期时间
+    dbExpireInfo *expire_info;
+    // 同一个槽中的前一个 key 和后一个 key
+    dictEntry *slot_prev;
+    dictEntry *slot_next;
+} dbEntryMetadata;
+
+#define dbEntryMeta(de) ((dbEntryMetadata*)dictMetadata(de))
+#define dbEntryExpireInfo(de) (dbEntryMeta(de)->expire_info)
+#define dbEntryExpire(de) \
+    (dbEntryExpireInfo(de) ? dbEntryExpireInfo(de)->expire : -1)
+
+/* The entryMetadataBytes method of the keyspace dict type. */
+// 返回键空间字典节点附加数据的大小
+size_t dbDictEntryMetadataSize(dict *d) {
+    REDIS_NOTUSED(d);
+    if (server.cluster_enabled) return sizeof(dbEntryMetadata);
+    return offsetof(dbEntryMetadata,slot_prev);
+}
+
+/* The entryMetadataDestructor method of the keyspace dict type: it is also
+ * called by the lazy free thread when a whole keyspace is released. */
+// 释放节点的过期信息
+void dbDictEntryMetadataFree(dict *d, dictEntry *de) {
+    REDIS_NOTUSED(d);
+    zfree(dbEntryExpireInfo(de));
+}
+
+// 设置节点的过期时间，第一次设置时分配过期信息
+static void dbEntrySetExpire(dictEntry *de, long long when) {
+    dbExpireInfo *info = dbEntryExpireInfo(de);
+
+    if (info == NULL) {
+        info = zcalloc(server.expire_index ? sizeof(dbExpireInfo) :
+                       offsetof(dbExpireInfo,expire_next));
+        dbEntryExpireInfo(de) = info;
+    }
+    info->expire = when;
+}
+
+/* Return the memory used by the expire info of the entry 'de', that is
+ * zero for persistent keys. Used by the memory introspection of object.c. */
+// 返回节点的过期信息占用的内存，没有过期时间的 key 返回 0
+size_t dbEntryExpireInfoSize(dictEntry *de) {
+    dbExpireInfo *info = dbEntryExpireInfo(de);
+
+    return info ? zmalloc_size(info) : 0;
+}
+
+// 移除节点的过期时间，并释放过期信息
+static void dbEntryClearExpire(dictEntry *de) {
+    zfree(dbEntryExpireInfo(de));
+    dbEntryExpireInfo(de) = NULL;
+}
+
+/* Return the value stored at the entry 'de' of the keyspace of 'db',
+ * or NULL if 'de' is NULL. */
+// 返回节点的值，并更新它的访问信息
+static robj *lookupKeyByEntry(redisDb *db, dictEntry *de) {
     if (de) {
-        // 取出值
+        // 取出值，带标记的整数直接返回，不为它创建对象
         robj *val = dictGetVal(de);
 
-        /* Update the access time for the aging algorithm.
+        /* Update the access time (or the access frequency counter with
+         * the LFU policy) for the aging algorithm.
          * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        // 如果条件允许，就更新 server.lruclock
-        if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
-            val->lru = server.lruclock;
+         * a copy on write madness. Tagged integers have no access info. */
+        // 如果条件允许，就更新对象的 LRU 时间或者 LFU 计数器
+        if (!objectIsTaggedInt(val) &&
+            server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+            updateObjectAccess(val);
 
         // 返回值
         return val;
@@ -49,13 +223,30 @@ robj *lookupKey(redisDb *db, robj *key) {
     }
 }
 
+// 查找给定 key
+robj *lookupKey(redisDb *db, robj *key) {
+    return lookupKeyByEntry(db,dictFind(db->dict,key->ptr));
+}
+
+/* Find the entry of 'key', expiring the key first if needed. The expire is
+ * read from the entry itself, so this is a single hash table lookup. */
+// 查找 key 的节点，如果 key 已经过期，那么先删除它
+static dictEntry *lookupKeyEntryExpire(redisDb *db, robj *key) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
+
+    /* Slaves report expired keys but don't delete them, so the entry is
+     * still valid there. */
+    // 在主服务器上，过期的 key 已经被删除了
+    if (de && expireEntryIfNeeded(db,key,de) && server.masterhost == NULL)
+        de = NULL;
+    return de;
+}
+
 // 为读取而查找给定 key ，并统计 miss 和 hit 次数
 robj *lookupKeyRead(redisDb *db, robj *key) {
     robj *val;
 
-    expireIfNeeded(db,key);
-
-    val = lookupKey(db,key);
+    val = lookupKeyByEntry(db,lookupKeyEntryExpire(db,key));
     if (val == NULL)
         server.stat_keyspace_misses++;
     else
@@ -66,8 +257,22 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
 
 // 为写入而查找给定 key
 robj *lookupKeyWrite(redisDb *db, robj *key) {
-    expireIfNeeded(db,key);
-    return lookupKey(db,key);
+    dictEntry *de = lookupKeyEntryExpire(db,key);
+    robj *val = lookupKeyByEntry(db,de);
+
+    /* The caller may modify the value in place, so an aggregate value
+     * shared with a cloned DB (see CLONEDB) is replaced by a private copy.
+     * Shared strings are already copied by the string commands before
+     * they modify them. */
+    // 写时复制：被共享的聚合值在修改之前被复制
+    if (val && objectType(val) != REDIS_STRING && val->refcount > 1) {
+        robj *copy = dupValueObject(val);
+
+        dictSetVal(db->dict,de,copy);
+        decrRefCount(val);
+        val = copy;
+    }
+    return val;
 }
 
 // 为了读取而查找，或返回一个回应
@@ -84,6 +289,19 @@ robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply) {
     return o;
 }
 
+/* Return the representation of 'val' to store into the keyspace. The
+ * reference to 'val' owned by the DB is dropped if it gets stored as a
+ * tagged integer, but only when the current command returns, since the
+ * caller is allowed to keep using the object it just stored. */
+// 返回值在数据库中的保存形式，
+// 如果值被保存为带标记的整数，那么在命令返回时释放原来的对象
+static robj *dbStoredValue(robj *val) {
+    robj *stored = tryObjectTagging(val);
+
+    if (stored != val) deferDecrRefCount(val);
+    return stored;
+}
+
 /* Add the key to the DB. It's up to the caller to increment the reference
  * counte of the value if needed.
  *
@@ -93,10 +311,12 @@ robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply) {
 // 如果有增加引用计数的工作，那么由调用者完成
 void dbAdd(redisDb *db, robj *key, robj *val) {
     sds copy = sdsdup(key->ptr);    // 复制 key
-    int retval = dictAdd(db->dict, copy, val);  // 添加 key
+    dictEntry *de = dictAddRaw(db->dict, copy);  // 添加 key
 
-    redisAssertWithInfo(NULL,key,retval == REDIS_OK);
-    if (server.cluster_enabled) SlotToKeyAdd(key);
+    redisAssertWithInfo(NULL,key,de != NULL);
+    // 如果可以的话，以带标记整数的形式保存值
+    dictSetVal(db->dict,de,dbStoredValue(val));
+    if (server.cluster_enabled) slotToKeyAddEntry(de);
  }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
@@ -112,11 +332,59 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
     // 查找给定 key
     struct dictEntry *de = dictFind(db->dict,key->ptr);
+    robj *old;
     
     redisAssertWithInfo(NULL,key,de != NULL);
 
-    // 更新它
-    dictReplace(db->dict, key->ptr, val);
+    // 更新它，旧值可能在后台释放
+    old = dictGetVal(de);
+    dictSetVal(db->dict,de,dbStoredValue(val));
+    dbReleaseValue(old);
+}
+
+/* Prepare the sorted set 'o' stored at 'key' to be modified in place.
+ * The value may be shared with a range reply that is still being streamed
+ * to a client: in that case it is replaced in the DB by a copy, and the copy
+ * is returned, so that the reply keeps iterating over the old version.
+ * The expire time of the key is not modified. */
+// 在修改 key 的有序集合值之前调用，
+// 如果值被共享，那么用它的副本替换它，并返回副本
+robj *dbUnshareZsetValue(redisDb *db, robj *key, robj *o) {
+    redisAssertWithInfo(NULL,key,o->type == REDIS_ZSET);
+    return dbUnshareValue(db,key,o);
+}
+
+/* Same as dbUnshareZsetValue() for values of any type. Values are also
+ * shared between a DB and its clones created by CLONEDB. */
+// 如果值被共享，那么用它的副本替换它，并返回副本
+robj *dbUnshareValue(redisDb *db, robj *key, robj *o) {
+    // 带标记的整数不会被原地修改
+    if (objectIsTaggedInt(o) || o->refcount == 1) return o;
+    o = dupValueObject(o);
+    dbOverwrite(db,key,o);
+    return o;
+}
+
+/* Prepare the string value 'o' stored at 'key' to be modified in place
+ * (APPEND, SETRANGE, SETBIT). If the value is shared, or it is not RAW
+ * encoded (EMBSTR strings live in the same allocation of the object, and
+ * integers have no sds at all), it is replaced in the DB by a private RAW
+ * copy, that is returned. The expire time of the key is not modified. */
+// 在原地修改 key 的字符串值之前调用，
+// 如果值被共享，或者不是 raw 编码，那么用它的 raw 编码副本替换它，并返回副本
+robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
+    robj *decoded;
+
+    redisAssertWithInfo(NULL,key,
+        objectIsTaggedInt(o) || o->type == REDIS_STRING);
+    if (!objectIsTaggedInt(o) && o->refcount == 1 &&
+        o->encoding == REDIS_ENCODING_RAW) return o;
+
+    decoded = getDecodedObject(o);
+    o = createRawStringObject(decoded->ptr,sdslen(decoded->ptr));
+    decrRefCount(decoded);
+    dbOverwrite(db,key,o);
+    return o;
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -127,13 +395,14 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
  * 3) The expire time of the key is reset (the key is made persistent). */
 // 设置一个 key 到 db ，无论 key 是否存在
 void setKey(redisDb *db, robj *key, robj *val) {
-    if (lookupKeyWrite(db,key) == NULL) {
+    // 增加引用计数，数据库持有这个引用
+    incrRefCount(val);
+    // 只检查 key 是否存在，旧值会被覆盖，所以不需要复制它
+    if (lookupKeyEntryExpire(db,key) == NULL) {
         dbAdd(db,key,val);
     } else {
         dbOverwrite(db,key,val);
     }
-    // 增加引用计数
-    incrRefCount(val);
     // 移除过期时间
     removeExpire(db,key);
     // 告知 key 已被修改
@@ -168,7 +437,7 @@ robj *dbRandomKey(redisDb *db) {
         // 取出 key 的字符串名字
         keyobj = createStringObject(key,sdslen(key));
         // 略过过期 key
-        if (dictFind(db->expires,key)) {
+        if (dbEntryExpire(de) != -1) {
             if (expireIfNeeded(db,keyobj)) {
                 decrRefCount(keyobj);
                 continue; /* search for another key. This expired. */
@@ -183,17 +452,66 @@ robj *dbRandomKey(redisDb *db) {
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 // 从 db 中删除一个 key 及其 value ，还有相应的过期元素
 int dbDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-        if (server.cluster_enabled) SlotToKeyDel(key);
+    dictEntry *de;
+
+    /* Unlink the entry first, so that it can be removed from the deadline
+     * index and from the list of its slot without a second lookup. */
+    if ((de = dictUnlink(db->dict,key->ptr)) != NULL) {
+        if (dbEntryExpire(de) != -1) {
+            expireIndexDel(db,de);
+            db->volatile_keys--;
+        }
+        if (server.cluster_enabled) slotToKeyDelEntry(de);
+        /* The value may be freed by the lazy free thread. The destructor
+         * of the keyspace ignores NULL values. */
+        dbReleaseValue(dictGetVal(de));
+        dictSetVal(db->dict,de,NULL);
+        dictFreeUnlinkedEntry(db->dict,de);
         return 1;
     } else {
         return 0;
     }
 }
 
+/* Move the key 'key' of 'src' to 'dst' (that may be the same DB) with the
+ * name 'newkey', keeping its value and its expire. The entry of the key is
+ * relinked instead of being freed and allocated again, and the value is
+ * not touched at all, so this is O(1) whatever the size and the encoding
+ * of the value.
+ *
+ * The caller must make sure that 'key' exists in 'src' and 'newkey' does
+ * not exist in 'dst'. */
+// 将 src 中的 key 移动到 dst 并改名为 newkey ，值和过期时间保持不变
+void dbRelink(redisDb *src, robj *key, redisDb *dst, robj *newkey) {
+    dictEntry *de = dictUnlink(src->dict,key->ptr);
+    sds name;
+
+    redisAssertWithInfo(NULL,key,de != NULL);
+    if (server.cluster_enabled) slotToKeyDelEntry(de);
+
+    /* Inside the same DB the deadline doesn't change, so the entry keeps
+     * its place in the expire index. */
+    // 跨数据库移动时，将 key 从原数据库的过期时间索引中移除
+    if (src != dst && dbEntryExpire(de) != -1) {
+        expireIndexDel(src,de);
+        src->volatile_keys--;
+    }
+
+    // 在原来的 sds 中写入新的名字，空间足够时不需要重新分配
+    if (key != newkey) {
+        name = dictGetKey(de);
+        name = sdscpylen(name,newkey->ptr,sdslen(newkey->ptr));
+        dictSetKey(dst->dict,de,name);
+    }
+    redisAssertWithInfo(NULL,newkey,dictRelink(dst->dict,de) == DICT_OK);
+
+    if (src != dst && dbEntryExpire(de) != -1) {
+        dst->volatile_keys++;
+        expireIndexAdd(dst,de);
+    }
+    if (server.cluster_enabled) slotToKeyAddEntry(de);
+}
+
 // 清空所有 db
 long long emptyDb() {
     int j;
@@ -201,9 +519,11 @@ long long emptyDb() {
 
     for (j = 0; j < server.dbnum; j++) {
         removed += dictSize(server.db[j].dict);
-        dictEmpty(server.db[j].dict);
-        dictEmpty(server.db[j].expires);
+        server.db[j].dict = dbEmptyDict(server.db[j].dict);
+        server.db[j].volatile_keys = 0;
+        expireIndexFlush(&server.db[j]);
     }
+    if (server.cluster_enabled) slotToKeyFlush();
     
     // 返回所有 db 被删除元素的总数量
     return removed;
@@ -217,6 +537,248 @@ int selectDb(redisClient *c, int id) {
     return REDIS_OK;
 }
 
+/*-----------------------------------------------------------------------------
+ * Lazy free
+ *
+ * Freeing a big aggregate value, or a whole DB when it is flushed, takes a
+ * time proportional to the number of its elements. When lazyfree is
+ * enabled, dbDelete(), dbOverwrite() and emptyDb() hand such values to a
+ * background thread instead. Small values are still freed inline, since
+ * handing them over would cost more than freeing them.
+ *
+ * Jobs are pushed on a lock free stack that the thread takes as a whole.
+ * The elements of a value may still be referenced by the main thread (for
+ * instance by a reply waiting in the output list of a client), so when
+ * decrRefCount() is called by the background thread against an object that
+ * is still shared, the object is handed back to the main thread, that
+ * releases its reference in lazyfreeCron(). Shared objects like
+ * shared.integers are never freed and are simply skipped, and the members
+ * of sorted sets are released once even if they are referenced twice by
+ * the value (see freeZsetObject()).
+ *----------------------------------------------------------------------------*/
+
+// 释放代价超过这个值（元素数量）的值才在后台释放
+#define REDIS_LAZYFREE_EFFORT_THRESHOLD 64
+// 估算待释放内存时，每个容器采样的元素数量
+#define REDIS_LAZYFREE_SIZE_SAMPLES 8
+// 每次调用 lazyfreeCron() 最多处理的退回对象数量
+#define REDIS_LAZYFREE_CRON_BUDGET 1000
+
+// 后台任务的类型
+#define REDIS_LAZYFREE_OBJECT 0     // 释放一个对象
+#define REDIS_LAZYFREE_DICT 1       // 释放一个数据库的键空间字典
+
+typedef struct lazyfreeJob {
+    struct lazyfreeJob *next;
+    // 任务类型
+    int type;
+    // 要释放的对象或者字典
+    void *ptr;
+    // 要释放的值的数量，以及估算的内存字节数
+    unsigned long objects;
+    unsigned long long bytes;
+} lazyfreeJob;
+
+// 在后台线程中为 1
+__thread int lazyfree_in_thread = 0;
+
+// 等待后台线程释放的任务
+static lazyfreeJob *lazyfree_jobs = NULL;
+// 后台线程退回给主线程的共享对象
+static lazyfreeJob *lazyfree_deferred = NULL;
+// 已经从 lazyfree_deferred 中取出，但还没有处理的对象，只由主线程访问
+static lazyfreeJob *lazyfree_deferred_backlog = NULL;
+// 等待释放的值的数量和估算的字节数，由两个线程共同更新
+static unsigned long lazyfree_pending_objects = 0;
+static unsigned long long lazyfree_pending_bytes = 0;
+// 只用于在没有任务时让后台线程休眠
+static pthread_mutex_t lazyfree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazyfree_cond = PTHREAD_COND_INITIALIZER;
+// 后台线程的状态： 0 未创建， 1 运行中， -1 创建失败
+static int lazyfree_thread_state = 0;
+
+/* Push 'job' on the lock free stack 'stack'. Returns 1 if the stack was
+ * empty. */
+// 将任务推入栈中，如果栈原本为空，那么返回 1
+static int lazyfreePush(lazyfreeJob **stack, lazyfreeJob *job) {
+    lazyfreeJob *head = __atomic_load_n(stack,__ATOMIC_RELAXED);
+
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(stack,&head,job,1,
+                                          __ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    return head == NULL;
+}
+
+// 取出栈中所有任务
+static lazyfreeJob *lazyfreeTakeAll(lazyfreeJob **stack) {
+    return __atomic_exchange_n(stack,NULL,__ATOMIC_ACQUIRE);
+}
+
+// 后台线程的主函数
+static void *lazyfreeThreadMain(void *arg) {
+    REDIS_NOTUSED(arg);
+
+    lazyfree_in_thread = 1;
+    while(1) {
+        lazyfreeJob *job, *next;
+
+        pthread_mutex_lock(&lazyfree_mutex);
+        while (__atomic_load_n(&lazyfree_jobs,__ATOMIC_ACQUIRE) == NULL)
+            pthread_cond_wait(&lazyfree_cond,&lazyfree_mutex);
+        pthread_mutex_unlock(&lazyfree_mutex);
+
+        for (job = lazyfreeTakeAll(&lazyfree_jobs); job; job = next) {
+            next = job->next;
+            if (job->type == REDIS_LAZYFREE_OBJECT)
+                decrRefCount(job->ptr);
+            else
+                dictRelease(job->ptr);
+            __atomic_sub_fetch(&lazyfree_pending_objects,job->objects,
+                               __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&lazyfree_pending_bytes,job->bytes,
+                               __ATOMIC_RELAXED);
+            zfree(job);
+        }
+    }
+    return NULL;
+}
+
+/* Hand 'ptr' to the background thread, starting it the first time.
+ * Returns REDIS_ERR if the thread can't be created: the caller must free
+ * the value itself. */
+// 将任务交给后台线程
+static int lazyfreeSubmit(int type, void *ptr, unsigned long objects,
+                          unsigned long long bytes)
+{
+    lazyfreeJob *job;
+
+    if (lazyfree_thread_state == 0) {
+        pthread_t tid;
+
+        lazyfree_thread_state =
+            pthread_create(&tid,NULL,lazyfreeThreadMain,NULL) == 0 ? 1 : -1;
+        if (lazyfree_thread_state == -1)
+            redisLog(REDIS_WARNING,
+                "Can't create the lazy free thread: freeing values inline.");
+    }
+    if (lazyfree_thread_state != 1) return REDIS_ERR;
+
+    job = zmalloc(sizeof(*job));
+    job->type = type;
+    job->ptr = ptr;
+    job->objects = objects;
+    job->bytes = bytes;
+    __atomic_add_fetch(&lazyfree_pending_objects,objects,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&lazyfree_pending_bytes,bytes,__ATOMIC_RELAXED);
+    if (lazyfreePush(&lazyfree_jobs,job)) {
+        pthread_mutex_lock(&lazyfree_mutex);
+        pthread_cond_signal(&lazyfree_cond);
+        pthread_mutex_unlock(&lazyfree_mutex);
+    }
+    return REDIS_OK;
+}
+
+/* Return the number of allocations that freeing 'o' is going to release,
+ * roughly: one for values that are stored in a single allocation. */
+// 返回释放对象所需的工作量
+static unsigned long lazyfreeGetFreeEffort(robj *o) {
+    if (o->type == REDIS_LIST && o->encoding == REDIS_ENCODING_LINKEDLIST) {
+        return listLength((list*)o->ptr);
+    } else if (o->type == REDIS_SET && o->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)o->ptr);
+    } else if (o->type == REDIS_ZSET &&
+               (o->encoding == REDIS_ENCODING_SKIPLIST ||
+                o->encoding == REDIS_ENCODING_BTREE)) {
+        return dictSize(((zset*)o->ptr)->dict);
+    } else if (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_BLOCKS) {
+        return ((zblocks*)o->ptr)->nblocks;
+    } else if (o->type == REDIS_HASH && o->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)o->ptr);
+    } else {
+        return 1;
+    }
+}
+
+/* Release the reference of the keyspace to the value 'val', freeing it in
+ * the background if it is big and not referenced by anyone else. */
+// 释放键空间对值的引用，大的值在后台释放
+void dbReleaseValue(robj *val) {
+    if (server.lazyfree && !objectIsTaggedInt(val) && val->refcount == 1 &&
+        lazyfreeGetFreeEffort(val) > REDIS_LAZYFREE_EFFORT_THRESHOLD &&
+        lazyfreeSubmit(REDIS_LAZYFREE_OBJECT,val,1,
+            objectComputeSize(val,REDIS_LAZYFREE_SIZE_SAMPLES)) == REDIS_OK)
+        return;
+    decrRefCount(val);
+}
+
+/* Empty the keyspace dictionary 'd', returning the dictionary to use from
+ * now on: a big dictionary is replaced by a new one, and released in the
+ * background. */
+// 清空键空间字典，返回之后使用的字典
+dict *dbEmptyDict(dict *d) {
+    unsigned long keys = dictSize(d);
+
+    if (server.lazyfree && keys > REDIS_LAZYFREE_EFFORT_THRESHOLD) {
+        dictEntry *samples[REDIS_LAZYFREE_SIZE_SAMPLES];
+        unsigned long long bytes = 0;
+        unsigned int j, count;
+
+        // 根据采样估算字典占用的内存
+        count = dictGetSomeKeys(d,samples,REDIS_LAZYFREE_SIZE_SAMPLES);
+        for (j = 0; j < count; j++) {
+            sds key = dictGetKey(samples[j]);
+
+            bytes += zmalloc_size(samples[j]) + zmalloc_size(sdsAllocPtr(key)) +
+                     objectComputeSize(dictGetVal(samples[j]),
+                                       REDIS_LAZYFREE_SIZE_SAMPLES);
+        }
+        if (count) bytes = bytes/count*keys;
+
+        if (lazyfreeSubmit(REDIS_LAZYFREE_DICT,d,keys,bytes) == REDIS_OK)
+            return dictCreate(d->type,d->privdata);
+    }
+    dictEmpty(d);
+    return d;
+}
+
+/* Called by decrRefCount() in the background thread for objects that are
+ * still shared: the main thread will release the reference. */
+// 将共享对象退回给主线程，由主线程减少它的引用计数
+void lazyfreeDeferDecrRefCount(robj *o) {
+    lazyfreeJob *job = zmalloc(sizeof(*job));
+
+    job->type = REDIS_LAZYFREE_OBJECT;
+    job->ptr = o;
+    job->objects = job->bytes = 0;
+    lazyfreePush(&lazyfree_deferred,job);
+}
+
+/* Called by serverCron(): release the references handed back by the
+ * background thread, at most REDIS_LAZYFREE_CRON_BUDGET per call, so that
+ * a big backlog doesn't block the server. The rest is kept for the next
+ * calls. */
+// 释放后台线程退回的共享对象，每次调用最多处理 REDIS_LAZYFREE_CRON_BUDGET 个
+void lazyfreeCron(void) {
+    lazyfreeJob *job;
+    int budget = REDIS_LAZYFREE_CRON_BUDGET;
+
+    if (lazyfree_deferred_backlog == NULL)
+        lazyfree_deferred_backlog = lazyfreeTakeAll(&lazyfree_deferred);
+
+    while ((job = lazyfree_deferred_backlog) != NULL && budget--) {
+        lazyfree_deferred_backlog = job->next;
+        decrRefCount(job->ptr);
+        zfree(job);
+    }
+}
+
+// 返回等待释放的值的数量和估算的字节数
+void lazyfreeGetStats(unsigned long *objects, unsigned long long *bytes) {
+    *objects = __atomic_load_n(&lazyfree_pending_objects,__ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&lazyfree_pending_bytes,__ATOMIC_RELAXED);
+}
+
 /*-----------------------------------------------------------------------------
  * Hooks for key space changes.
  *
@@ -236,6 +798,11 @@ void signalFlushedDb(int dbid) {
     touchWatchedKeysOnFlush(dbid);
 }
 
+// db 的内容将被 with 的内容替换
+void signalReplacedDb(redisDb *db, redisDb *with) {
+    touchWatchedKeysOnReplace(db,with);
+}
+
 /*-----------------------------------------------------------------------------
  * Type agnostic commands operating on the key space
  *----------------------------------------------------------------------------*/
@@ -243,8 +810,10 @@ void signalFlushedDb(int dbid) {
 void flushdbCommand(redisClient *c) {
     server.dirty += dictSize(c->db->dict);
     signalFlushedDb(c->db->id);
-    dictEmpty(c->db->dict);
-    dictEmpty(c->db->expires);
+    c->db->dict = dbEmptyDict(c->db->dict);
+    c->db->volatile_keys = 0;
+    expireIndexFlush(c->db);
+    if (server.cluster_enabled) slotToKeyFlush();
     addReply(c,shared.ok);
 }
 
@@ -358,7 +927,7 @@ void typeCommand(redisClient *c) {
     if (o == NULL) {
         type = "none";
     } else {
-        switch(o->type) {
+        switch(objectType(o)) {
         case REDIS_STRING: type = "string"; break;
         case REDIS_LIST: type = "list"; break;
         case REDIS_SET: type = "set"; break;
@@ -391,32 +960,29 @@ void shutdownCommand(redisClient *c) {
 }
 
 void renameGenericCommand(redisClient *c, int nx) {
-    robj *o;
-    long long expire;
-
     /* To use the same key as src and dst is probably an error */
     if (sdscmp(c->argv[1]->ptr,c->argv[2]->ptr) == 0) {
         addReply(c,shared.sameobjecterr);
         return;
     }
 
-    if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.nokeyerr)) == NULL)
+    /* Only the entries are looked up: the value is never accessed, so a
+     * tagged integer is not turned into an object. */
+    if (lookupKeyEntryExpire(c->db,c->argv[1]) == NULL) {
+        addReply(c,shared.nokeyerr);
         return;
+    }
 
-    incrRefCount(o);
-    expire = getExpire(c->db,c->argv[1]);
-    if (lookupKeyWrite(c->db,c->argv[2]) != NULL) {
+    if (lookupKeyEntryExpire(c->db,c->argv[2]) != NULL) {
         if (nx) {
-            decrRefCount(o);
             addReply(c,shared.czero);
             return;
         }
         /* Overwrite: delete the old key before creating the new one with the same name. */
         dbDelete(c->db,c->argv[2]);
     }
-    dbAdd(c->db,c->argv[2],o);
-    if (expire != -1) setExpire(c->db,c->argv[2],expire);
-    dbDelete(c->db,c->argv[1]);
+    // 直接将节点改名，值和过期时间都保留在节点中
+    dbRelink(c->db,c->argv[1],c->db,c->argv[2]);
     signalModifiedKey(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[2]);
     server.dirty++;
@@ -432,7 +998,6 @@ void renamenxCommand(redisClient *c) {
 }
 
 void moveCommand(redisClient *c) {
-    robj *o;
     redisDb *src, *dst;
     int srcid;
 
@@ -458,48 +1023,335 @@ void moveCommand(redisClient *c) {
         return;
     }
 
-    /* Check if the element exists and get a reference */
-    o = lookupKeyWrite(c->db,c->argv[1]);
-    if (!o) {
+    /* Check if the element exists */
+    if (lookupKeyEntryExpire(src,c->argv[1]) == NULL) {
         addReply(c,shared.czero);
         return;
     }
 
     /* Return zero if the key already exists in the target DB */
-    if (lookupKeyWrite(dst,c->argv[1]) != NULL) {
+    if (lookupKeyEntryExpire(dst,c->argv[1]) != NULL) {
         addReply(c,shared.czero);
         return;
     }
-    dbAdd(dst,c->argv[1],o);
-    incrRefCount(o);
 
-    /* OK! key moved, free the entry in the source DB */
-    dbDelete(src,c->argv[1]);
+    /* OK! Move the entry, with its value and expire, to the target DB */
+    dbRelink(src,c->argv[1],dst,c->argv[1]);
     server.dirty++;
     addReply(c,shared.cone);
 }
 
+/* Clients blocked on keys of 'db' may find a list there after the DB
+ * content was swapped or cloned: signal the keys that now hold a list. */
+// 唤醒阻塞在数据库中新出现的列表上的客户端
+static void dbSignalReadyLists(redisDb *db) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (dictSize(db->blocking_keys) == 0) return;
+    di = dictGetIterator(db->blocking_keys);
+    while((de = dictNext(di)) != NULL) {
+        robj *key = dictGetKey(de);
+        dictEntry *kde = dictFind(db->dict,key->ptr);
+
+        if (kde && objectType((robj*)dictGetVal(kde)) == REDIS_LIST)
+            signalListAsReady(db,key);
+    }
+    dictReleaseIterator(di);
+}
+
+/* Swap the content of two DBs: the keyspaces, with the expires and the
+ * expire indexes, are exchanged, while the clients, the blocked keys and
+ * the watched keys stay attached to the DB id. So this is O(1), and a
+ * dataset built in a DB can be made live atomically. */
+// 交换两个数据库的内容，客户端以及阻塞和 WATCH 的 key 仍然属于原来的数据库
+void dbSwapDatabases(redisDb *db1, redisDb *db2) {
+    dict *d = db1->dict;
+    unsigned long volatile_keys = db1->volatile_keys;
+    struct expireIndex *idx = db1->expire_index;
+
+    // 所有在交换之前或者之后存在的被 WATCH 的 key 都被视为已修改
+    signalReplacedDb(db1,db2);
+    signalReplacedDb(db2,db1);
+
+    db1->dict = db2->dict;
+    db1->volatile_keys = db2->volatile_keys;
+    db1->expire_index = db2->expire_index;
+    db2->dict = d;
+    db2->volatile_keys = volatile_keys;
+    db2->expire_index = idx;
+
+    dbSignalReadyLists(db1);
+    dbSignalReadyLists(db2);
+}
+
+/* Replace the content of 'dst' with a copy of 'src'. Only the keys and the
+ * entries are copied: the values are shared between the two DBs, and are
+ * copied by lookupKeyWrite() when one of them is going to be modified.
+ * Returns the number of keys removed from 'dst'.
+ *
+ * Copying the entries is still O(N) in the number of keys of 'src', and
+ * is performed synchronously: the server is blocked meanwhile. */
+// 用 src 的副本替换 dst 的内容，值对象在两个数据库之间共享，写时复制，
+// 复制字典节点的复杂度为 O(N) ，执行期间服务器被阻塞
+long long dbCloneDatabase(redisDb *src, redisDb *dst) {
+    long long removed = dictSize(dst->dict);
+    dictIterator *di;
+    dictEntry *de, *copy;
+
+    signalReplacedDb(dst,src);
+    dst->dict = dbEmptyDict(dst->dict);
+    dst->volatile_keys = 0;
+    expireIndexFlush(dst);
+
+    dictExpand(dst->dict,dictSize(src->dict));
+    di = dictGetIterator(src->dict);
+    while((de = dictNext(di)) != NULL) {
+        robj *val = dictGetVal(de);
+
+        copy = dictAddRaw(dst->dict,sdsdup(dictGetKey(de)));
+        // 带标记的整数没有引用计数，直接复制
+        if (!objectIsTaggedInt(val)) incrRefCount(val);
+        dictSetVal(dst->dict,copy,val);
+        if (dbEntryExpire(de) != -1) {
+            dbEntrySetExpire(copy,dbEntryExpire(de));
+            dst->volatile_keys++;
+            expireIndexAdd(dst,copy);
+        }
+    }
+    dictReleaseIterator(di);
+
+    dbSignalReadyLists(dst);
+    return removed;
+}
+
+/* Parse the DB index stored in 'o', replying with an error if it is not
+ * valid. */
+// 取出数据库号码，号码无效时向客户端返回错误
+static redisDb *getDbFromObjectOrReply(redisClient *c, robj *o) {
+    long id;
+
+    if (getLongFromObjectOrReply(c,o,&id,"invalid DB index") != REDIS_OK)
+        return NULL;
+    if (id < 0 || id >= server.dbnum) {
+        addReply(c,shared.outofrangeerr);
+        return NULL;
+    }
+    return server.db+id;
+}
+
+// SWAPDB index1 index2
+void swapdbCommand(redisClient *c) {
+    redisDb *db1, *db2;
+
+    if (server.cluster_enabled) {
+        addReplyError(c,"SWAPDB is not allowed in cluster mode");
+        return;
+    }
+    if ((db1 = getDbFromObjectOrReply(c,c->argv[1])) == NULL ||
+        (db2 = getDbFromObjectOrReply(c,c->argv[2])) == NULL)
+        return;
+
+    if (db1 != db2) dbSwapDatabases(db1,db2);
+    server.dirty++;
+    addReply(c,shared.ok);
+}
+
+// CLONEDB source destination
+void clonedbCommand(redisClient *c) {
+    redisDb *src, *dst;
+
+    if (server.cluster_enabled) {
+        addReplyError(c,"CLONEDB is not allowed in cluster mode");
+        return;
+    }
+    if ((src = getDbFromObjectOrReply(c,c->argv[1])) == NULL ||
+        (dst = getDbFromObjectOrReply(c,c->argv[2])) == NULL)
+        return;
+    if (src == dst) {
+        addReply(c,shared.sameobjecterr);
+        return;
+    }
+
+    server.dirty += dbCloneDatabase(src,dst);
+    server.dirty += dictSize(dst->dict)+1;
+    addReply(c,shared.ok);
+}
+
 /*-----------------------------------------------------------------------------
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* Expiration checks don't call mstime() for every key. server.mstime is
+ * refreshed once per event loop iteration, after the poll returns and in
+ * serverCron(), and server.cmd_time_snapshot is copied from it when the
+ * outermost command starts executing, and is kept frozen until it returns.
+ * EXEC and EVAL run their commands through call() as well, so a whole
+ * transaction or script sees a single time, and a key can't be found alive
+ * and then expired by a later access in the same execution. */
+// 过期检查使用缓存的时间，在命令、事务或者脚本执行期间，这个时间保持不变
+
+/* Refresh server.mstime. The cached time never goes backward, otherwise
+ * keys already seen as expired could come back to life when the system
+ * clock is adjusted. Long running operations that need the elapsed time,
+ * like the slow script detection, call this function directly: the time
+ * snapshot of the running command is not modified. */
+// 更新缓存的时间，缓存的时间不会倒退
+void updateCachedMstime(void) {
+    long long now = mstime();
+
+    if (now > server.mstime) server.mstime = now;
+    if (server.execution_nesting == 0)
+        server.cmd_time_snapshot = server.mstime;
+}
+
+/* Called by call() before executing a command, and after it returns. */
+// 开始和结束执行一个命令
+void enterExecutionUnit(void) {
+    if (server.execution_nesting++ == 0)
+        server.cmd_time_snapshot = server.mstime;
+}
+
+void exitExecutionUnit(void) {
+    // 最外层的命令返回时，释放命令执行期间延迟释放的对象
+    if (--server.execution_nesting == 0) releaseDeferredObjects();
+}
+
+/* Return the time to use for expiration, see above. */
+// 返回过期检查所使用的时间
+long long commandTimeSnapshot(void) {
+    return server.cmd_time_snapshot;
+}
+
+/* The expire time of a key is stored in the metadata of its entry in the
+ * keyspace (see dbEntryMetadata), -1 meaning that the key is persistent.
+ *
+ * Deadline index. When enabled, the entries of the volatile keys are also
+ * linked in a hashed timing wheel: the time is divided in slots of
+ * 2^REDIS_EXPIRE_INDEX_SHIFT milliseconds, and every entry is linked in the
+ * bucket of the slot of its expire time, modulo the number of buckets.
+ * A bucket may hold keys of later rounds of the wheel as well, so
+ * dbReclaimExpiredKeys() checks the expire time of every entry it visits,
+ * but every entry is visited only once per round, and the keys that are
+ * due are found without any random sampling.
+ *
+ * The links are stored in the expire info of the entries as well, so the
+ * index costs two pointers per volatile key, plus the buckets array
+ * allocated the first time an expire is set in the DB. */
+// 过期时间保存在键空间字典节点附加数据指向的过期信息中。
+// 过期时间索引：按过期时间把带有过期时间的节点连接到时间轮的桶里，
+// 这样主动过期时可以直接找出已经过期的 key ，而不必随机取样
+
+// 每个时间槽的长度为 2^REDIS_EXPIRE_INDEX_SHIFT 毫秒
+#define REDIS_EXPIRE_INDEX_SHIFT 8
+// 时间轮中桶的数量，一圈大约为 70 分钟
+#define REDIS_EXPIRE_INDEX_BUCKETS (1<<14)
+#define REDIS_EXPIRE_INDEX_MASK (REDIS_EXPIRE_INDEX_BUCKETS-1)
+
+typedef struct expireIndex {
+    // 桶数组，每个桶都是一个节点链表
+    dictEntry **buckets;
+    // 下一个要处理的时间槽，在它之前的时间槽都已经处理完毕
+    long long clock;
+    // 当前时间槽的桶中，下一个要检查的节点，为 NULL 表示从链表头开始
+    dictEntry *resume;
+    // 索引中节点的数量
+    unsigned long count;
+} expireIndex;
+
+// 将带有过期时间的节点添加到索引
+static void expireIndexAdd(redisDb *db, dictEntry *de) {
+    expireIndex *idx = db->expire_index;
+    dbExpireInfo *info;
+    long long slot;
+    dictEntry **pos;
+
+    if (!server.expire_index) return;
+    if (idx == NULL) {
+        idx = db->expire_index = zmalloc(sizeof(*idx));
+        idx->buckets = zcalloc(sizeof(dictEntry*)*REDIS_EXPIRE_INDEX_BUCKETS);
+        idx->clock = commandTimeSnapshot() >> REDIS_EXPIRE_INDEX_SHIFT;
+        idx->resume = NULL;
+        idx->count = 0;
+    }
+
+    /* Keys already expired go in the bucket that is processed next. */
+    // 已经过期的 key 放到下一个要处理的桶中
+    slot = dbEntryExpire(de) >> REDIS_EXPIRE_INDEX_SHIFT;
+    if (slot < idx->clock) slot = idx->clock;
+
+    /* If the bucket of the current slot is half visited, link the entry
+     * just before the next entry to visit, so it is not missed. */
+    // 如果当前时间槽的桶已经检查了一半，那么把节点放在下一个要检查的节点之前
+    if (slot == idx->clock && idx->resume) {
+        pos = dbEntryExpireInfo(idx->resume)->expire_pprev;
+        idx->resume = de;
+    } else {
+        pos = &idx->buckets[slot & REDIS_EXPIRE_INDEX_MASK];
+    }
+
+    info = dbEntryExpireInfo(de);
+    info->expire_next = *pos;
+    info->expire_pprev = pos;
+    if (*pos) dbEntryExpireInfo(*pos)->expire_pprev = &info->expire_next;
+    *pos = de;
+    idx->count++;
+}
+
+// 将节点从索引中移除
+void expireIndexDel(redisDb *db, dictEntry *de) {
+    dbExpireInfo *info;
+
+    if (db->expire_index == NULL) return;
+    info = dbEntryExpireInfo(de);
+    if (info == NULL || info->expire_pprev == NULL) return;
+
+    if (db->expire_index->resume == de)
+        db->expire_index->resume = info->expire_next;
+    *info->expire_pprev = info->expire_next;
+    if (info->expire_next)
+        dbEntryExpireInfo(info->expire_next)->expire_pprev =
+            info->expire_pprev;
+    info->expire_next = NULL;
+    info->expire_pprev = NULL;
+    db->expire_index->count--;
+}
+
+/* Called when the keyspace is emptied: the entries were already freed. */
+// 释放数据库的索引
+void expireIndexFlush(redisDb *db) {
+    if (db->expire_index == NULL) return;
+    zfree(db->expire_index->buckets);
+    zfree(db->expire_index);
+    db->expire_index = NULL;
+}
+
 // 移除过期 key
 int removeExpire(redisDb *db, robj *key) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
+
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    redisAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    redisAssertWithInfo(NULL,key,de != NULL);
+    if (dbEntryExpire(de) == -1) return 0;
+    expireIndexDel(db,de);
+    dbEntryClearExpire(de);
+    db->volatile_keys--;
+    return 1;
 }
 
 // 为 key 设置过期时间
 void setExpire(redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *de = dictFind(db->dict,key->ptr);
 
-    /* Reuse the sds from the main dict in the expire dict */
-    kde = dictFind(db->dict,key->ptr);
-    redisAssertWithInfo(NULL,key,kde != NULL);
-    de = dictReplaceRaw(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);
+    redisAssertWithInfo(NULL,key,de != NULL);
+    // 如果 key 已经有过期时间，那么先将它从索引中移除
+    if (dbEntryExpire(de) != -1)
+        expireIndexDel(db,de);
+    else
+        db->volatile_keys++;
+    dbEntrySetExpire(de,when);
+    expireIndexAdd(db,de);
 }
 
 /* Return the expire time of the specified key, or -1 if no expire
@@ -509,13 +1361,68 @@ long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+    if (db->volatile_keys == 0 ||
+       (de = dictFind(db->dict,key->ptr)) == NULL) return -1;
+
+    return dbEntryExpire(de);
+}
+
+/* dbSampleVolatileKeys() with the deadline index: maximum number of buckets
+ * probed by a single call, and maximum number of steps taken into the
+ * chain of a bucket to pick the sampled entry. */
+// 使用过期时间索引取样时，每次调用最多检查的桶数量
+#define REDIS_EXPIRE_INDEX_SAMPLE_PROBES 64
+// 在桶的链表中随机前进的最大步数
+#define REDIS_EXPIRE_INDEX_SAMPLE_WALK 16
+
+/* Store in 'des' up to 'count' random entries of keys of 'db' having an
+ * expire set, and return the number of entries stored.
+ *
+ * With the deadline index every sample is taken from a different random
+ * bucket, at a random (bounded) position of its chain, so the samples are
+ * not biased toward keys with similar expire times. At most
+ * REDIS_EXPIRE_INDEX_SAMPLE_PROBES buckets are probed: if they are all
+ * empty (few volatile keys spread over the wheel) the keyspace is sampled
+ * instead. Without the index the keyspace is sampled and the persistent
+ * keys are discarded, so less than 'count' entries may be returned even if
+ * there are enough volatile keys. */
+// 随机取出最多 count 个带有过期时间的 key 的节点，返回取出节点的数量
+unsigned int dbSampleVolatileKeys(redisDb *db, dictEntry **des, unsigned int count) {
+    unsigned int stored = 0, j, n;
+
+    if (db->volatile_keys == 0) return 0;
+
+    if (db->expire_index) {
+        unsigned int probes = REDIS_EXPIRE_INDEX_SAMPLE_PROBES, steps;
+        dictEntry *head, *de;
+
+        // 每个样本都从一个随机的桶中取出
+        while (stored < count && probes--) {
+            head = db->expire_index->buckets[dictRandom() &
+                                             REDIS_EXPIRE_INDEX_MASK];
+            if (head == NULL) continue;
+
+            // 在链表中随机前进几步，到达链表末尾时回到表头
+            de = head;
+            steps = dictRandom() % REDIS_EXPIRE_INDEX_SAMPLE_WALK;
+            while (steps--) {
+                de = dbEntryExpireInfo(de)->expire_next;
+                if (de == NULL) de = head;
+            }
+
+            // 同一个 key 只取一次
+            for (j = 0; j < stored; j++)
+                if (des[j] == de) break;
+            if (j == stored) des[stored++] = de;
+        }
+        if (stored) return stored;
+    }
 
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    redisAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+    n = dictGetSomeKeys(db->dict,des,count);
+    // 丢弃没有过期时间的 key
+    for (j = 0; j < n; j++)
+        if (dbEntryExpire(des[j]) != -1) des[stored++] = des[j];
+    return stored;
 }
 
 /* Propagate expires into slaves and the AOF file.
@@ -544,9 +1451,10 @@ void propagateExpire(redisDb *db, robj *key) {
     decrRefCount(argv[1]);
 }
 
-// 如果条件允许，就删除过期 key 
-int expireIfNeeded(redisDb *db, robj *key) {
-    long long when = getExpire(db,key);
+/* Like expireIfNeeded(), for a key whose entry 'de' was already found. */
+// 如果条件允许，就删除过期 key ，de 为 key 在键空间中的节点
+static int expireEntryIfNeeded(redisDb *db, robj *key, dictEntry *de) {
+    long long when = dbEntryExpire(de), now;
 
     // 没有过期时间
     if (when < 0) return 0; /* No expire for this key */
@@ -555,6 +1463,8 @@ int expireIfNeeded(redisDb *db, robj *key) {
     // 服务器处于 loading 状态
     if (server.loading) return 0;
 
+    now = commandTimeSnapshot();
+
     /* If we are running in the context of a slave, return ASAP:
      * the slave key expiration is controlled by the master that will
      * send us synthesized DEL operations for expired keys.
@@ -564,12 +1474,12 @@ int expireIfNeeded(redisDb *db, robj *key) {
      * we think the key is expired at this time. */
     // 这是一个 slave ，不必自己 expire key
     if (server.masterhost != NULL) {
-        return mstime() > when;
+        return now > when;
     }
 
     /* Return when this key has not expired */
     // key 未过期
-    if (mstime() <= when) return 0;
+    if (now <= when) return 0;
 
     /* Delete the key */
     server.stat_expiredkeys++;
@@ -577,6 +1487,73 @@ int expireIfNeeded(redisDb *db, robj *key) {
     return dbDelete(db,key);
 }
 
+// 如果条件允许，就删除过期 key 
+int expireIfNeeded(redisDb *db, robj *key) {
+    dictEntry *de;
+
+    if (db->volatile_keys == 0 ||
+        (de = dictFind(db->dict,key->ptr)) == NULL) return 0;
+    return expireEntryIfNeeded(db,key,de);
+}
+
+/* Active expiration using the deadline index: delete the keys of 'db' whose
+ * expire time is not after 'now', visiting at most 'effort' entries of the
+ * index, and return the number of keys deleted. Only the time slots that
+ * are entirely in the past are processed, so a key may be reclaimed up to
+ * one slot late (it is still expired on access by expireIfNeeded()).
+ * Like activeExpireCycle(), this must only be called by masters. */
+// 使用过期时间索引删除已经过期的 key ，最多检查 effort 个节点，
+// 返回被删除 key 的数量
+long dbReclaimExpiredKeys(redisDb *db, long long now, long effort) {
+    expireIndex *idx = db->expire_index;
+    long long nowslot = now >> REDIS_EXPIRE_INDEX_SHIFT;
+    long deleted = 0;
+
+    if (idx == NULL) return 0;
+
+    /* After a long pause a single round of the wheel visits every key. */
+    // 落后超过一圈时，只需要处理一圈
+    if (nowslot - idx->clock > REDIS_EXPIRE_INDEX_BUCKETS) {
+        idx->clock = nowslot - REDIS_EXPIRE_INDEX_BUCKETS;
+        idx->resume = NULL;
+    }
+
+    while (idx->clock < nowslot) {
+        dictEntry *de = idx->resume ? idx->resume :
+                        idx->buckets[idx->clock & REDIS_EXPIRE_INDEX_MASK];
+
+        while (de != NULL && effort > 0) {
+            dictEntry *next = dbEntryExpireInfo(de)->expire_next;
+
+            effort--;
+            if (dbEntryExpire(de) <= now) {
+                sds key = dictGetKey(de);
+                robj *keyobj = createStringObject(key,sdslen(key));
+
+                idx->resume = next;
+                server.stat_expiredkeys++;
+                propagateExpire(db,keyobj);
+                dbDelete(db,keyobj);
+                decrRefCount(keyobj);
+                deleted++;
+            }
+            de = next;
+        }
+
+        // 检查次数用完，下次从这个节点继续
+        if (de != NULL) {
+            idx->resume = de;
+            break;
+        }
+
+        // 这个时间槽已经处理完毕
+        idx->resume = NULL;
+        idx->clock++;
+        if (effort == 0) break;
+    }
+    return deleted;
+}
+
 /*-----------------------------------------------------------------------------
  * Expires Commands
  *----------------------------------------------------------------------------*/
@@ -611,7 +1588,7 @@ void expireGenericCommand(redisClient *c, long long basetime, int unit) {
      *
      * Instead we take the other branch of the IF statement setting an expire
      * (possibly in the past) and wait for an explicit DEL from the master. */
-    if (when <= mstime() && !server.loading && !server.masterhost) {
+    if (when <= commandTimeSnapshot() && !server.loading && !server.masterhost) {
         // 删除过期 key 
         robj *aux;
 
@@ -636,7 +1613,7 @@ void expireGenericCommand(redisClient *c, long long basetime, int unit) {
 }
 
 void expireCommand(redisClient *c) {
-    expireGenericCommand(c,mstime(),UNIT_SECONDS);
+    expireGenericCommand(c,commandTimeSnapshot(),UNIT_SECONDS);
 }
 
 void expireatCommand(redisClient *c) {
@@ -644,7 +1621,7 @@ void expireatCommand(redisClient *c) {
 }
 
 void pexpireCommand(redisClient *c) {
-    expireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+    expireGenericCommand(c,commandTimeSnapshot(),UNIT_MILLISECONDS);
 }
 
 void pexpireatCommand(redisClient *c) {
@@ -656,7 +1633,7 @@ void ttlGenericCommand(redisClient *c, int output_ms) {
 
     expire = getExpire(c->db,c->argv[1]);
     if (expire != -1) {
-        ttl = expire-mstime();
+        ttl = expire-commandTimeSnapshot();
         if (ttl < 0) ttl = -1;
     }
     if (ttl == -1) {
@@ -691,6 +1668,224 @@ void persistCommand(redisClient *c) {
     }
 }
 
+/*-----------------------------------------------------------------------------
+ * Eviction pool
+ *
+ * freeMemoryIfNeeded() uses dbEvictionCandidate() in order to select the
+ * key to evict with the LRU, LFU and TTL policies. Instead of evicting the
+ * best key among a few random samples, a persistent pool of the best
+ * candidates found so far is kept across calls: every call adds
+ * maxmemory_samples new samples per DB to the pool, and the best key of the
+ * pool is evicted. This approximates the ideal algorithm much better for
+ * the same number of samples.
+ *----------------------------------------------------------------------------*/
+
+// 候选池的大小
+#define REDIS_EVPOOL_SIZE 16
+// 长度不超过这个值的 key 保存在预先分配的 sds 中，避免频繁的内存分配
+#define REDIS_EVPOOL_CACHED_SDS_SIZE 255
+// 单次采样的最大 key 数量
+#define REDIS_EVPOOL_MAX_SAMPLES 64
+
+// 候选池中的一项
+struct evictionPoolEntry {
+    // 对象的分数，分数越大越适合被删除
+    // LRU 策略下为空转时间，LFU 策略下为 255 减去访问频率，
+    // TTL 策略下为 ULLONG_MAX 减去过期时间
+    unsigned long long idle;
+    // 候选 key ，为 NULL 表示这一项为空
+    sds key;
+    // 预先分配的 sds ，用于保存较短的 key
+    sds cached;
+    // key 所在的数据库
+    int dbid;
+};
+
+// 候选池，各项按分数从小到大排列
+static struct evictionPoolEntry *EvictionPool = NULL;
+
+/* Create a new eviction pool. */
+// 创建候选池
+static void evictionPoolAlloc(void) {
+    struct evictionPoolEntry *ep;
+    int j;
+
+    ep = zmalloc(sizeof(*ep)*REDIS_EVPOOL_SIZE);
+    for (j = 0; j < REDIS_EVPOOL_SIZE; j++) {
+        ep[j].idle = 0;
+        ep[j].key = NULL;
+        ep[j].cached = sdsMakeRoomFor(sdsempty(),REDIS_EVPOOL_CACHED_SDS_SIZE);
+        ep[j].dbid = 0;
+    }
+    EvictionPool = ep;
+}
+
+/* Return the eviction score of the object 'o' according to the current
+ * maxmemory policy: the bigger the score, the better candidate the key
+ * is. 'de' is the entry of the key in the keyspace. */
+// 根据 maxmemory 策略，返回对象的删除分数
+static unsigned long long evictionScore(robj *o, dictEntry *de) {
+    int policy = server.maxmemory_policy;
+
+    if (policy == REDIS_MAXMEMORY_VOLATILE_TTL)
+        return ULLONG_MAX - (unsigned long long) dbEntryExpire(de);
+
+    // 带标记的整数不记录访问信息，只在没有其他候选 key 时才会被删除
+    if (objectIsTaggedInt(o)) return 0;
+
+    if (maxmemoryPolicyIsLFU(policy))
+        return REDIS_LFU_COUNTER_MAX - LFUDecrAndReturn(o);
+    return estimateObjectIdleTime(o);
+}
+
+/* Sample keys from 'db' and add them to the pool if they are better
+ * candidates than the ones already there. If 'volatile_only' is true only
+ * keys with an expire set are sampled. */
+// 从数据库中采样 key ，并将比池中已有的 key 更好的候选 key 放入池中
+static void evictionPoolPopulate(redisDb *db, int volatile_only) {
+    struct evictionPoolEntry *pool = EvictionPool;
+    dictEntry *samples[REDIS_EVPOOL_MAX_SAMPLES];
+    unsigned int count, j;
+    int k;
+
+    count = server.maxmemory_samples;
+    if (count > REDIS_EVPOOL_MAX_SAMPLES) count = REDIS_EVPOOL_MAX_SAMPLES;
+    /* Sample a window of contiguous buckets in a single pass: this is
+     * much faster than calling dictGetRandomKey() once per sample, and
+     * does not spin on sparse tables. */
+    // 一次取出多个连续的节点作为样本
+    if (volatile_only)
+        count = dbSampleVolatileKeys(db,samples,count);
+    else
+        count = dictGetSomeKeys(db->dict,samples,count);
+
+    for (j = 0; j < count; j++) {
+        unsigned long long idle;
+        dictEntry *de = samples[j];
+        sds key = dictGetKey(de);
+
+        idle = evictionScore(dictGetVal(de),de);
+
+        /* Find the first empty bucket or the first populated bucket that
+         * has an idle time smaller than our idle time. */
+        // 找到第一个空项，或者第一个分数不小于 idle 的项
+        k = 0;
+        while (k < REDIS_EVPOOL_SIZE && pool[k].key &&
+               pool[k].idle < idle) k++;
+
+        if (k == 0 && pool[REDIS_EVPOOL_SIZE-1].key != NULL) {
+            /* Can't insert if the element is < the worst element we have
+             * and there are no empty buckets. */
+            // 池已满，并且这个 key 比池中所有 key 都差
+            continue;
+        } else if (k < REDIS_EVPOOL_SIZE && pool[k].key == NULL) {
+            /* Inserting into empty position. No setup needed before insert. */
+        } else {
+            /* Inserting in the middle. Now k points to the first element
+             * greater than the element to insert.  */
+            if (pool[REDIS_EVPOOL_SIZE-1].key == NULL) {
+                /* Free space on the right? Insert at k shifting
+                 * all the elements from k to end to the right. */
+                // 右边有空位，将 k 及其后面的项右移
+                sds cached = pool[REDIS_EVPOOL_SIZE-1].cached;
+                memmove(pool+k+1,pool+k,
+                    sizeof(pool[0])*(REDIS_EVPOOL_SIZE-k-1));
+                pool[k].cached = cached;
+            } else {
+                /* No free space on right? Insert at k-1 */
+                // 没有空位，丢弃最左边（最差）的项，将 k 之前的项左移
+                sds cached = pool[0].cached;
+
+                k--;
+                if (pool[0].key != pool[0].cached) sdsfree(pool[0].key);
+                memmove(pool,pool+1,sizeof(pool[0])*k);
+                pool[k].cached = cached;
+            }
+        }
+
+        /* Try to reuse the cached SDS string allocated in the pool entry,
+         * because allocating and deallocating this object is costly. */
+        // 尽量使用预先分配的 sds 保存 key
+        if (sdslen(key) > REDIS_EVPOOL_CACHED_SDS_SIZE) {
+            pool[k].key = sdsdup(key);
+        } else {
+            // cached 有足够的预留空间，所以 sdscpylen 不会重新分配内存
+            pool[k].cached = sdscpylen(pool[k].cached,key,sdslen(key));
+            pool[k].key = pool[k].cached;
+        }
+        pool[k].idle = idle;
+        pool[k].dbid = db->id;
+    }
+}
+
+/* Return the best key to evict according to the current maxmemory policy
+ * (that must be one of the LRU, LFU or TTL policies) as a new string
+ * object, storing the DB it belongs to in '*dbp'. NULL is returned if
+ * there are no keys to evict. */
+// 根据 maxmemory 策略，返回最适合被删除的 key ，并将它所在的数据库保存到 *dbp
+// 没有可以删除的 key 时返回 NULL
+robj *dbEvictionCandidate(redisDb **dbp) {
+    struct evictionPoolEntry *pool;
+    int volatile_only, j, k;
+
+    if (EvictionPool == NULL) evictionPoolAlloc();
+    pool = EvictionPool;
+    volatile_only = server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU ||
+                    server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LFU ||
+                    server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_TTL;
+
+    while (1) {
+        unsigned long total_keys = 0;
+
+        /* We don't want to make local-db choices when expiring keys,
+         * so to start populate the eviction pool sampling keys from
+         * every DB. */
+        // 从所有数据库中采样
+        for (j = 0; j < server.dbnum; j++) {
+            redisDb *db = server.db+j;
+            unsigned long keys = volatile_only ? db->volatile_keys :
+                                                 dictSize(db->dict);
+
+            if (keys) {
+                evictionPoolPopulate(db,volatile_only);
+                total_keys += keys;
+            }
+        }
+        if (total_keys == 0) return NULL;
+
+        /* Go backward from best to worst element to evict. */
+        // 从分数最大的项开始，找到一个仍然存在的 key
+        for (k = REDIS_EVPOOL_SIZE-1; k >= 0; k--) {
+            redisDb *db;
+            dictEntry *de;
+            robj *keyobj;
+
+            if (pool[k].key == NULL) continue;
+            db = server.db+pool[k].dbid;
+            de = dictFind(db->dict,pool[k].key);
+            // 在挑选之后过期时间被移除的 key 不再是候选 key
+            if (de && volatile_only && dbEntryExpire(de) == -1) de = NULL;
+
+            /* Remove the entry from the pool. */
+            // 从池中移除这一项
+            keyobj = de ? createStringObject(pool[k].key,sdslen(pool[k].key))
+                        : NULL;
+            if (pool[k].key != pool[k].cached) sdsfree(pool[k].key);
+            pool[k].key = NULL;
+            pool[k].idle = 0;
+
+            /* If the key exists, is our pick. Otherwise it is a ghost
+             * and we try the next element. */
+            // key 已经被删除了，尝试下一项
+            if (keyobj) {
+                *dbp = db;
+                return keyobj;
+            }
+        }
+        // 池中所有的 key 都已不存在，重新采样
+    }
+}
+
 /* -----------------------------------------------------------------------------
  * API to get key arguments from commands
  * ---------------------------------------------------------------------------*/
@@ -753,8 +1948,11 @@ int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *num
 
     num = atoi(argv[2]->ptr);
     /* Sanity check. Don't return any key if the command is going to
-     * reply with syntax error. */
-    if (num > (argc-3)) {
+     * reply with syntax error. This is also called for queued commands
+     * that were not executed yet (see execPrefetchKeys() in multi.c), so
+     * a zero or negative numkeys must not reach zmalloc(). */
+    // numkeys 不合法时不返回任何 key
+    if (num < 1 || num > (argc-3)) {
         *numkeys = 0;
         return NULL;
     }
@@ -766,32 +1964,69 @@ int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *num
 
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
- * while rehashing the cluster. */
-void SlotToKeyAdd(robj *key) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-
-    zslInsert(server.cluster.slots_to_keys,hashslot,key);
-    incrRefCount(key);
+ * while rehashing the cluster.
+ *
+ * The keys of every slot are linked in a doubly linked list, whose pointers
+ * are stored in the metadata of the dictEntry of the key in the keyspace
+ * (see dbEntryMetadata), so adding and removing a key is O(1) and does not
+ * allocate memory. */
+// 槽到 key 的索引，每个槽的 key 被连接成一个双向链表，
+// 链表的指针保存在键空间字典节点的附加数据中
+
+// 将 key 的字典节点添加到它所属的槽的链表头
+void slotToKeyAddEntry(dictEntry *de) {
+    sds key = dictGetKey(de);
+    unsigned int hashslot = keyHashSlot(key,sdslen(key));
+    slotToKeys *slot = &server.cluster.slots_to_keys[hashslot];
+    dbEntryMetadata *meta = dbEntryMeta(de);
+
+    meta->slot_prev = NULL;
+    meta->slot_next = slot->head;
+    if (slot->head) dbEntryMeta(slot->head)->slot_prev = de;
+    slot->head = de;
+    slot->count++;
 }
 
-void SlotToKeyDel(robj *key) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
+// 将 key 的字典节点从它所属的槽的链表中移除
+void slotToKeyDelEntry(dictEntry *de) {
+    sds key = dictGetKey(de);
+    unsigned int hashslot = keyHashSlot(key,sdslen(key));
+    slotToKeys *slot = &server.cluster.slots_to_keys[hashslot];
+    dbEntryMetadata *meta = dbEntryMeta(de);
+
+    if (meta->slot_prev)
+        dbEntryMeta(meta->slot_prev)->slot_next = meta->slot_next;
+    else
+        slot->head = meta->slot_next;
+    if (meta->slot_next)
+        dbEntryMeta(meta->slot_next)->slot_prev = meta->slot_prev;
+    slot->count--;
+}
 
-    zslDelete(server.cluster.slots_to_keys,hashslot,key);
+/* Called when the keyspace is emptied: the entries were already freed. */
+// 清空所有槽的链表
+void slotToKeyFlush(void) {
+    memset(server.cluster.slots_to_keys,0,
+           sizeof(server.cluster.slots_to_keys));
 }
 
-unsigned int GetKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    zskiplistNode *n;
-    zrangespec range;
+/* Store in 'keys' up to 'count' keys of the specified hash slot, and return
+ * the number of keys stored. The keys are the sds strings of the keyspace:
+ * they must not be freed, and are only valid until the key is deleted. */
+// 返回槽中最多 count 个 key ，
+// 返回的 key 属于键空间，调用者不能释放它们
+unsigned int GetKeysInSlot(unsigned int hashslot, sds *keys, unsigned int count) {
+    dictEntry *de = server.cluster.slots_to_keys[hashslot].head;
     int j = 0;
 
-    range.min = range.max = hashslot;
-    range.minex = range.maxex = 0;
-    
-    n = zslFirstInRange(server.cluster.slots_to_keys, range);
-    while(n && n->score == hashslot && count--) {
-        keys[j++] = n->obj;
-        n = n->level[0].forward;
+    while(de && count--) {
+        keys[j++] = dictGetKey(de);
+        de = dbEntryMeta(de)->slot_next;
     }
     return j;
 }
+
+// 返回槽中 key 的数量
+unsigned int CountKeysInSlot(unsigned int hashslot) {
+    return server.cluster.slots_to_keys[hashslot].count;
+}
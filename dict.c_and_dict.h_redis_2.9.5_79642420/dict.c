@@ -104,6 +104,40 @@ unsigned int dictGetHashFunctionSeed(void) {
     return dict_hash_function_seed;
 }
 
+/* Pseudo random numbers for the randomized algorithms of the hash table,
+ * also used by other modules (for instance for the skiplist levels).
+ * random() takes a lock shared by all the threads, so every thread uses
+ * its own xorshift64* generator instead. The state is seeded lazily from
+ * the clock and the address of the state itself, that is different for
+ * every thread, unless dictSetRandomSeed() is used to get a reproducible
+ * sequence in the calling thread (for tests and benchmarks). */
+/* 每个线程都有自己的 xorshift64* 随机数生成器，
+ * 调用 dictSetRandomSeed() 可以让当前线程生成可重现的随机数序列 */
+static __thread uint64_t dict_random_state = 0;
+
+void dictSetRandomSeed(uint64_t seed) {
+    /* The state of xorshift must not be zero. */
+    dict_random_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+uint64_t dictRandom(void) {
+    uint64_t x = dict_random_state;
+
+    if (x == 0) {
+        struct timeval tv;
+
+        gettimeofday(&tv,NULL);
+        dictSetRandomSeed(((uint64_t)tv.tv_sec*1000000+tv.tv_usec) ^
+                          ((uint64_t)(uintptr_t)&dict_random_state << 16));
+        x = dict_random_state;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    dict_random_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
 /* Generic hash function (a popular one from Bernstein).
  * I tested a few and this was the best. */
 unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
@@ -356,6 +390,7 @@ dictEntry *dictAddRaw(dict *d, void *key)
     int index;
     dictEntry *entry;
     dictht *ht;
+    size_t metasize = dictMetadataSize(d);
 
     // 检查字典(的哈希表)能否执行 rehash 操作
     // 如果可以的话，执行平摊 rehash 操作
@@ -370,7 +405,8 @@ dictEntry *dictAddRaw(dict *d, void *key)
     // 否则，使用 0 号哈希表
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
 
-    entry = zmalloc(sizeof(*entry));    // 为新节点分配内存
+    entry = zmalloc(sizeof(*entry)+metasize);   // 为新节点分配内存
+    if (metasize > 0) memset(dictMetadata(entry),0,metasize);
     entry->next = ht->table[index];     // 调整节点的 next 指针
     ht->table[index] = entry;           // 然后将新节点设为链头
     ht->used++;                         // 更新正在使用的节点数量
@@ -422,18 +458,17 @@ dictEntry *dictReplaceRaw(dict *d, void *key) {
     return entry ? entry : dictAddRaw(d,key);
 }
 
-/* 删除指定元素的底层实现代码
+/* 从字典中解除指定元素的链接，但不释放它
  *
  * Args:
  *  d
  *  key
- *  nofree 指示是否释放被删除元素的键和值
  *
  * Returns:
- *  DICT_ERR 字典为空，删除失败
- *  DICT_OK 删除成功
+ *  NULL 字典为空，或者元素不存在
+ *  he 被解除链接的节点，它的键和值都没有被释放
  */
-static int dictGenericDelete(dict *d, const void *key, int nofree)
+static dictEntry *dictGenericDelete(dict *d, const void *key)
 {
     unsigned int h, idx;
     dictEntry *he, *prevHe;
@@ -441,7 +476,7 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
 
     // 字典为空，删除失败
     if (d->ht[0].size == 0)
-        return DICT_ERR;
+        return NULL;
 
     // 平摊 rehash
     if (dictIsRehashing(d))
@@ -463,15 +498,9 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
                 else
                     d->ht[table].table[idx] = he->next;
 
-                if (!nofree) {
-                    dictFreeKey(d, he);
-                    dictFreeVal(d, he);
-                }
-
-                zfree(he);
                 d->ht[table].used--;
 
-                return DICT_OK;
+                return he;
             }
             // 推进指针
             prevHe = he;
@@ -480,15 +509,73 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
         if (!dictIsRehashing(d)) break;
     }
 
-    return DICT_ERR; /* not found */
+    return NULL; /* not found */
 }
 
 int dictDelete(dict *ht, const void *key) {
-    return dictGenericDelete(ht,key,0);
+    dictEntry *he = dictGenericDelete(ht,key);
+
+    if (he == NULL) return DICT_ERR;
+    dictFreeUnlinkedEntry(ht,he);
+    return DICT_OK;
 }
 
 int dictDeleteNoFree(dict *ht, const void *key) {
-    return dictGenericDelete(ht,key,1);
+    dictEntry *he = dictGenericDelete(ht,key);
+
+    if (he == NULL) return DICT_ERR;
+    dictFreeMetadata(ht, he);
+    zfree(he);
+    return DICT_OK;
+}
+
+/* Remove the element from the table without freeing it, and return it, so
+ * that the caller can still use the entry (for instance its metadata)
+ * before releasing it with dictFreeUnlinkedEntry(). This avoids a second
+ * lookup compared to dictFind() followed by dictDelete().
+ * NULL is returned if the key was not found. */
+// 从字典中解除元素的链接并返回它，调用者用完之后，
+// 需要调用 dictFreeUnlinkedEntry() 来释放它
+dictEntry *dictUnlink(dict *ht, const void *key) {
+    return dictGenericDelete(ht,key);
+}
+
+/* Free the key, the value and the entry returned by dictUnlink().
+ * It's safe to call this function with 'he' = NULL. */
+// 释放 dictUnlink() 返回的节点，以及它的键和值
+void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
+    if (he == NULL) return;
+    dictFreeKey(d, he);
+    dictFreeVal(d, he);
+    dictFreeMetadata(d, he);
+    zfree(he);
+}
+
+/* Link the entry 'he', returned by dictUnlink() on this dictionary or on
+ * another dictionary of the same type, into 'd'. The value and the metadata
+ * of the entry are preserved. The key may be changed with dictSetKey()
+ * while the entry is unlinked, so renaming a key, or moving it to another
+ * dictionary, doesn't free or allocate the entry.
+ *
+ * Returns DICT_ERR, leaving the entry unlinked, if the key of the entry
+ * already exists in 'd'. */
+// 将 dictUnlink() 返回的节点连接到字典中，节点的值和附加数据保持不变
+int dictRelink(dict *d, dictEntry *he)
+{
+    int index;
+    dictht *ht;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    // 计算索引，同时检查 key 是否已经存在
+    if ((index = _dictKeyIndex(d, he->key)) == -1)
+        return DICT_ERR;
+
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    he->next = ht->table[index];
+    ht->table[index] = he;
+    ht->used++;
+    return DICT_OK;
 }
 
 /* 删除字典中指定的哈希表
@@ -520,6 +607,7 @@ int _dictClear(dict *d, dictht *ht)
 
             dictFreeKey(d, he); // 释放 key 空间
             dictFreeVal(d, he); // 释放 value 空间
+            dictFreeMetadata(d, he); // 释放附加数据引用的内存
             zfree(he);          // 释放节点
 
             ht->used--;         // 减少计数器
@@ -699,13 +787,13 @@ dictEntry *dictGetRandomKey(dict *d)
     if (dictIsRehashing(d)) _dictRehashStep(d);
     if (dictIsRehashing(d)) {
         do {
-            h = random() % (d->ht[0].size+d->ht[1].size);
+            h = dictRandom() % (d->ht[0].size+d->ht[1].size);
             he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
                                       d->ht[0].table[h];
         } while(he == NULL);
     } else {
         do {
-            h = random() & d->ht[0].sizemask;
+            h = dictRandom() & d->ht[0].sizemask;
             he = d->ht[0].table[h];
         } while(he == NULL);
     }
@@ -720,12 +808,217 @@ dictEntry *dictGetRandomKey(dict *d)
         he = he->next;
         listlen++;
     }
-    listele = random() % listlen;
+    listele = dictRandom() % listlen;
     he = orighe;
     while(listele--) he = he->next;
     return he;
 }
 
+/* This function samples the dictionary to return a few keys from random
+ * locations.
+ *
+ * It does not guarantee to return all the keys specified in 'count', nor
+ * it does guarantee to return non-duplicated elements, however it will make
+ * some effort to do both things.
+ *
+ * Returned pointers to hash table entries are stored into 'des' that
+ * points to an array of dictEntry pointers. The array must have room for
+ * at least 'count' elements, that is the argument we pass to the function
+ * to tell how many random elements we need.
+ *
+ * The function returns the number of items stored into 'des', that may
+ * be less than 'count' if the hash table has less than 'count' elements
+ * inside, or if not enough elements were found in a reasonable amount of
+ * steps.
+ *
+ * Note that this function is not suitable when you need a good distribution
+ * of the returned items, but only when you need to "sample" a given number
+ * of continuous elements to run some kind of algorithm or to produce
+ * statistics. However the function is much faster than dictGetRandomKey()
+ * at producing N elements: a single random bucket is selected, then the
+ * following buckets are visited in order, collecting whole chains. */
+/* 从一个随机位置开始，顺序访问连续的桶，批量取出最多 count 个节点
+ * 访问的桶数量被限制为 count*10 ，所以在稀疏的哈希表上也不会空转 */
+unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count)
+{
+    unsigned int j; /* internal hash table id, 0 or 1. */
+    unsigned int tables; /* 1 or 2 tables? */
+    unsigned int stored = 0, maxsizemask;
+    unsigned int maxsteps;
+
+    if (dictSize(d) < count) count = dictSize(d);
+    maxsteps = count*10;
+
+    /* Try to do a rehashing work proportional to 'count'. */
+    for (j = 0; j < count; j++) {
+        if (dictIsRehashing(d))
+            _dictRehashStep(d);
+        else
+            break;
+    }
+
+    tables = dictIsRehashing(d) ? 2 : 1;
+    maxsizemask = d->ht[0].sizemask;
+    if (tables > 1 && maxsizemask < d->ht[1].sizemask)
+        maxsizemask = d->ht[1].sizemask;
+
+    /* Pick a random point inside the larger table. */
+    unsigned int i = dictRandom() & maxsizemask;
+    unsigned int emptylen = 0; /* Continuous empty entries so far. */
+    while(stored < count && maxsteps--) {
+        for (j = 0; j < tables; j++) {
+            /* Invariant of the dict.c rehashing: up to the indexes already
+             * visited in ht[0] during the rehashing, there are no populated
+             * buckets, so we can skip ht[0] for indexes between 0 and idx-1. */
+            if (tables == 2 && j == 0 && i < (unsigned int) d->rehashidx) {
+                /* Moreover, if we are currently out of range in the second
+                 * table, there will be no elements in both tables up to
+                 * the current rehashing index, so we jump if possible.
+                 * (this happens when going from big to small table). */
+                if (i >= d->ht[1].size) i = d->rehashidx;
+                continue;
+            }
+            if (i >= d->ht[j].size) continue; /* Out of range for this table. */
+            dictEntry *he = d->ht[j].table[i];
+
+            /* Count contiguous empty buckets, and jump to other
+             * locations if they reach 'count' (with a minimum of 5). */
+            if (he == NULL) {
+                emptylen++;
+                if (emptylen >= 5 && emptylen > count) {
+                    i = dictRandom() & maxsizemask;
+                    emptylen = 0;
+                }
+            } else {
+                emptylen = 0;
+                while (he) {
+                    /* Collect all the elements of the buckets found non
+                     * empty while iterating. */
+                    *des = he;
+                    des++;
+                    he = he->next;
+                    stored++;
+                    if (stored == count) return stored;
+                }
+            }
+        }
+        i = (i+1) & maxsizemask;
+    }
+    return stored;
+}
+
+/* Return a random entry from the hash table, selected with uniform
+ * probability among all the entries.
+ *
+ * dictGetRandomKey() picks a random non empty bucket and then a random
+ * element of its chain, so elements living in short chains are returned
+ * more often than elements living in long chains. Here instead a random
+ * bucket and a random position in [0, chainlen) are picked, and the pick
+ * is rejected if the bucket has no element at that position: every element
+ * has exactly the same probability of being selected, as long as no chain
+ * is longer than 'chainlen'. Since the chains get longer as the load factor
+ * grows, 'chainlen' is DICT_FAIR_CHAIN_LEN for load factors >= 1 and is
+ * reduced for sparse tables, where a big value would reject almost every
+ * pick while chains longer than a couple of elements are very unlikely.
+ *
+ * To bound the work on very sparse tables, after DICT_FAIR_MAX_TRIES
+ * rejected picks we fall back to a random element among the ones returned
+ * by dictGetSomeKeys(), that is not perfectly uniform but cheap. */
+/* 以均匀的概率随机返回哈希表中的一个节点
+ * 通过拒绝采样消除 dictGetRandomKey() 偏向短链表节点的问题，
+ * 重试次数超过 DICT_FAIR_MAX_TRIES 时，退而从 dictGetSomeKeys() 的结果中随机选取 */
+dictEntry *dictGetFairRandomKey(dict *d)
+{
+    dictEntry *entries[DICT_FAIR_SAMPLES];
+    unsigned int count, tries;
+    unsigned long size, used;
+    int chainlen;
+
+    if (dictSize(d) == 0) return NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    /* 根据负载因子决定假设的最大链表长度 */
+    size = dictSlots(d);
+    used = dictSize(d);
+    if (used >= size)
+        chainlen = DICT_FAIR_CHAIN_LEN;
+    else if (used*2 >= size)
+        chainlen = DICT_FAIR_CHAIN_LEN/2;
+    else
+        chainlen = DICT_FAIR_CHAIN_LEN/4;
+
+    for (tries = 0; tries < DICT_FAIR_MAX_TRIES; tries++) {
+        unsigned long h;
+        int pos = dictRandom() % chainlen;
+        dictEntry *he;
+
+        h = dictRandom() % size;
+        he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
+                                    d->ht[0].table[h];
+        while (he && pos--) he = he->next;
+        if (he) return he;
+    }
+
+    count = dictGetSomeKeys(d,entries,DICT_FAIR_SAMPLES);
+    /* dictGetSomeKeys() may return zero elements in an unlucky run even
+     * if there are elements inside the hash table. */
+    if (count == 0) return dictGetRandomKey(d);
+    return entries[dictRandom() % count];
+}
+
+#if defined(__GNUC__)
+#define dictPrefetchAddr(addr) __builtin_prefetch(addr)
+#else
+#define dictPrefetchAddr(addr)
+#endif
+
+/* Prefetch the memory that looking up the 'count' keys is going to touch:
+ * the buckets, then the first entry of every bucket, then the key and the
+ * value of that entry. Each step is issued for a whole batch of keys before
+ * moving to the next one, so that the cache misses of the different keys
+ * overlap instead of being paid one after the other.
+ *
+ * The value is prefetched as a pointer even if it is an integer: a
+ * prefetch of an invalid address is harmless. */
+// 预取查找这些 key 时需要访问的内存：桶、桶中的第一个节点、节点的键和值
+void dictPrefetch(dict *d, void **keys, unsigned int count) {
+    dictEntry **buckets[DICT_PREFETCH_BATCH*2];
+    unsigned int done, n, nb, j, table;
+
+    if (dictSize(d) == 0) return;
+    for (done = 0; done < count; done += n) {
+        n = count-done;
+        if (n > DICT_PREFETCH_BATCH) n = DICT_PREFETCH_BATCH;
+
+        // 预取桶，正在 rehash 时两个哈希表都要预取
+        nb = 0;
+        for (j = 0; j < n; j++) {
+            unsigned int h = dictHashKey(d,keys[done+j]);
+
+            for (table = 0; table <= 1; table++) {
+                buckets[nb] = d->ht[table].table+(h & d->ht[table].sizemask);
+                dictPrefetchAddr(buckets[nb]);
+                nb++;
+                if (!dictIsRehashing(d)) break;
+            }
+        }
+
+        // 预取桶中的第一个节点
+        for (j = 0; j < nb; j++)
+            if (*buckets[j]) dictPrefetchAddr(*buckets[j]);
+
+        // 预取节点的键和值
+        for (j = 0; j < nb; j++) {
+            dictEntry *he = *buckets[j];
+
+            if (he) {
+                dictPrefetchAddr(he->key);
+                dictPrefetchAddr(he->v.val);
+            }
+        }
+    }
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
@@ -956,3 +1249,144 @@ dictType dictTypeHeapStringCopyKeyValue = {
     _dictStringDestructor,         /* val destructor */
 };
 #endif
+
+#ifdef DICT_BENCHMARK_MAIN
+
+#include <math.h>
+
+/* Compare dictGetRandomKey(), dictGetFairRandomKey() and dictGetSomeKeys()
+ * both on a full table and on a sparse table (after deleting most of the
+ * keys without resizing), reporting the time needed to sample the same
+ * number of entries and how uniform the selection is.
+ *
+ * Build with (from the Redis src directory):
+ *   gcc -DDICT_BENCHMARK_MAIN dict.c zmalloc.c -lm -o dict-benchmark */
+/* 随机取样函数的性能测试 */
+
+static unsigned int _dictBenchHashFunction(const void *key)
+{
+    return dictIntHashFunction((unsigned long) key);
+}
+
+static int _dictBenchKeyCompare(void *privdata, const void *key1,
+        const void *key2)
+{
+    DICT_NOTUSED(privdata);
+
+    return key1 == key2;
+}
+
+static dictType dictTypeBenchmark = {
+    _dictBenchHashFunction,        /* hash function */
+    NULL,                          /* key dup */
+    NULL,                          /* val dup */
+    _dictBenchKeyCompare,          /* key compare */
+    NULL,                          /* key destructor */
+    NULL,                          /* val destructor */
+    NULL,                          /* entry metadata bytes */
+    NULL                           /* entry metadata destructor */
+};
+
+#define BENCH_SAMPLES 1000000
+#define BENCH_BATCH 16
+
+/* Return the coefficient of variation (stddev/mean) of the number of
+ * times every live key was sampled. For a uniform selection it is about
+ * 1/sqrt(mean), since the hits of every key follow a Poisson distribution.
+ * Keys are 0 .. maxkey-1, only one key every 'step' is still live. */
+static double benchSpread(unsigned long *hits, unsigned long maxkey,
+                          unsigned long step, double *expected)
+{
+    unsigned long j, live = 0;
+    double sum = 0, sumsq = 0, mean;
+
+    for (j = 0; j < maxkey; j += step) {
+        sum += hits[j];
+        sumsq += (double)hits[j]*hits[j];
+        live++;
+    }
+    mean = sum/live;
+    *expected = 1/sqrt(mean);
+    return sqrt(sumsq/live - mean*mean)/mean;
+}
+
+static void benchRun(dict *d, unsigned long maxkey, unsigned long step,
+                     const char *label)
+{
+    double cv, expected;
+    unsigned long *hits = zcalloc(sizeof(unsigned long)*maxkey);
+    dictEntry *des[BENCH_BATCH];
+    long long start;
+    unsigned long j;
+
+    printf("%s (%lu elements, %lu buckets)\n", label,
+        (unsigned long) dictSize(d), (unsigned long) dictSlots(d));
+
+    start = timeInMilliseconds();
+    for (j = 0; j < BENCH_SAMPLES; j++)
+        hits[(unsigned long) dictGetKey(dictGetRandomKey(d))]++;
+    cv = benchSpread(hits,maxkey,step,&expected);
+    printf("  dictGetRandomKey:     %lld ms, stddev/mean %.3f (uniform %.3f)\n",
+        timeInMilliseconds()-start, cv, expected);
+
+    memset(hits,0,sizeof(unsigned long)*maxkey);
+    start = timeInMilliseconds();
+    for (j = 0; j < BENCH_SAMPLES; j++)
+        hits[(unsigned long) dictGetKey(dictGetFairRandomKey(d))]++;
+    cv = benchSpread(hits,maxkey,step,&expected);
+    printf("  dictGetFairRandomKey: %lld ms, stddev/mean %.3f (uniform %.3f)\n",
+        timeInMilliseconds()-start, cv, expected);
+
+    memset(hits,0,sizeof(unsigned long)*maxkey);
+    start = timeInMilliseconds();
+    for (j = 0; j < BENCH_SAMPLES; j += BENCH_BATCH) {
+        unsigned int count = dictGetSomeKeys(d,des,BENCH_BATCH), k;
+
+        for (k = 0; k < count; k++)
+            hits[(unsigned long) dictGetKey(des[k])]++;
+    }
+    printf("  dictGetSomeKeys(%d):  %lld ms\n", BENCH_BATCH,
+        timeInMilliseconds()-start);
+    zfree(hits);
+}
+
+/* Check that dictSetRandomSeed() makes the sampling reproducible: the same
+ * seed must select the same keys, in the same order. */
+static int benchSeedCheck(dict *d) {
+    dictEntry *first[BENCH_BATCH];
+    int j;
+
+    dictSetRandomSeed(1234);
+    for (j = 0; j < BENCH_BATCH; j++) first[j] = dictGetRandomKey(d);
+    dictSetRandomSeed(1234);
+    for (j = 0; j < BENCH_BATCH; j++)
+        if (dictGetRandomKey(d) != first[j]) return 0;
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long maxkey = argc > 1 ? strtoul(argv[1],NULL,10) : 100000;
+    dict *d = dictCreate(&dictTypeBenchmark,NULL);
+    unsigned long j;
+
+    for (j = 0; j < maxkey; j++)
+        dictAdd(d,(void*)j,NULL);
+    while (dictIsRehashing(d)) dictRehash(d,100);
+    if (!benchSeedCheck(d)) {
+        printf("dictSetRandomSeed(): the sampling is not reproducible\n");
+        return 1;
+    }
+    benchRun(d,maxkey,1,"Full table");
+
+    /* Delete 90% of the keys without allowing the table to shrink, so
+     * that most of the buckets are empty. */
+    dictDisableResize();
+    for (j = 0; j < maxkey; j++)
+        if (j % 10 != 0) dictDelete(d,(void*)j);
+    benchRun(d,maxkey,10,"Sparse table");
+
+    dictRelease(d);
+    return 0;
+}
+#endif
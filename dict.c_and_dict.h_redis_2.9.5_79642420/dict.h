@@ -43,6 +43,8 @@
 /* Unused arguments generate annoying warnings... */
 #define DICT_NOTUSED(V) ((void) V)
 
+struct dict;
+
 // 哈希表节点结构
 typedef struct dictEntry {
     void *key;              // 键
@@ -50,8 +52,12 @@ typedef struct dictEntry {
         void *val;
         uint64_t u64;
         int64_t s64;
+        double d;
     } v;                    // 值(可以有几种不同类型)
     struct dictEntry *next; // 指向下一个哈希节点(形成链表)
+    /* Extra bytes reserved by the dict type, see entryMetadataBytes. */
+    // 由字典类型决定大小的附加数据，新节点的附加数据会被清零
+    void *metadata[];
 } dictEntry;
 
 // 因为哈希表可以保存多种不同的值，
@@ -63,6 +69,14 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* Number of bytes of metadata allocated at the end of every entry,
+     * NULL means no metadata. */
+    // 每个节点附加数据的字节数，为 NULL 表示没有附加数据
+    size_t (*entryMetadataBytes)(struct dict *d);
+    /* Called before an entry is freed, to release the memory referenced
+     * by its metadata. NULL means nothing to release. */
+    // 在释放节点之前调用，释放附加数据引用的内存，为 NULL 表示不需要释放
+    void (*entryMetadataDestructor)(struct dict *d, dictEntry *de);
 } dictType;
 
 /* 哈希表结构
@@ -103,6 +117,17 @@ typedef struct dictIterator {
 // 哈希表的初始大小
 #define DICT_HT_INITIAL_SIZE     4
 
+// dictGetFairRandomKey() 所使用的参数
+// 拒绝采样时假设的最大链表长度（负载因子大于等于 1 时）
+#define DICT_FAIR_CHAIN_LEN      8
+// 拒绝采样的最大尝试次数
+#define DICT_FAIR_MAX_TRIES      100
+// 拒绝采样失败时，通过 dictGetSomeKeys() 取出的节点数量
+#define DICT_FAIR_SAMPLES        15
+
+// dictPrefetch() 每批处理的 key 数量
+#define DICT_PREFETCH_BATCH      16
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -122,6 +147,13 @@ typedef struct dictIterator {
 #define dictSetUnsignedIntegerVal(entry, _val_) \
     do { entry->v.u64 = _val_; } while(0)
 
+#define dictSetDoubleVal(entry, _val_) \
+    do { entry->v.d = _val_; } while(0)
+
+#define dictFreeMetadata(d, entry) \
+    if ((d)->type->entryMetadataDestructor) \
+        (d)->type->entryMetadataDestructor((d), (entry))
+
 #define dictFreeKey(d, entry) \
     if ((d)->type->keyDestructor) \
         (d)->type->keyDestructor((d)->privdata, (entry)->key)
@@ -145,9 +177,14 @@ typedef struct dictIterator {
 #define dictGetVal(he) ((he)->v.val)
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
+#define dictGetDoubleVal(he) ((he)->v.d)
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(ht) ((ht)->rehashidx != -1)
+// 节点附加数据的地址和大小
+#define dictMetadata(entry) (&(entry)->metadata)
+#define dictMetadataSize(d) ((d)->type->entryMetadataBytes \
+                             ? (d)->type->entryMetadataBytes(d) : 0)
 
 /* API */
 
@@ -159,6 +196,9 @@ int dictReplace(dict *d, void *key, void *val);
 dictEntry *dictReplaceRaw(dict *d, void *key);
 int dictDelete(dict *d, const void *key);
 int dictDeleteNoFree(dict *d, const void *key);
+dictEntry *dictUnlink(dict *d, const void *key);
+void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
+int dictRelink(dict *d, dictEntry *he);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
@@ -168,6 +208,8 @@ dictIterator *dictGetSafeIterator(dict *d);
 dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
+unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);
+dictEntry *dictGetFairRandomKey(dict *d);
 void dictPrintStats(dict *d);
 unsigned int dictGenHashFunction(const unsigned char *buf, int len);
 unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
@@ -178,6 +220,9 @@ int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
 void dictSetHashFunctionSeed(unsigned int initval);
 unsigned int dictGetHashFunctionSeed(void);
+void dictSetRandomSeed(uint64_t seed);
+uint64_t dictRandom(void);
+void dictPrefetch(dict *d, void **keys, unsigned int count);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
@@ -6,15 +6,24 @@
  *   // 其他属性 ...
  *   redisDb *db;                // 当前 DB
  *   multiState mstate;          // 事务中的所有命令
- *   list *watched_keys;         // 这个客户端 WATCH 的所有 KEY
+ *   dict *watched_keys;         // 这个客户端 WATCH 的所有 KEY （watchedKey 集合）
  *   // 其他属性 ...
  * } redisClient;
  *
+ * networking.c 的 createClient() 使用
+ * dictCreate(&clientWatchedKeysDictType,NULL) 创建 c->watched_keys ，
+ * freeClient() 在 unwatchAllKeys() 之后使用 dictRelease() 释放它
+ *
  * typedef struct multiState {
  *   multiCmd *commands;         // 保存事务中所有命令的数组（FIFO 形式）
  *   int count;                  // 命令的数量
+ *   int size;                   // 数组的容量
  * } multiState;
  *
+ * 入队的命令直接取得客户端的 argv 数组，
+ * networking.c 在解析每个新命令时都会重新分配 c->argv ，
+ * 并且 freeClientArgv() 可以处理 c->argv 为 NULL 的情况
+ *
  * typedef struct multiCmd {
  *   robj **argv;                // 命令参数
  *   int argc;                   // 命令参数数量
@@ -23,10 +32,35 @@
  *
  * typedef struct redisDb {
  *    // 其他属性 ...
- *    dict *watched_keys;
+ *    dict *watched_keys;        // KEY 到 keyWatchers 的映射
+ *    long long flush_gen;       // 数据库被 FLUSH 的次数，初始化为 0
  *    int id;
  * } redisDb;
  *
+ * redis.c 的 initServer() 使用
+ * dictCreate(&keyWatchersDictType,NULL) 创建 db->watched_keys
+ *
+ * struct redisServer {
+ *   // 其他属性 ...
+ *   sds exec_record;            // 正在执行的事务的传播记录，没有时为 NULL
+ *   int exec_record_dbid;       // 记录中最后一个命令所在的 DB
+ *   // 其他属性 ...
+ * };
+ *
+ * 事务的传播记录：
+ *
+ * redis.c 的 propagate() 在 server.exec_record 不为 NULL 时，
+ * 调用 execRecordPropagate() 并直接返回；
+ * redis.h 中增加客户端标志 REDIS_PREVENT_PROPAGATE ，
+ * call() 在执行命令之前清除这个标志，
+ * 执行之后如果客户端设置了这个标志，那么不传播命令；
+ * aof.c 提供 feedAppendOnlyFileRecord() ，replication.c 提供
+ * replicationFeedSlavesRecord() ，它们在需要时先写入 SELECT ，
+ * 然后写入整个记录，并将当前 DB 设为记录中最后一个命令所在的 DB ，
+ * 附属节点共享同一个记录对象；
+ * aof.c 的 catAppendOnlyGenericCommand() 和 catAppendOnlyExpireAtCommand()
+ * 在 redis.h 中声明
+ *
  */
 
 /* ================================ MULTI/EXEC ============================== */
@@ -36,6 +70,7 @@
 void initClientMultiState(redisClient *c) {
     c->mstate.commands = NULL;  // 清空命令数组
     c->mstate.count = 0;        // 清空命令计数器
+    c->mstate.size = 0;         // 清空数组容量
 }
 
 /* Release all the resources associated with MULTI/EXEC state */
@@ -58,24 +93,39 @@ void freeClientMultiState(redisClient *c) {
     zfree(c->mstate.commands);
 }
 
-/* Add a new command into the MULTI commands queue */
+/* Add a new command into the MULTI commands queue.
+ *
+ * The queue grows geometrically, and the command takes the ownership of
+ * the argv array of the client, together with the references to the
+ * arguments, so queueing a command doesn't allocate or copy anything most
+ * of the times. The client gets a new argv for the next command. */
 // 添加新命令到 MULTI 的执行队列中（FIFO）
+// 命令直接取得客户端的 argv 数组以及参数的引用
 void queueMultiCommand(redisClient *c) {
     multiCmd *mc;
     int j;
 
-    // 为新命令分配空间
-    c->mstate.commands = zrealloc(c->mstate.commands,
-            sizeof(multiCmd)*(c->mstate.count+1));
+    // 数组的容量按两倍增长
+    if (c->mstate.count == c->mstate.size) {
+        c->mstate.size = c->mstate.size ? c->mstate.size*2 : 4;
+        c->mstate.commands = zrealloc(c->mstate.commands,
+                sizeof(multiCmd)*c->mstate.size);
+    }
+
+    /* The arguments will outlive the reset of the argv arena. */
+    // 参数的生命周期比 arena 更长，将它们移到堆中
+    for (j = 0; j < c->argc; j++)
+        promoteArenaStringObject(c->argv[j]);
 
     // 设置新命令
     mc = c->mstate.commands+c->mstate.count;            // 指向新命令
     mc->cmd = c->cmd;                                   // 设置命令
     mc->argc = c->argc;                                 // 设置参数计数器
-    mc->argv = zmalloc(sizeof(robj*)*c->argc);          // 生成参数空间
-    memcpy(mc->argv,c->argv,sizeof(robj*)*c->argc);     // 设置参数
-    for (j = 0; j < c->argc; j++)
-        incrRefCount(mc->argv[j]);
+    mc->argv = c->argv;                                 // 取得参数数组
+
+    // 客户端不再持有参数
+    c->argv = NULL;
+    c->argc = 0;
 
     // 更新命令数量的计数器
     c->mstate.count++;
@@ -114,22 +164,121 @@ void discardCommand(redisClient *c) {
     addReply(c,shared.ok);
 }
 
-/* Send a MULTI command to all the slaves and AOF file. Check the execCommand
- * implememntation for more information. */
-// 向所有附属节点和 AOF 文件发送 MULTI 命令
-// 保证一致性
-void execCommandReplicateMulti(redisClient *c) {
-    robj *multistring = createStringObject("MULTI",5);
+/* The commands executed by EXEC are not propagated one by one: they are
+ * serialized in a single record, MULTI ... EXEC, that is written once to
+ * the AOF and appended as a shared object to the output of every slave
+ * when EXEC returns. Both the AOF and the slaves receive the same bytes,
+ * so relative expires are translated to PEXPIREAT for the slaves too, as
+ * it was already done for the AOF. */
+// 事务中的命令被序列化到同一个记录中，
+// 在 EXEC 返回时一次性写入 AOF 和所有附属节点
+
+// 是否有 AOF 或者附属节点需要接收传播的命令
+static int execRecordNeeded(void) {
+    return server.aof_state != REDIS_AOF_OFF ||
+           server.repl_backlog != NULL || listLength(server.slaves);
+}
+
+/* Start the record of the transaction of the client 'c', with MULTI. */
+// 开始记录事务，记录以 MULTI 开头
+static void execRecordStart(redisClient *c) {
+    server.exec_record = sdsnew("*1\r\n$5\r\nMULTI\r\n");
+    server.exec_record_dbid = c->db->id;
+}
+
+/* Called by propagate() while a transaction is recorded. */
+// 将事务中的命令追加到记录中
+void execRecordPropagate(struct redisCommand *cmd, int dbid, robj **argv,
+                         int argc)
+{
+    sds buf = server.exec_record;
+    robj *tmpargv[3];
+
+    // 命令所在的 DB 改变了，写入 SELECT
+    if (dbid != server.exec_record_dbid) {
+        char seldb[64];
+
+        snprintf(seldb,sizeof(seldb),"%d",dbid);
+        buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
+            (unsigned long)strlen(seldb),seldb);
+        server.exec_record_dbid = dbid;
+    }
 
-    // 如果处于 AOF 模式，则发送 AOF 
+    // 和 feedAppendOnlyFile() 一样，将相对的过期时间转换为 PEXPIREAT
+    if (cmd->proc == expireCommand || cmd->proc == pexpireCommand ||
+        cmd->proc == expireatCommand) {
+        buf = catAppendOnlyExpireAtCommand(buf,cmd,argv[1],argv[2]);
+    } else if (cmd->proc == setexCommand || cmd->proc == psetexCommand) {
+        tmpargv[0] = createStringObject("SET",3);
+        tmpargv[1] = argv[1];
+        tmpargv[2] = argv[3];
+        buf = catAppendOnlyGenericCommand(buf,3,tmpargv);
+        decrRefCount(tmpargv[0]);
+        buf = catAppendOnlyExpireAtCommand(buf,cmd,argv[1],argv[2]);
+    } else {
+        buf = catAppendOnlyGenericCommand(buf,argc,argv);
+    }
+    server.exec_record = buf;
+}
+
+/* Terminate the record with EXEC and feed it to the AOF and to the slaves.
+ * 'dbid' is the DB that was selected when the transaction started. */
+// 以 EXEC 结束记录，并将它写入 AOF 和附属节点
+static void execRecordFeed(int dbid) {
+    sds record = sdscat(server.exec_record,"*1\r\n$4\r\nEXEC\r\n");
+    int lastdbid = server.exec_record_dbid;
+
+    server.exec_record = NULL;
+
+    // 如果处于 AOF 模式，则写入 AOF
     if (server.aof_state != REDIS_AOF_OFF)
-        feedAppendOnlyFile(server.multiCommand,c->db->id,&multistring,1);
+        feedAppendOnlyFileRecord(dbid,lastdbid,record);
 
-    // 如果处于复制模式，向附属节点发送 AOF
-    if (listLength(server.slaves))
-        replicationFeedSlaves(server.slaves,c->db->id,&multistring,1);
+    // 如果处于复制模式，所有附属节点共享同一个记录对象
+    if (server.repl_backlog != NULL || listLength(server.slaves)) {
+        robj *o = createObject(REDIS_STRING,record);
 
-    decrRefCount(multistring);
+        replicationFeedSlavesRecord(server.slaves,dbid,lastdbid,o);
+        decrRefCount(o);
+    } else {
+        sdsfree(record);
+    }
+}
+
+/* Number of queued commands whose keys are prefetched together by EXEC. */
+// EXEC 每次预取多少个命令的 key
+#define REDIS_EXEC_PREFETCH_BATCH 16
+// 每批最多预取的 key 数量
+#define REDIS_EXEC_PREFETCH_MAX_KEYS (REDIS_EXEC_PREFETCH_BATCH*4)
+
+/* Prefetch the keyspace entries of the keys of the queued commands from
+ * 'first' to 'first'+REDIS_EXEC_PREFETCH_BATCH-1. EXEC prefetches a batch
+ * ahead of the one it executes, so that the cache misses of the lookups are
+ * already in flight when the commands run, but the lines are not evicted
+ * before they are used, as they could be for a large transaction if all
+ * the keys were prefetched at once. */
+// 预取事务中一批命令的 key 在数据库中的节点
+static void execPrefetchKeys(redisClient *c, int first) {
+    void *keys[REDIS_EXEC_PREFETCH_MAX_KEYS];
+    int j, k, n = 0;
+
+    for (j = first; j < c->mstate.count &&
+                    j < first+REDIS_EXEC_PREFETCH_BATCH; j++)
+    {
+        multiCmd *mc = c->mstate.commands+j;
+        int *pos, numkeys;
+
+        pos = getKeysFromCommand(mc->cmd,mc->argv,mc->argc,&numkeys,
+                                 REDIS_GETKEYS_ALL);
+        for (k = 0; k < numkeys && n < REDIS_EXEC_PREFETCH_MAX_KEYS; k++) {
+            robj *key = mc->argv[pos[k]];
+
+            if (sdsEncodedObject(key)) keys[n++] = key->ptr;
+        }
+        getKeysFreeResult(pos);
+    }
+    /* A SELECT inside the transaction only makes the prefetch useless. */
+    dictPrefetch(c->db->dict,keys,n);
 }
 
 // 执行事务
@@ -138,6 +287,7 @@ void execCommand(redisClient *c) {
     robj **orig_argv;
     int orig_argc;
     struct redisCommand *orig_cmd;
+    int record, dbid;
 
     // 如果没执行过 MULTI ，报错
     if (!(c->flags & REDIS_MULTI)) {
@@ -149,7 +299,7 @@ void execCommand(redisClient *c) {
      * A failed EXEC will return a multi bulk nil object. */
     // 如果在执行事务之前，有监视中（WATCHED）的 key 被改变
     // 那么取消这个事务
-    if (c->flags & REDIS_DIRTY_CAS) {
+    if (c->flags & REDIS_DIRTY_CAS || isWatchedKeyFlushed(c)) {
         freeClientMultiState(c);
         initClientMultiState(c);
         c->flags &= ~(REDIS_MULTI|REDIS_DIRTY_CAS);
@@ -158,14 +308,15 @@ void execCommand(redisClient *c) {
         return;
     }
 
-    /* Replicate a MULTI request now that we are sure the block is executed.
-     * This way we'll deliver the MULTI/..../EXEC block as a whole and
-     * both the AOF and the replication link will have the same consistency
-     * and atomicity guarantees. */
+    /* Record the MULTI/..../EXEC block now that we are sure it is executed.
+     * This way we'll deliver the block as a whole and both the AOF and the
+     * replication link will have the same consistency and atomicity
+     * guarantees. */
     // 为保证一致性和原子性
-    // 如果处在 AOF 模式中，向 AOF 文件发送 MULTI 
-    // 如果处在复制模式中，向附属节点发送 MULTI
-    execCommandReplicateMulti(c);
+    // 事务中的命令被记录下来，在事务执行完毕之后一次性传播
+    dbid = c->db->id;
+    record = execRecordNeeded();
+    if (record) execRecordStart(c);
 
     /* Exec all the queued commands */
     // 开始执行所有事务中的命令（FIFO 方式）
@@ -176,7 +327,11 @@ void execCommand(redisClient *c) {
     orig_argc = c->argc;
     orig_cmd = c->cmd;
     addReplyMultiBulkLen(c,c->mstate.count);
+    execPrefetchKeys(c,0);
     for (j = 0; j < c->mstate.count; j++) {
+        // 在执行一批命令之前，预取下一批命令的 key
+        if (j % REDIS_EXEC_PREFETCH_BATCH == 0)
+            execPrefetchKeys(c,j+REDIS_EXEC_PREFETCH_BATCH);
         c->argc = c->mstate.commands[j].argc;   // 取出参数数量
         c->argv = c->mstate.commands[j].argv;   // 取出参数
         c->cmd = c->mstate.commands[j].cmd;     // 取出要执行的命令
@@ -198,79 +353,184 @@ void execCommand(redisClient *c) {
     initClientMultiState(c);
     c->flags &= ~(REDIS_MULTI|REDIS_DIRTY_CAS);
 
-    /* Make sure the EXEC command is always replicated / AOF, since we
-     * always send the MULTI command (we can't know beforehand if the
-     * next operations will contain at least a modification to the DB). */
+    /* The record already ends with EXEC: call() must not propagate the
+     * EXEC command itself. */
+    // 传播事务记录，EXEC 命令本身不再由 call() 传播
+    if (record) {
+        execRecordFeed(dbid);
+        c->flags |= REDIS_PREVENT_PROPAGATE;
+    }
+
+    /* The dataset is considered modified, since we always propagate the
+     * whole MULTI/EXEC block (we can't know beforehand if the operations
+     * contained at least a modification to the DB). */
     // 更新状态值，确保事务执行之后的状态为脏
     server.dirty++;
 }
 
 /* ===================== WATCH (CAS alike for MULTI/EXEC) ===================
  *
- * The implementation uses a per-DB hash table mapping keys to list of clients
- * WATCHing those keys, so that given a key that is going to be modified
- * we can mark all the associated clients as dirty.
+ * The implementation uses a per-DB hash table mapping keys to the array of
+ * watchedKey structures of the clients WATCHing those keys, so that given a
+ * key that is going to be modified we can mark all the associated clients
+ * as dirty in O(watchers).
  *
- * Also every client contains a list of WATCHed keys so that's possible to
- * un-watch such keys when the client is freed or when UNWATCH is called. */
+ * Also every client contains a hash set of its WATCHed keys, so that it's
+ * possible to check if a key is already watched, and to un-watch all the
+ * keys when the client is freed or when UNWATCH is called, without scanning
+ * lists. Every watchedKey remembers its position in the array of the key,
+ * so it is removed from it in O(1).
+ *
+ * FLUSHDB and FLUSHALL don't scan the clients: they just increment the
+ * flush generation of the DB, that is compared by EXEC with the generation
+ * recorded at WATCH time. */
 // 为每个 DB 保存一个哈希表
-// 哈希表的键是被 WATCH 的 KEY ，值是一个列表，列表中保存了所有 WATCH 这个 KEY 的客户端
+// 哈希表的键是被 WATCH 的 KEY ，值是一个数组，数组中保存了所有 WATCH 这个 KEY 的客户端的 watchedKey
 // 这样每当某个 KEY 被修改了，那么所有 WATCH 它的客户端都会被标记为 dirty
 //
-// 另外每个客户端也保存一个被 WATCH KEY 的链表，
+// 另外每个客户端也保存一个被 WATCH KEY 的集合（哈希表），
 // 这样就可以在事务执行完毕或者执行 UNWATCH 命令的时候
 // 一次性对客户端 WATCHED 的所有 KEY 进行 UNWATCH
+//
+// FLUSHDB 和 FLUSHALL 只增加 DB 的 flush 代数，由 EXEC 检查
 
-/* In the client->watched_keys list we need to use watchedKey structures
+/* In the client->watched_keys set we need to use watchedKey structures
  * as in order to identify a key in Redis we need both the key name and the
  * DB */
 // 每个被 WATCH 的 KEY 都会根据 KEY 名和 DB 
-// 被保存到 redisClient.watched_keys 这个列表中
+// 被保存到 redisClient.watched_keys 这个集合中
 typedef struct watchedKey {
     robj *key;      // 被 WATCH 的 KEY
     redisDb *db;    // 被 WATCH 的 KEY 所在的 DB
+    redisClient *client;            // WATCH 这个 KEY 的客户端
+    struct keyWatchers *watchers;   // 这个 KEY 的所有 watchedKey
+    unsigned long pos;              // 在 watchers->items 数组中的位置
+    long long flush_gen;            // WATCH 时 DB 的 flush 代数
+    int existed;                    // WATCH 时 KEY 是否存在
 } watchedKey;
 
+// db->watched_keys 字典的值
+typedef struct keyWatchers {
+    watchedKey **items;     // WATCH 这个 KEY 的所有 watchedKey
+    unsigned long count;    // 数组中 watchedKey 的数量
+    unsigned long size;     // 数组的容量
+} keyWatchers;
+
+// 计算字符串对象的哈希值
+static unsigned int watchedKeyObjHash(robj *key) {
+    return dictGenHashFunction(key->ptr,sdslen((sds)key->ptr));
+}
+
+static unsigned int clientWatchedKeyHash(const void *key) {
+    const watchedKey *wk = key;
+
+    return watchedKeyObjHash(wk->key) ^ (unsigned int)wk->db->id;
+}
+
+static int clientWatchedKeyCompare(void *privdata, const void *key1,
+        const void *key2)
+{
+    const watchedKey *wk1 = key1, *wk2 = key2;
+
+    DICT_NOTUSED(privdata);
+    return wk1->db == wk2->db && equalStringObjects(wk1->key,wk2->key);
+}
+
+/* Client->watched_keys: set of watchedKey, freed by unwatchAllKeys(). */
+// 客户端 WATCH 的 KEY 的集合
+dictType clientWatchedKeysDictType = {
+    clientWatchedKeyHash,       /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    clientWatchedKeyCompare,    /* key compare */
+    NULL,                       /* key destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* entry metadata bytes */
+    NULL                        /* entry metadata destructor */
+};
+
+static unsigned int keyWatchersHash(const void *key) {
+    return watchedKeyObjHash((robj*)key);
+}
+
+static int keyWatchersKeyCompare(void *privdata, const void *key1,
+        const void *key2)
+{
+    DICT_NOTUSED(privdata);
+    return equalStringObjects((robj*)key1,(robj*)key2);
+}
+
+static void keyWatchersKeyDestructor(void *privdata, void *key) {
+    DICT_NOTUSED(privdata);
+    decrRefCount(key);
+}
+
+static void keyWatchersValDestructor(void *privdata, void *val) {
+    keyWatchers *kw = val;
+
+    DICT_NOTUSED(privdata);
+    zfree(kw->items);
+    zfree(kw);
+}
+
+/* Db->watched_keys: key -> keyWatchers. */
+// DB 中被 WATCH 的 KEY 到 watchedKey 数组的映射
+dictType keyWatchersDictType = {
+    keyWatchersHash,            /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    keyWatchersKeyCompare,      /* key compare */
+    keyWatchersKeyDestructor,   /* key destructor */
+    keyWatchersValDestructor,   /* val destructor */
+    NULL,                       /* entry metadata bytes */
+    NULL                        /* entry metadata destructor */
+};
+
 /* Watch for the specified key */
 // WATCH 某个 KEY
 void watchForKey(redisClient *c, robj *key) {
-    list *clients = NULL;
-    listIter li;
-    listNode *ln;
-    watchedKey *wk;
+    watchedKey probe, *wk;
+    keyWatchers *kw;
 
     /* Check if we are already watching for this key */
-    // 所有被 WATCHED 的 KEY 都被放在 redisClient.watched_keys 链表中
-    // 遍历这个链表，查看这个 KEY 是否已经处于监视状态（WATCHED）
-    listRewind(c->watched_keys,&li);
-    while((ln = listNext(&li))) {
-        wk = listNodeValue(ln);
-        if (wk->db == c->db && equalStringObjects(key,wk->key))
-            return; /* Key already watched */
-    }
+    // 所有被 WATCHED 的 KEY 都被放在 redisClient.watched_keys 集合中
+    probe.key = key;
+    probe.db = c->db;
+    if (dictFind(c->watched_keys,&probe) != NULL)
+        return; /* Key already watched */
 
     /* This key is not already watched in this DB. Let's add it */
     // 如果 KEY 还没有被 WATCH 过，那么对它进行 WATCH
-    clients = dictFetchValue(c->db->watched_keys,key);
-    if (!clients) { 
-        // 如果 clients 链表不存在
+    kw = dictFetchValue(c->db->watched_keys,key);
+    if (!kw) {
+        // 如果数组不存在
         // 说明这个客户端是第一个监视这个 DB 的这个 KEY 的客户端
-        // 那么 clients 创建链表，并将它添加到 c->db->watched_keys 字典中
-        clients = listCreate();
-        dictAdd(c->db->watched_keys,key,clients);
+        // 那么创建数组，并将它添加到 c->db->watched_keys 字典中
+        kw = zmalloc(sizeof(*kw));
+        kw->items = NULL;
+        kw->count = kw->size = 0;
+        dictAdd(c->db->watched_keys,key,kw);
         incrRefCount(key);
     }
-    // 将客户端添加到 clients 链表
-    listAddNodeTail(clients,c); 
+    // 数组的容量按两倍增长
+    if (kw->count == kw->size) {
+        kw->size = kw->size ? kw->size*2 : 4;
+        kw->items = zrealloc(kw->items,sizeof(watchedKey*)*kw->size);
+    }
 
-    /* Add the new key to the lits of keys watched by this client */
-    // 除了 c->db->watched_keys 之外
-    // 还要将被 WATCH 的 KEY 添加到 c->watched_keys
+    /* Add the new key to the set of keys watched by this client, and to the
+     * watchers of the key. */
     wk = zmalloc(sizeof(*wk));
     wk->key = key;
     wk->db = c->db;
+    wk->client = c;
+    wk->watchers = kw;
+    wk->pos = kw->count;
+    wk->flush_gen = c->db->flush_gen;
+    wk->existed = dictFind(c->db->dict,key->ptr) != NULL;
     incrRefCount(key);
-    listAddNodeTail(c->watched_keys,wk);
+    kw->items[kw->count++] = wk;
+    dictAdd(c->watched_keys,wk,NULL);
 }
 
 /* Unwatch all the keys watched by this client. To clean the EXEC dirty
@@ -278,37 +538,37 @@ void watchForKey(redisClient *c, robj *key) {
 // 撤销对这个客户端的所有 WATCH
 // 清除 EXEC dirty FLAG 的任务由调用者完成
 void unwatchAllKeys(redisClient *c) {
-    listIter li;
-    listNode *ln;
+    dictIterator *di;
+    dictEntry *de;
 
     // 没有 WATCHED KEY ，直接返回
-    if (listLength(c->watched_keys) == 0) return;
+    if (dictSize(c->watched_keys) == 0) return;
 
-    listRewind(c->watched_keys,&li);
-    while((ln = listNext(&li))) {
-        list *clients;
-        watchedKey *wk;
+    di = dictGetIterator(c->watched_keys);
+    while((de = dictNext(di)) != NULL) {
+        watchedKey *wk = dictGetKey(de), *last;
+        keyWatchers *kw = wk->watchers;
 
-        /* Lookup the watched key -> clients list and remove the client
-         * from the list */
-        // 将当前客户端从监视 KEY 的链表中移除
-        wk = listNodeValue(ln);
-        clients = dictFetchValue(wk->db->watched_keys, wk->key);
-        redisAssertWithInfo(c,NULL,clients != NULL);
-        listDelNode(clients,listSearchKey(clients,c));
+        /* Remove the client from the watchers of the key, moving the last
+         * watcher in its place. */
+        // 将当前客户端从监视 KEY 的数组中移除
+        last = kw->items[--kw->count];
+        kw->items[wk->pos] = last;
+        last->pos = wk->pos;
 
         /* Kill the entry at all if this was the only client */
         // 如果监视 KEY 的只有这个客户端
-        // 那么将链表从字典中删除
-        if (listLength(clients) == 0)
+        // 那么将数组从字典中删除
+        if (kw->count == 0)
             dictDelete(wk->db->watched_keys, wk->key);
 
-        /* Remove this watched key from the client->watched list */
-        // 还需要将 KEY 从 client->watched_keys 链表中移除
-        listDelNode(c->watched_keys,ln);
         decrRefCount(wk->key);
         zfree(wk);
     }
+    dictReleaseIterator(di);
+
+    // 清空 client->watched_keys 集合
+    dictEmpty(c->watched_keys);
 }
 
 /* "Touch" a key, so that if this key is being WATCHed by some client the
@@ -316,52 +576,86 @@ void unwatchAllKeys(redisClient *c) {
 // 打开所有 WATCH 给定 KEY 的客户端的 REDIS_DIRTY_CAS 状态
 // 使得接下来的 EXEC 执行失败
 void touchWatchedKey(redisDb *db, robj *key) {
-    list *clients;
-    listIter li;
-    listNode *ln;
+    keyWatchers *kw;
+    unsigned long j;
 
     if (dictSize(db->watched_keys) == 0) return;
-    clients = dictFetchValue(db->watched_keys, key);
-    if (!clients) return;
+    kw = dictFetchValue(db->watched_keys, key);
+    if (!kw) return;
 
     /* Mark all the clients watching this key as REDIS_DIRTY_CAS */
-    /* Check if we are already watching for this key */
-    listRewind(clients,&li);
-    while((ln = listNext(&li))) {
-        redisClient *c = listNodeValue(ln);
-
-        c->flags |= REDIS_DIRTY_CAS;    // 打开 FLAG
-    }
+    for (j = 0; j < kw->count; j++)
+        kw->items[j]->client->flags |= REDIS_DIRTY_CAS;    // 打开 FLAG
 }
 
 /* On FLUSHDB or FLUSHALL all the watched keys that are present before the
  * flush but will be deleted as effect of the flushing operation should
  * be touched. "dbid" is the DB that's getting the flush. -1 if it is
- * a FLUSHALL operation (all the DBs flushed). */
-// 在 FLUSH 命令执行时，打开所有 WATCHED KEY 的 REDIS_DIRTY_CAS FLAG
+ * a FLUSHALL operation (all the DBs flushed).
+ *
+ * Instead of scanning the clients, the flush generation of the DB is
+ * incremented: see isWatchedKeyFlushed(). */
+// 在 FLUSH 命令执行时，增加被 FLUSH 的 DB 的 flush 代数
 // dbid 变量表示要被 FLUSH 的 DB 序号
 // 如果 dbid 为 -1 ，表示所有 DB 都要被 FLUSH（也即是 FLUSHALL）
 void touchWatchedKeysOnFlush(int dbid) {
-    listIter li1, li2;
-    listNode *ln;
-
-    /* For every client, check all the waited keys */
-    listRewind(server.clients,&li1);
-    while((ln = listNext(&li1))) {
-        redisClient *c = listNodeValue(ln);
-        listRewind(c->watched_keys,&li2);
-        while((ln = listNext(&li2))) {
-            watchedKey *wk = listNodeValue(ln);
-
-            /* For every watched key matching the specified DB, if the
-             * key exists, mark the client as dirty, as the key will be
-             * removed. */
-            if (dbid == -1 || wk->db->id == dbid) {
-                if (dictFind(wk->db->dict, wk->key->ptr) != NULL)
-                    c->flags |= REDIS_DIRTY_CAS;    // 打开 FLAG
-            }
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        if (dbid == -1 || j == dbid)
+            server.db[j].flush_gen++;
+    }
+}
+
+/* Return 1 if one of the keys watched by the client existed when it was
+ * WATCHed and its DB was flushed since then.
+ *
+ * A key that was created or deleted after the WATCH already made the client
+ * dirty, so for a client that is not dirty the existence of the key at the
+ * time of the flush is the same as at the time of the WATCH. */
+// 如果客户端 WATCH 的某个 KEY 在 WATCH 之后被 FLUSH 删除，那么返回 1
+int isWatchedKeyFlushed(redisClient *c) {
+    dictIterator *di;
+    dictEntry *de;
+    int flushed = 0;
+
+    if (dictSize(c->watched_keys) == 0) return 0;
+    di = dictGetIterator(c->watched_keys);
+    while((de = dictNext(di)) != NULL) {
+        watchedKey *wk = dictGetKey(de);
+
+        if (wk->existed && wk->flush_gen != wk->db->flush_gen) {
+            flushed = 1;
+            break;
         }
     }
+    dictReleaseIterator(di);
+    return flushed;
+}
+
+/* When the content of 'db' is going to be replaced by the content of
+ * 'with' (SWAPDB, CLONEDB), every watched key of 'db' that exists before or
+ * after the operation is touched. */
+// 在数据库的内容被替换时，打开所有 WATCH 受影响 KEY 的客户端的
+// REDIS_DIRTY_CAS FLAG
+void touchWatchedKeysOnReplace(redisDb *db, redisDb *with) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (dictSize(db->watched_keys) == 0) return;
+    di = dictGetIterator(db->watched_keys);
+    while((de = dictNext(di)) != NULL) {
+        robj *key = dictGetKey(de);
+        keyWatchers *kw = dictGetVal(de);
+        unsigned long j;
+
+        if (dictFind(db->dict,key->ptr) == NULL &&
+            dictFind(with->dict,key->ptr) == NULL) continue;
+
+        for (j = 0; j < kw->count; j++)
+            kw->items[j]->client->flags |= REDIS_DIRTY_CAS;    // 打开 FLAG
+    }
+    dictReleaseIterator(di);
 }
 
 void watchCommand(redisClient *c) {
@@ -381,3 +675,126 @@ void unwatchCommand(redisClient *c) {
     c->flags &= (~REDIS_DIRTY_CAS);
     addReply(c,shared.ok);
 }
+
+#ifdef MULTI_BENCHMARK_MAIN
+
+#include <sys/time.h>
+
+/* Compare queueMultiCommand() with the previous way of queueing commands,
+ * that grew the queue by one slot and copied the argv of the client for
+ * every command, over transactions of increasing length. The object
+ * functions are replaced by minimal versions, so that only the queue and
+ * the allocator are measured.
+ *
+ * Build with (from the Redis src directory, the unused functions of this
+ * file are discarded by the linker):
+ *   gcc -DMULTI_BENCHMARK_MAIN -ffunction-sections -fdata-sections \
+ *       -Wl,--gc-sections multi.c zmalloc.c -o multi-benchmark */
+/* 事务队列的性能测试 */
+
+#define BENCH_ARGC 3
+#define BENCH_COMMANDS 2000000
+
+robj *createObject(int type, void *ptr) {
+    robj *o = zmalloc(sizeof(*o));
+
+    o->type = type;
+    o->encoding = REDIS_ENCODING_RAW;
+    o->ptr = ptr;
+    o->refcount = 1;
+    o->arena = 0;
+    return o;
+}
+
+void incrRefCount(robj *o) {
+    o->refcount++;
+}
+
+void decrRefCount(void *obj) {
+    robj *o = obj;
+
+    if (--o->refcount == 0) zfree(o);
+}
+
+void promoteArenaStringObject(robj *o) {
+    REDIS_NOTUSED(o);
+}
+
+static long long benchUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+// 模拟网络层为每个命令创建参数
+static void benchFillArgv(redisClient *c) {
+    int j;
+
+    c->argv = zmalloc(sizeof(robj*)*BENCH_ARGC);
+    c->argc = BENCH_ARGC;
+    for (j = 0; j < BENCH_ARGC; j++) c->argv[j] = createObject(REDIS_STRING,NULL);
+}
+
+// 模拟 freeClientArgv() ，参数的数组由客户端保留
+static void benchFreeArgv(redisClient *c) {
+    int j;
+
+    for (j = 0; j < c->argc; j++) decrRefCount(c->argv[j]);
+    c->argc = 0;
+}
+
+/* The previous queueMultiCommand(): one zrealloc() per command, and a copy
+ * of the argv array with a new reference to every argument. */
+static void benchQueueCopy(redisClient *c) {
+    multiCmd *mc;
+    int j;
+
+    c->mstate.commands = zrealloc(c->mstate.commands,
+            sizeof(multiCmd)*(c->mstate.count+1));
+    mc = c->mstate.commands+c->mstate.count;
+    mc->cmd = c->cmd;
+    mc->argc = c->argc;
+    mc->argv = zmalloc(sizeof(robj*)*c->argc);
+    memcpy(mc->argv,c->argv,sizeof(robj*)*c->argc);
+    for (j = 0; j < c->argc; j++)
+        incrRefCount(mc->argv[j]);
+    c->mstate.count++;
+}
+
+static void benchRun(int commands) {
+    redisClient client, *c = &client;
+    long long start, elapsed[2];
+    int mode, j, k, transactions = BENCH_COMMANDS/commands;
+
+    memset(c,0,sizeof(*c));
+    for (mode = 0; mode < 2; mode++) {
+        start = benchUstime();
+        for (j = 0; j < transactions; j++) {
+            initClientMultiState(c);
+            for (k = 0; k < commands; k++) {
+                benchFillArgv(c);
+                if (mode == 0) {
+                    benchQueueCopy(c);
+                    benchFreeArgv(c);
+                    zfree(c->argv);
+                } else {
+                    queueMultiCommand(c);
+                }
+            }
+            freeClientMultiState(c);
+        }
+        elapsed[mode] = benchUstime()-start;
+    }
+    printf("%6d commands per transaction: copy %lld ms, move %lld ms\n",
+        commands, elapsed[0]/1000, elapsed[1]/1000);
+}
+
+int main(void) {
+    int commands;
+
+    for (commands = 1; commands <= 100000; commands *= 10)
+        benchRun(commands);
+    return 0;
+}
+#endif
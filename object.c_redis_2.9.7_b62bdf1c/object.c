@@ -12,6 +12,148 @@
 #define REDIS_ENCODING_ZIPLIST 5 // Encoded as ziplist
 #define REDIS_ENCODING_INTSET 6  // Encoded as intset
 #define REDIS_ENCODING_SKIPLIST 7  // Encoded as skiplist
+#define REDIS_ENCODING_EMBSTR 8  // Embedded sds string encoding
+#define REDIS_ENCODING_BTREE 9  // Encoded as B+tree (big sorted sets)
+#define REDIS_ENCODING_BLOCKS 10 // Encoded as ziplist blocks (medium sorted sets)
+
+// 检查对象的 ptr 是否指向一个 sds （ raw 或者 embstr 编码）
+#define sdsEncodedObject(objptr) (objptr->encoding == REDIS_ENCODING_RAW || objptr->encoding == REDIS_ENCODING_EMBSTR)
+
+// embstr 编码的字符串是只读的，它的 sds 和对象在同一块内存中，
+// 所以原地修改字符串的代码必须先取得一个 raw 编码的私有副本：
+//
+// t_string.c 的 appendCommand() 和 setrangeCommand() ，
+// 以及 bitops.c 的 setbitCommand() 在修改已有的值之前调用
+//     o = dbUnshareStringValue(c->db,c->argv[1],o);
+// 它返回一个引用计数为 1 的 raw 编码对象（见 db.c）
+//
+// networking.c 的 dupLastObjectIfNeeded() 在
+//     cur->refcount > 1 || cur->encoding != REDIS_ENCODING_RAW
+// 时复制回复链表的最后一个对象，而不只是在引用计数大于 1 时复制，
+// 复制使用 dupStringObject() ，它总是返回 raw 编码的对象，
+// 所以 _addReplyObjectToList() 和 _addReplyStringToList() 可以继续
+// 对它调用 sdscatlen()
+//
+// rdb.c 的 rdbSaveStringObject() 中的断言改为
+//     redisAssertWithInfo(NULL,obj,sdsEncodedObject(obj));
+// t_hash.c 、 t_list.c 、 t_set.c 、 sort.c 和 networking.c 中
+// 在访问 sds 之前检查 encoding == REDIS_ENCODING_RAW 的地方，
+// 都改为使用 sdsEncodedObject()
+
+typedef struct redisObject {
+    unsigned type:4;
+    unsigned arena:1;       // sds 是否从客户端的参数 arena 中分配
+    unsigned encoding:4;
+    // LRU 策略下保存对象最后一次被访问的时间（相对于 server.lruclock ）
+    // LFU 策略下高 15 位保存以分钟为单位的最后一次衰减时间，
+    // 低 8 位保存对数访问频率计数器
+    unsigned lru:REDIS_LRU_BITS;
+    int refcount;
+    void *ptr;
+} robj;
+
+typedef struct redisClient {
+    // 其他属性 ...
+    sdsarena *argv_arena;   // 用于分配命令参数 sds 的 arena ，可以为 NULL
+    // 其他属性 ...
+} redisClient;
+
+// networking.c 中的参数分析函数使用 createArenaStringObject() 创建 argv ，
+// 而 resetClient() 则在 freeClientArgv() 之后调用 sdsArenaReset() 回收空间
+
+// 单个参数的长度超过这个值时，不从 arena 中分配
+#define REDIS_ARENA_MAX_ARG_LEN 1024
+
+// 带标记的整数（tagged integer）
+//
+// 数据库字典的值指针的最低两位为 01 时，它不指向任何 robj ，
+// 而是直接保存一个 62 位的有符号整数，从而节省一个 robj 的分配
+#define REDIS_TAGGED_INT_BITS 2
+#define REDIS_TAGGED_INT_MASK 3
+#define REDIS_TAGGED_INT_TAG 1
+#define REDIS_TAGGED_INT_MIN (-(1LL<<61))
+#define REDIS_TAGGED_INT_MAX ((1LL<<61)-1)
+#define objectIsTaggedInt(o) ((((uintptr_t)(o)) & REDIS_TAGGED_INT_MASK) == REDIS_TAGGED_INT_TAG)
+// 返回对象的类型，带标记的整数为字符串
+#define objectType(o) (objectIsTaggedInt(o) ? REDIS_STRING : (o)->type)
+// 只在 64 位平台上使用带标记的整数，
+// 32 位的指针无法保存上面的取值范围
+#if UINTPTR_MAX >= 0xffffffffffffffffULL
+#define REDIS_TAGGED_INT_ENABLED 1
+#else
+#define REDIS_TAGGED_INT_ENABLED 0
+#endif
+//
+// lookupKeyRead() 和 lookupKeyWrite() 直接返回数据库中的带标记整数，
+// 不为它分配对象，所以读取值的代码需要处理这种形式：
+//
+// networking.c 的 addReply() 、 addReplyBulkLen() 和 addReplyBulk()
+// 在 objectIsTaggedInt(obj) 时通过 taggedIntegerValue(obj) 回复，比如
+//     addReplyBulkLongLong(c,taggedIntegerValue(obj));
+// 比较类型的代码使用 checkType() 或者 objectType() ，
+// 比如 t_string.c 的 getGenericCommand() 和 sort.c 的 sortCommand()
+//
+// t_string.c 的 incrDecrCommand() 和 incrbyCommand() 等命令
+// 通过 getLongLongFromObjectOrReply() 读取旧值，
+// 新值在 taggedIntegerAllowed(value) 时直接以带标记整数的形式保存：
+//     dbOverwrite(c->db,c->argv[1],createTaggedInteger(value));
+//     addReplyLongLong(c,value);
+// 否则和原来一样创建一个新对象，所以 INCR 在常见情况下不会分配任何对象
+//
+// rdb.c 的 rdbSaveObjectType() 和 rdbSaveObject() 以及
+// aof.c 的 rewriteAppendOnlyFile() 将带标记的整数保存为字符串，
+// 值通过 rdbSaveLongLongAsStringObject() 和 rioWriteBulkLongLong() 写入
+//
+// db.c 的 exitExecutionUnit() 在最外层的命令返回时调用 releaseDeferredObjects()
+// aof.c 的 loadAppendOnlyFile() 必须在调用 cmd->proc() 的前后
+// 调用 enterExecutionUnit() 和 exitExecutionUnit() ，
+// 否则在载入 AOF 期间延迟释放的对象不会被释放
+
+// LRU 时钟
+#define REDIS_LRU_BITS 23
+#define REDIS_LRU_CLOCK_MAX ((1<<REDIS_LRU_BITS)-1) // Max value of obj->lru
+#define REDIS_LRU_CLOCK_RESOLUTION 1000 // LRU clock resolution in ms
+
+// 如果 serverCron 更新 server.lruclock 的频率足够高，那么直接使用它，
+// 否则调用 getLRUClock() 获取当前时钟
+#define LRU_CLOCK() ((1000/server.hz <= REDIS_LRU_CLOCK_RESOLUTION) ? server.lruclock : getLRUClock())
+
+// LFU 计数器
+#define REDIS_LFU_INIT_VAL 5        // 新对象的计数器初始值
+#define REDIS_LFU_COUNTER_BITS 8
+#define REDIS_LFU_COUNTER_MAX 255
+#define REDIS_LFU_TIME_MAX ((1<<(REDIS_LRU_BITS-REDIS_LFU_COUNTER_BITS))-1)
+
+// 新增的 maxmemory 策略
+#define REDIS_MAXMEMORY_VOLATILE_LFU 6
+#define REDIS_MAXMEMORY_ALLKEYS_LFU 7
+#define maxmemoryPolicyIsLFU(p) ((p) == REDIS_MAXMEMORY_VOLATILE_LFU || (p) == REDIS_MAXMEMORY_ALLKEYS_LFU)
+
+struct redisServer {
+    // 其他属性 ...
+    unsigned lruclock:REDIS_LRU_BITS; // Clock for LRU eviction, 由 serverCron 调用 getLRUClock() 更新
+    int lfu_log_factor;     // LFU 计数器的对数因子，默认为 10
+    int lfu_decay_time;     // LFU 计数器每隔多少分钟衰减一次，默认为 1
+    // 其他属性 ...
+};
+
+// db.c 中的 lazy free 后台线程通过 decrRefCount() 释放值，
+// lazyfree_in_thread 在后台线程中为 1 ，
+// 此时仍然被共享的对象通过 lazyfreeDeferDecrRefCount() 交给主线程处理
+extern __thread int lazyfree_in_thread;
+void lazyfreeDeferDecrRefCount(robj *o);
+
+// 共享对象的引用计数：引用计数为这个值的对象永远不会被释放，
+// incrRefCount() 和 decrRefCount() 都不会修改它，
+// 所以后台线程也不需要把共享对象交给主线程处理
+#define REDIS_SHARED_REFCOUNT INT_MAX
+
+// db.c 中，返回键空间字典节点的过期信息占用的内存，
+// keyComputeSize() 用它统计带有过期时间的 key 的内存
+size_t dbEntryExpireInfoSize(dictEntry *de);
+//
+// redis.c 的 createSharedObjects() 通过 makeObjectShared() 创建所有共享对象，
+// 比如： shared.integers[j] = makeObjectShared(createObject(REDIS_STRING,(void*)(long)j));
 
 */
 
@@ -22,15 +164,108 @@ robj *createObject(int type, void *ptr) {
     o->encoding = REDIS_ENCODING_RAW;
     o->ptr = ptr;
     o->refcount = 1;
+    o->arena = 0;
 
-    /* Set the LRU to the current lruclock (minutes resolution). */
-    o->lru = server.lruclock;
+    /* Set the LRU to the current lruclock, or initialize the LFU
+     * counter if the LFU maxmemory policy is used. */
+    initObjectAccess(o);
     return o;
 }
 
+/* Make 'o' a shared object, that is never freed: its reference count is
+ * never modified again. Used for the objects of the 'shared' structure,
+ * so that the threads can use them without synchronization. */
+// 将对象设置为共享对象，共享对象永远不会被释放
+robj *makeObjectShared(robj *o) {
+    redisAssert(o->refcount == 1);
+    o->refcount = REDIS_SHARED_REFCOUNT;
+    return o;
+}
+
+// 创建一个 raw 编码的字符串对象
+// 对象和 sds 分别进行分配
+robj *createRawStringObject(char *ptr, size_t len) {
+    return createObject(REDIS_STRING,sdsnewlen(ptr,len));
+}
+
+/* Create a string object with encoding REDIS_ENCODING_EMBSTR, that is
+ * an object where the sds string is actually an unmodifiable string
+ * allocated in the same chunk as the object itself. */
+// 创建一个 embstr 编码的字符串对象
+// robj 结构、 sdshdr 以及字符串内容保存在同一块内存中，
+// 只需要一次内存分配，并且这个字符串不能被修改
+robj *createEmbeddedStringObject(char *ptr, size_t len) {
+    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr)+len+1);
+    struct sdshdr *sh = (void*)(o+1);
+
+    o->type = REDIS_STRING;
+    o->encoding = REDIS_ENCODING_EMBSTR;
+    o->ptr = sh+1;
+    o->refcount = 1;
+    o->arena = 0;
+    initObjectAccess(o);
+
+    sh->len = len;
+    sh->free = 0;
+    if (ptr) {
+        memcpy(sh->buf,ptr,len);
+        sh->buf[len] = '\0';
+    } else {
+        memset(sh->buf,0,len+1);
+    }
+    return o;
+}
+
+/* Create a string object with EMBSTR encoding if it is smaller than
+ * REDIS_ENCODING_EMBSTR_SIZE_LIMIT, otherwise the RAW encoding is
+ * used.
+ *
+ * The current limit of 39 is chosen so that the biggest string object
+ * we allocate as EMBSTR will still fit into the 64 byte arena of
+ * jemalloc. */
 // 创建字符对象
+// 长度不超过 REDIS_ENCODING_EMBSTR_SIZE_LIMIT 的字符串使用 embstr 编码，
+// 其他字符串使用 raw 编码
+#define REDIS_ENCODING_EMBSTR_SIZE_LIMIT 39
 robj *createStringObject(char *ptr, size_t len) {
-    return createObject(REDIS_STRING,sdsnewlen(ptr,len));
+    if (len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT)
+        return createEmbeddedStringObject(ptr,len);
+    else
+        return createRawStringObject(ptr,len);
+}
+
+/* Create a string object whose sds is carved from the arena 'a'. This is
+ * used for the arguments of the command being processed: the arena is
+ * reset once the command was executed, and objects that are still
+ * referenced at that time were already moved to the heap by
+ * decrRefCount(), see promoteArenaStringObject().
+ *
+ * When the arena is NULL, full, or the string is too big, a normal
+ * heap allocated object is returned. */
+// 创建一个 sds 从 arena 中分配的字符串对象
+// 如果 arena 为 NULL 、空间不足，或者字符串太长，
+// 那么创建一个普通的字符串对象
+robj *createArenaStringObject(sdsarena *a, char *ptr, size_t len) {
+    robj *o;
+    sds s;
+
+    if (a == NULL || len > REDIS_ARENA_MAX_ARG_LEN ||
+        (s = sdsArenaNewLen(a,ptr,len)) == NULL)
+        return createStringObject(ptr,len);
+
+    o = createObject(REDIS_STRING,s);
+    o->arena = 1;
+    return o;
+}
+
+/* Move the sds of an arena backed object to the heap, so that the object
+ * can outlive the reset of the arena. */
+// 将 arena 对象的 sds 复制到堆中，
+// 使得对象在 arena 被重置之后仍然可用
+void promoteArenaStringObject(robj *o) {
+    if (!o->arena) return;
+    o->ptr = sdsnewlen(o->ptr,sdslen(o->ptr));
+    o->arena = 0;
 }
 
 // 从 long long 值中创建对象
@@ -55,6 +290,103 @@ robj *createStringObjectFromLongLong(long long value) {
     return o;
 }
 
+/* Tagged integers are string values stored directly into the value slot
+ * of the keyspace dictionary, without any robj allocation: the value is
+ * shifted left by REDIS_TAGGED_INT_BITS and the low bits are set to
+ * REDIS_TAGGED_INT_TAG, that can't be the case for a real (aligned)
+ * object pointer.
+ *
+ * Lookups return the tagged form as it is, so reading a counter doesn't
+ * allocate anything: the string helpers of this file, checkType() and
+ * objectType() handle it natively, and the reply functions reply with the
+ * integer value.
+ *
+ * Tagged integers are only used on 64 bit systems, a 32 bit pointer can't
+ * hold the REDIS_TAGGED_INT_MIN .. REDIS_TAGGED_INT_MAX range. */
+// 创建一个带标记的整数，调用者需要确保 value 在可表示的范围之内
+robj *createTaggedInteger(long long value) {
+    return (robj*) (uintptr_t)
+        ((((unsigned long long)value) << REDIS_TAGGED_INT_BITS) |
+         REDIS_TAGGED_INT_TAG);
+}
+
+// 取出带标记整数的值
+long long taggedIntegerValue(robj *o) {
+    return ((long long)(intptr_t)o) >> REDIS_TAGGED_INT_BITS;
+}
+
+/* Return 1 if 'value' can be stored into the keyspace as a tagged integer.
+ *
+ * Like shared integers, tagged integers are not used when maxmemory is
+ * set, since they don't have a private LRU field. */
+// 如果 value 可以用带标记的整数保存，那么返回 1
+int taggedIntegerAllowed(long long value) {
+#if REDIS_TAGGED_INT_ENABLED
+    return server.maxmemory == 0 &&
+           value >= REDIS_TAGGED_INT_MIN && value <= REDIS_TAGGED_INT_MAX;
+#else
+    REDIS_NOTUSED(value);
+    return 0;
+#endif
+}
+
+/* Return the representation of 'o' that should be stored as value into
+ * the keyspace: integer encoded strings that taggedIntegerAllowed() are
+ * returned as tagged integers, any other object is returned as it is. */
+// 返回对象在数据库中的保存形式：
+// 如果对象是 int 编码的字符串，并且值可以用带标记的整数保存，
+// 那么返回带标记的整数，否则直接返回对象本身
+robj *tryObjectTagging(robj *o) {
+    if (objectIsTaggedInt(o)) return o;
+    if (o->type != REDIS_STRING || o->encoding != REDIS_ENCODING_INT ||
+        !taggedIntegerAllowed((long)o->ptr))
+        return o;
+    return createTaggedInteger((long)o->ptr);
+}
+
+/* Objects that commands may still be using after the last reference they
+ * own was dropped: the values replaced by tagged integers in dbAdd() /
+ * dbOverwrite(), since the caller may keep using the object it just stored.
+ * They are released by releaseDeferredObjects() when the outermost command
+ * returns. */
+// 延迟释放的对象，在最外层的命令返回时释放
+static robj **deferred_objects = NULL;
+static size_t deferred_objects_count = 0;
+static size_t deferred_objects_size = 0;
+
+/* Drop a reference to 'o' when the outermost command returns. If no command
+ * is executing (for instance while loading the RDB file) nobody can be
+ * using the object, and the reference is dropped immediately. */
+// 在最外层的命令返回时，减少对象的引用计数
+void deferDecrRefCount(robj *o) {
+    if (server.execution_nesting == 0) {
+        decrRefCount(o);
+        return;
+    }
+    if (deferred_objects_count == deferred_objects_size) {
+        deferred_objects_size = deferred_objects_size ?
+                                deferred_objects_size*2 : 16;
+        deferred_objects = zrealloc(deferred_objects,
+            sizeof(robj*)*deferred_objects_size);
+    }
+    deferred_objects[deferred_objects_count++] = o;
+}
+
+// 释放所有延迟释放的对象
+void releaseDeferredObjects(void) {
+    size_t j;
+
+    for (j = 0; j < deferred_objects_count; j++)
+        decrRefCount(deferred_objects[j]);
+    deferred_objects_count = 0;
+    // 不保留一次大事务或者大脚本留下的数组
+    if (deferred_objects_size > 1024) {
+        zfree(deferred_objects);
+        deferred_objects = NULL;
+        deferred_objects_size = 0;
+    }
+}
+
 /* Note: this function is defined into object.c since here it is where it
  * belongs but it is actually designed to be used just for INCRBYFLOAT */
 // 从 long double 值中创建字符串对象
@@ -84,10 +416,30 @@ robj *createStringObjectFromLongDouble(long double value) {
     return createStringObject(buf,len);
 }
 
+/* Duplicate a string object. Integer encoded objects are duplicated as
+ * they are, while sds encoded objects (RAW or EMBSTR) are always duplicated
+ * as RAW, so that the caller can modify the returned string in place (this
+ * is what the reply list and the string commands do). */
 // 复制字符串对象
+// raw 和 embstr 编码的对象都被复制为 raw 编码，调用者可以原地修改它
 robj *dupStringObject(robj *o) {
-    redisAssertWithInfo(NULL,o,o->encoding == REDIS_ENCODING_RAW);
-    return createStringObject(o->ptr,sdslen(o->ptr));
+    robj *d;
+
+    redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
+
+    switch(o->encoding) {
+    case REDIS_ENCODING_RAW:
+    case REDIS_ENCODING_EMBSTR:
+        return createRawStringObject(o->ptr,sdslen(o->ptr));
+    case REDIS_ENCODING_INT:
+        d = createObject(REDIS_STRING, NULL);
+        d->encoding = REDIS_ENCODING_INT;
+        d->ptr = o->ptr;
+        return d;
+    default:
+        redisPanic("Wrong encoding.");
+        break;
+    }
 }
 
 // 创建列表对象
@@ -138,6 +490,7 @@ robj *createZsetObject(void) {
 
     zs->dict = dictCreate(&zsetDictType,NULL);
     zs->zsl = zslCreate();
+    zs->zbt = NULL;
     o = createObject(REDIS_ZSET,zs);
     o->encoding = REDIS_ENCODING_SKIPLIST;
     return o;
@@ -151,9 +504,73 @@ robj *createZsetZiplistObject(void) {
     return o;
 }
 
+/* Return a copy of the value object 'o' with the same type and encoding
+ * (EMBSTR strings are copied as RAW, see dupStringObject()), that can be
+ * modified without affecting the original. The elements of
+ * lists, sets and hashes encoded as linked lists or hash tables are
+ * objects that are never modified in place, so they are shared between
+ * the two values. */
+// 创建值对象的副本，副本和原对象共享元素对象
+robj *dupValueObject(robj *o) {
+    robj *d;
+
+    if (o->type == REDIS_STRING) {
+        d = dupStringObject(o);
+    } else if (o->type == REDIS_ZSET) {
+        d = zsetDup(o);
+    } else if (o->encoding == REDIS_ENCODING_ZIPLIST ||
+               o->encoding == REDIS_ENCODING_INTSET) {
+        // 连续内存的编码，直接复制整块内存
+        size_t len = (o->encoding == REDIS_ENCODING_ZIPLIST) ?
+                     ziplistBlobLen(o->ptr) : intsetBlobLen(o->ptr);
+        void *ptr = zmalloc(len);
+
+        memcpy(ptr,o->ptr,len);
+        d = createObject(o->type,ptr);
+        d->encoding = o->encoding;
+    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+        list *l = o->ptr;
+        listIter li;
+        listNode *ln;
+
+        d = createListObject();
+        listRewind(l,&li);
+        while((ln = listNext(&li))) {
+            incrRefCount(listNodeValue(ln));
+            listAddNodeTail(d->ptr,listNodeValue(ln));
+        }
+    } else if (o->encoding == REDIS_ENCODING_HT) {
+        dict *src = o->ptr, *dst;
+        dictIterator *di;
+        dictEntry *de;
+
+        dst = dictCreate(o->type == REDIS_SET ? &setDictType : &hashDictType,
+                         NULL);
+        dictExpand(dst,dictSize(src));
+        di = dictGetIterator(src);
+        while((de = dictNext(di)) != NULL) {
+            robj *key = dictGetKey(de), *val = dictGetVal(de);
+
+            incrRefCount(key);
+            if (val) incrRefCount(val);
+            dictAdd(dst,key,val);
+        }
+        dictReleaseIterator(di);
+        d = createObject(o->type,dst);
+        d->encoding = REDIS_ENCODING_HT;
+    } else {
+        redisPanic("Unknown value encoding");
+    }
+    // 副本继承原对象的访问信息
+    d->lru = o->lru;
+    return d;
+}
+
 // 释放字符串对象
+// embstr 编码的 sds 和对象一起被释放
 void freeStringObject(robj *o) {
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    // arena 中的 sds 在 arena 重置时回收
+    if (o->encoding == REDIS_ENCODING_RAW && !o->arena) {
         sdsfree(o->ptr);
     }
 }
@@ -186,19 +603,60 @@ void freeSetObject(robj *o) {
     }
 }
 
+/* The members of a skiplist or B+tree encoded sorted set are referenced
+ * both by the dictionary and by the ordered index. In the lazy free thread
+ * the reference of the dictionary is dropped without calling decrRefCount()
+ * for the members that nobody else references, so that they are freed once
+ * by the ordered index, instead of being handed back to the main thread
+ * twice because their reference count is 2. */
+// 释放有序集合的字典，在后台线程中，只被有序集合引用的成员由有序索引释放
+static void freeZsetDict(dict *d) {
+    if (lazyfree_in_thread) {
+        dictType type = *d->type;
+        dictIterator *di = dictGetIterator(d);
+        dictEntry *de;
+
+        while ((de = dictNext(di)) != NULL) {
+            robj *ele = dictGetKey(de);
+
+            // 丢弃字典的引用，被共享的成员仍然交给主线程处理
+            if (ele->refcount == 2)
+                ele->refcount = 1;
+            else
+                decrRefCount(ele);
+        }
+        dictReleaseIterator(di);
+        // 字典已经不再持有成员的引用
+        type.keyDestructor = NULL;
+        d->type = &type;
+        dictRelease(d);
+        return;
+    }
+    dictRelease(d);
+}
+
 // 释放 zset 对象
 void freeZsetObject(robj *o) {
     zset *zs;
     switch (o->encoding) {
     case REDIS_ENCODING_SKIPLIST:
         zs = o->ptr;
-        dictRelease(zs->dict);
+        freeZsetDict(zs->dict);
         zslFree(zs->zsl);
         zfree(zs);
         break;
+    case REDIS_ENCODING_BTREE:
+        zs = o->ptr;
+        freeZsetDict(zs->dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
+        break;
     case REDIS_ENCODING_ZIPLIST:
         zfree(o->ptr);
         break;
+    case REDIS_ENCODING_BLOCKS:
+        zblkFree(o->ptr);
+        break;
     default:
         redisPanic("Unknown sorted set encoding");
     }
@@ -220,7 +678,9 @@ void freeHashObject(robj *o) {
 }
 
 // 增加引用计数
+// 带标记的整数没有引用计数，共享对象的引用计数不会被修改
 void incrRefCount(robj *o) {
+    if (objectIsTaggedInt(o) || o->refcount == REDIS_SHARED_REFCOUNT) return;
     o->refcount++;
 }
 
@@ -229,6 +689,7 @@ void incrRefCount(robj *o) {
 void decrRefCount(void *obj) {
     robj *o = obj;
 
+    if (objectIsTaggedInt(o) || o->refcount == REDIS_SHARED_REFCOUNT) return;
     if (o->refcount <= 0) redisPanic("decrRefCount against refcount <= 0");
     // 如果引用数为 0 ，释放对象
     if (o->refcount == 1) {
@@ -242,6 +703,23 @@ void decrRefCount(void *obj) {
         }
         zfree(o);
     } else {
+        /* The lazy free thread never modifies the reference count of an
+         * object that is still shared with the main thread. */
+        // 后台线程将共享对象交给主线程处理
+        if (lazyfree_in_thread) {
+            lazyfreeDeferDecrRefCount(o);
+            return;
+        }
+        /* An arena backed object is referenced by the argv of the client
+         * it was created for, that always releases it via decrRefCount()
+         * before the arena gets reset. If someone else still holds a
+         * reference (the object was stored into the keyspace, the slow
+         * log, a MULTI queue, ...) we move the string to the heap now. */
+        // arena 对象总是由客户端的 argv 持有，
+        // 并且 argv 会在 arena 被重置之前释放它们，
+        // 如果此时对象还被其他地方引用（比如被保存到了数据库、
+        // slow log 或者事务队列中），那么将它提升到堆中
+        if (o->arena) promoteArenaStringObject(o);
         o->refcount--;
     }
 }
@@ -266,7 +744,7 @@ robj *resetRefCount(robj *obj) {
 
 // 查看给定对象 obj 的类型是否为 type
 int checkType(redisClient *c, robj *o, int type) {
-    if (o->type != type) {
+    if (objectType(o) != type) {
         addReply(c,shared.wrongtypeerr);
         return 1;
     }
@@ -275,6 +753,10 @@ int checkType(redisClient *c, robj *o, int type) {
 
 // 检查给定对象能否表示为 long long 类型值
 int isObjectRepresentableAsLongLong(robj *o, long long *llval) {
+    if (objectIsTaggedInt(o)) {
+        if (llval) *llval = taggedIntegerValue(o);
+        return REDIS_OK;
+    }
     redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
     if (o->encoding == REDIS_ENCODING_INT) {
         if (llval) *llval = (long) o->ptr;
@@ -289,40 +771,87 @@ int isObjectRepresentableAsLongLong(robj *o, long long *llval) {
 robj *tryObjectEncoding(robj *o) {
     long value;
     sds s = o->ptr;
+    size_t len;
+
+    /* Make sure this is a string object, the only type we encode
+     * in this function. Other types use encoded memory efficient
+     * representations but are handled by the commands implementing
+     * the type. */
+    redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
 
-    if (o->encoding != REDIS_ENCODING_RAW)
-        return o; /* Already encoded */
+    /* We try some specialized encoding only for objects that are
+     * RAW or EMBSTR encoded, in other words objects that are still
+     * in represented by an actually array of chars. */
+    if (!sdsEncodedObject(o)) return o;
 
     /* It's not safe to encode shared objects: shared objects can be shared
      * everywhere in the "object space" of Redis. Encoded objects can only
      * appear as "values" (and not, for instance, as keys) */
      if (o->refcount > 1) return o;
 
-    /* Currently we try to encode only strings */
-    redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
+    /* Check if we can represent this string as a long integer.
+     * Note that we are sure that a string larger than 21 chars is not
+     * representable as a 64 bit integer. */
+    len = sdslen(s);
+    if (len <= 21 && string2l(s,len,&value)) {
+        /* Ok, this object can be encoded...
+         *
+         * Can I use a shared object? Only if the object is inside a given range
+         *
+         * Note that we also avoid using shared integers when maxmemory is used
+         * because every object needs to have a private LRU field for the LRU
+         * algorithm to work well. */
+        if (server.maxmemory == 0 && value >= 0 && value < REDIS_SHARED_INTEGERS) {
+            // 将值放到共享池中
+            decrRefCount(o);
+            incrRefCount(shared.integers[value]);
+            return shared.integers[value];
+        } else if (o->encoding == REDIS_ENCODING_RAW) {
+            // 值转换为数字类型
+            o->encoding = REDIS_ENCODING_INT;
+            if (!o->arena) sdsfree(o->ptr);
+            o->arena = 0;
+            o->ptr = (void*) value;
+            return o;
+        } else {
+            // embstr 的 sds 不能单独释放，只能创建新对象
+            decrRefCount(o);
+            return createStringObjectFromLongLong(value);
+        }
+    }
 
-    /* Check if we can represent this string as a long integer */
-    if (!string2l(s,sdslen(s),&value)) return o;
+    /* If the string is small and is still RAW encoded,
+     * try the EMBSTR encoding which is more efficient.
+     * In this representation the object and the SDS string are allocated
+     * in the same chunk of memory to save space and cache misses. */
+    // 长度较短的 raw 字符串转换为 embstr 编码
+    if (len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT) {
+        robj *emb;
+
+        if (o->encoding == REDIS_ENCODING_EMBSTR) return o;
+        emb = createEmbeddedStringObject(s,len);
+        decrRefCount(o);
+        return emb;
+    }
 
-    /* Ok, this object can be encoded...
+    /* We can't encode the object...
      *
-     * Can I use a shared object? Only if the object is inside a given range
+     * Do the last try, and at least optimize the SDS string inside
+     * the string object to require little space, in case there
+     * is more than 10% of free space at the end of the SDS string.
      *
-     * Note that we also avoid using shared integers when maxmemory is used
-     * because every object needs to have a private LRU field for the LRU
-     * algorithm to work well. */
-    if (server.maxmemory == 0 && value >= 0 && value < REDIS_SHARED_INTEGERS) {
-        // 将值放到共享池中
-        decrRefCount(o);
-        incrRefCount(shared.integers[value]);
-        return shared.integers[value];
-    } else {
-        // 值转换为数字类型
-        o->encoding = REDIS_ENCODING_INT;
-        sdsfree(o->ptr);
-        o->ptr = (void*) value;
-        return o;
+     * We do that only for relatively large strings as this branch
+     * is only entered if the length of the string is greater than
+     * REDIS_ENCODING_EMBSTR_SIZE_LIMIT. */
+    // 回收 raw 字符串中超过 10% 的预留空间
+    if (o->encoding == REDIS_ENCODING_RAW && !o->arena &&
+        sdsavail(s) > len/10)
+    {
+        o->ptr = sdsRemoveFreeSpace(o->ptr);
     }
+
+    /* Return the original object. */
+    return o;
 }
 
 /* Get a decoded version of an encoded object (returned as a new object).
@@ -332,7 +861,13 @@ robj *tryObjectEncoding(robj *o) {
 robj *getDecodedObject(robj *o) {
     robj *dec;
 
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (objectIsTaggedInt(o)) {
+        char buf[32];
+        int len = ll2string(buf,32,taggedIntegerValue(o));
+
+        return createStringObject(buf,len);
+    }
+    if (sdsEncodedObject(o)) {
         incrRefCount(o);
         return o;
     }
@@ -347,6 +882,21 @@ robj *getDecodedObject(robj *o) {
     }
 }
 
+// 如果字符串对象是 int 编码的，或者是一个带标记的整数，
+// 那么将它的值保存到 *llval 并返回 1 ，否则返回 0
+static int stringObjectIntegerValue(robj *o, long long *llval) {
+    if (objectIsTaggedInt(o)) {
+        *llval = taggedIntegerValue(o);
+        return 1;
+    }
+    redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
+    if (o->encoding == REDIS_ENCODING_INT) {
+        *llval = (long) o->ptr;
+        return 1;
+    }
+    return 0;
+}
+
 /* Compare two string objects via strcmp() or alike.
  * Note that the objects may be integer-encoded. In such a case we
  * use ll2string() to get a string representation of the numbers on the stack
@@ -358,20 +908,20 @@ robj *getDecodedObject(robj *o) {
 // 针对不同的对象，使用不同的方法，
 // 在两个字符串对象之间进行类似于 strcmp 的对比操作
 int compareStringObjects(robj *a, robj *b) {
-    redisAssertWithInfo(NULL,a,a->type == REDIS_STRING && b->type == REDIS_STRING);
     char bufa[128], bufb[128], *astr, *bstr;
+    long long lla, llb;
     int bothsds = 1;
 
     if (a == b) return 0;
-    if (a->encoding != REDIS_ENCODING_RAW) {
-        ll2string(bufa,sizeof(bufa),(long) a->ptr);
+    if (stringObjectIntegerValue(a,&lla)) {
+        ll2string(bufa,sizeof(bufa),lla);
         astr = bufa;
         bothsds = 0;
     } else {
         astr = a->ptr;
     }
-    if (b->encoding != REDIS_ENCODING_RAW) {
-        ll2string(bufb,sizeof(bufb),(long) b->ptr);
+    if (stringObjectIntegerValue(b,&llb)) {
+        ll2string(bufb,sizeof(bufb),llb);
         bstr = bufb;
         bothsds = 0;
     } else {
@@ -386,8 +936,10 @@ int compareStringObjects(robj *a, robj *b) {
  * because it can perform some more optimization. */
 // 检查字符串对象 a 和 b 是否相同
 int equalStringObjects(robj *a, robj *b) {
-    if (a->encoding != REDIS_ENCODING_RAW && b->encoding != REDIS_ENCODING_RAW){
-        return a->ptr == b->ptr;
+    long long lla, llb;
+
+    if (stringObjectIntegerValue(a,&lla) && stringObjectIntegerValue(b,&llb)) {
+        return lla == llb;
     } else {
         return compareStringObjects(a,b) == 0;
     }
@@ -395,13 +947,14 @@ int equalStringObjects(robj *a, robj *b) {
 
 // 返回字符串对象的长度
 size_t stringObjectLen(robj *o) {
-    redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
-    if (o->encoding == REDIS_ENCODING_RAW) {
-        return sdslen(o->ptr);
-    } else {
+    long long llval;
+
+    if (stringObjectIntegerValue(o,&llval)) {
         char buf[32];
 
-        return ll2string(buf,32,(long)o->ptr);
+        return ll2string(buf,32,llval);
+    } else {
+        return sdslen(o->ptr);
     }
 }
 
@@ -412,9 +965,11 @@ int getDoubleFromObject(robj *o, double *target) {
 
     if (o == NULL) {
         value = 0;
+    } else if (objectIsTaggedInt(o)) {
+        value = taggedIntegerValue(o);
     } else {
         redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
-        if (o->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(o)) {
             errno = 0;
             value = strtod(o->ptr, &eptr);
             if (isspace(((char*)o->ptr)[0]) || eptr[0] != '\0' ||
@@ -452,9 +1007,11 @@ int getLongDoubleFromObject(robj *o, long double *target) {
 
     if (o == NULL) {
         value = 0;
+    } else if (objectIsTaggedInt(o)) {
+        value = taggedIntegerValue(o);
     } else {
         redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
-        if (o->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(o)) {
             errno = 0;
             value = strtold(o->ptr, &eptr);
             if (isspace(((char*)o->ptr)[0]) || eptr[0] != '\0' ||
@@ -492,9 +1049,11 @@ int getLongLongFromObject(robj *o, long long *target) {
 
     if (o == NULL) {
         value = 0;
+    } else if (objectIsTaggedInt(o)) {
+        value = taggedIntegerValue(o);
     } else {
         redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
-        if (o->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(o)) {
             errno = 0;
             value = strtoll(o->ptr, &eptr, 10);
             if (isspace(((char*)o->ptr)[0]) || eptr[0] != '\0' ||
@@ -552,22 +1111,452 @@ char *strEncoding(int encoding) {
     case REDIS_ENCODING_ZIPLIST: return "ziplist";
     case REDIS_ENCODING_INTSET: return "intset";
     case REDIS_ENCODING_SKIPLIST: return "skiplist";
+    case REDIS_ENCODING_BTREE: return "btree";
+    case REDIS_ENCODING_BLOCKS: return "blocks";
+    case REDIS_ENCODING_EMBSTR: return "embstr";
     default: return "unknown";
     }
 }
 
-/* Given an object returns the min number of seconds the object was never
- * requested, using an approximated LRU algorithm. */
-// 返回对象距离上次被请求所间隔的秒数
-unsigned long estimateObjectIdleTime(robj *o) {
-    if (server.lruclock >= o->lru) {
-        return (server.lruclock - o->lru) * REDIS_LRU_CLOCK_RESOLUTION;
+/* ---------------------- LRU clock and LFU counter ------------------------ */
+
+/* Return the LRU clock, based on the clock resolution. This is a time
+ * in a reduced-bits format that can be used to set and check the
+ * object->lru field of redisObject structures. */
+// 返回 LRU 时钟（以 REDIS_LRU_CLOCK_RESOLUTION 毫秒为单位），
+// 可以用于设置和检查 robj 的 lru 属性
+unsigned int getLRUClock(void) {
+    return (mstime()/REDIS_LRU_CLOCK_RESOLUTION) & REDIS_LRU_CLOCK_MAX;
+}
+
+/* Given an object returns the min number of milliseconds the object was
+ * never requested, using an approximated LRU algorithm. */
+// 返回对象距离上次被请求所间隔的毫秒数
+unsigned long long estimateObjectIdleTime(robj *o) {
+    unsigned long long lruclock = LRU_CLOCK();
+
+    if (lruclock >= o->lru) {
+        return (lruclock - o->lru) * REDIS_LRU_CLOCK_RESOLUTION;
     } else {
-        return ((REDIS_LRU_CLOCK_MAX - o->lru) + server.lruclock) *
+        return (lruclock + (REDIS_LRU_CLOCK_MAX - o->lru)) *
                     REDIS_LRU_CLOCK_RESOLUTION;
     }
 }
 
+/* When the LFU policy is used the 23 bits of the lru field are split
+ * into two parts:
+ *
+ *          15 bits          8 bits
+ *     +----------------+-----------+
+ *     | Last decr time |  Counter  |
+ *     +----------------+-----------+
+ *
+ * The 15 bits are the time, in minutes, of the last time the counter was
+ * decremented, and wrap every ~22 days. The 8 bits are a logarithmic
+ * counter of the access frequency: the more the counter is big, the less
+ * likely it is that it gets incremented on access, so that 255 can
+ * represent millions of accesses. The counter is halved over time (see
+ * lfu_decay_time) so that keys that were hot in the past can cool down. */
+
+// 返回以分钟为单位的时间，只保留低 15 位
+unsigned long LFUGetTimeInMinutes(void) {
+    return (server.unixtime/60) & REDIS_LFU_TIME_MAX;
+}
+
+// 返回从 ldt 开始经过的分钟数，处理时间回绕的情况
+unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = LFUGetTimeInMinutes();
+
+    if (now >= ldt) return now-ldt;
+    return REDIS_LFU_TIME_MAX-ldt+now+1;
+}
+
+/* Logarithmically increment a counter. The greater is the current counter
+ * value the less likely is that it gets really incremented.
+ * This runs on every key access: the per thread dictRandom() generator is
+ * used instead of rand(), that takes a global lock and has weak low bits. */
+// 对数地增加计数器：计数器的值越大，增加的概率就越小
+uint8_t LFULogIncr(uint8_t counter) {
+    double r, baseval, p;
+
+    if (counter == REDIS_LFU_COUNTER_MAX) return REDIS_LFU_COUNTER_MAX;
+    // 取随机数的高 53 位，得到 [0,1) 之间的 double
+    r = (double)(dictRandom() >> 11) / (double)(1ULL << 53);
+    baseval = counter - REDIS_LFU_INIT_VAL;
+    if (baseval < 0) baseval = 0;
+    p = 1.0/(baseval*server.lfu_log_factor+1);
+    if (r < p) counter++;
+    return counter;
+}
+
+/* Return the counter of the object, decremented by one for every
+ * lfu_decay_time minutes elapsed since the last decrement. The object
+ * is not modified: it is up to the caller to store the new value. */
+// 返回对象经过衰减之后的访问计数器，
+// 从上次衰减开始，每经过 lfu_decay_time 分钟，计数器的值就减一
+unsigned long LFUDecrAndReturn(robj *o) {
+    unsigned long ldt = o->lru >> REDIS_LFU_COUNTER_BITS;
+    unsigned long counter = o->lru & REDIS_LFU_COUNTER_MAX;
+    unsigned long num_periods;
+
+    num_periods = server.lfu_decay_time ?
+        LFUTimeElapsed(ldt) / server.lfu_decay_time : 0;
+    if (num_periods)
+        counter = (num_periods > counter) ? 0 : counter - num_periods;
+    return counter;
+}
+
+// 初始化新对象的访问信息
+void initObjectAccess(robj *o) {
+    if (maxmemoryPolicyIsLFU(server.maxmemory_policy)) {
+        o->lru = (LFUGetTimeInMinutes()<<REDIS_LFU_COUNTER_BITS) |
+                 REDIS_LFU_INIT_VAL;
+    } else {
+        o->lru = LRU_CLOCK();
+    }
+}
+
+/* Update the access information of an object that is being accessed by
+ * a command: the LRU time, or the LFU counter (after applying the decay)
+ * depending on the maxmemory policy. */
+// 在对象被访问时，更新它的 LRU 时间或者 LFU 计数器
+void updateObjectAccess(robj *o) {
+    if (maxmemoryPolicyIsLFU(server.maxmemory_policy)) {
+        unsigned long counter = LFUDecrAndReturn(o);
+
+        counter = LFULogIncr(counter);
+        o->lru = (LFUGetTimeInMinutes()<<REDIS_LFU_COUNTER_BITS) | counter;
+    } else {
+        o->lru = LRU_CLOCK();
+    }
+}
+
+/* ---------------------------- Memory introspection ------------------------ */
+
+/* Number of elements sampled by default when computing the size of a
+ * nested container: the size of the sampled elements is used in order to
+ * estimate the size of the whole container. */
+// 计算容器对象大小时，默认采样的元素数量
+#define REDIS_MEMORY_SAMPLES_DEFAULT 5
+
+// 直方图的桶数量：第 i 个桶统计大小小于 2^(i+REDIS_MEMHIST_MIN_BITS) 字节的 key ，
+// 最后一个桶统计所有更大的 key
+#define REDIS_MEMHIST_BUCKETS 16
+#define REDIS_MEMHIST_MIN_BITS 6
+
+// 每次 OBJECT MEMSTATS 默认采样的 key 数量
+#define REDIS_MEMHIST_COUNT_DEFAULT 100
+// 每次 OBJECT MEMSTATS 最多采样的 key 数量，更大的 COUNT 会被截断，
+// 以免一次调用阻塞服务器太长时间
+#define REDIS_MEMHIST_COUNT_MAX 10000
+
+// 返回 sds 字符串占用的内存（以分配器的可用大小计算）
+static size_t sdsZmallocSize(sds s) {
+    return zmalloc_size(sdsAllocPtr(s));
+}
+
+/* Return the memory used by a string object, including the object
+ * structure itself. Shared and tagged integers don't use any memory that
+ * is private to the key, but we still report the object size for
+ * shared objects since it's what they would cost once unshared. */
+// 返回字符串对象占用的内存，包括 robj 结构本身
+static size_t stringObjectAllocSize(robj *o) {
+    if (objectIsTaggedInt(o)) return 0;
+    if (o->encoding == REDIS_ENCODING_RAW)
+        return zmalloc_size(o) + sdsZmallocSize(o->ptr);
+    // embstr 的 sds 和对象在同一块内存中， int 编码则没有额外的分配
+    return zmalloc_size(o);
+}
+
+// 返回字典结构以及哈希表数组占用的内存，不包括字典节点
+static size_t dictTablesAllocSize(dict *d) {
+    size_t asize = zmalloc_size(d);
+
+    if (d->ht[0].table) asize += zmalloc_size(d->ht[0].table);
+    if (d->ht[1].table) asize += zmalloc_size(d->ht[1].table);
+    return asize;
+}
+
+/* Sample up to 'samples' entries of the dictionary (all of them if
+ * 'samples' is zero) and return the estimated memory used by all the
+ * dictionary entries, keys and values. If 'hasval' is false the values
+ * are not accounted, for instance because they point to memory owned by
+ * other structures. */
+// 采样字典中的节点，估算所有节点、键和值占用的内存
+static size_t dictEntriesAllocSize(dict *d, size_t samples, int hasval) {
+    dictIterator *di;
+    dictEntry *de;
+    size_t elesize = 0, samplecount = 0;
+
+    if (dictSize(d) == 0) return 0;
+    di = dictGetIterator(d);
+    while ((samples == 0 || samplecount < samples) &&
+           (de = dictNext(di)) != NULL)
+    {
+        elesize += zmalloc_size(de) + stringObjectAllocSize(dictGetKey(de));
+        if (hasval) elesize += stringObjectAllocSize(dictGetVal(de));
+        samplecount++;
+    }
+    dictReleaseIterator(di);
+    return (double)elesize/samplecount*dictSize(d);
+}
+
+/* Return the memory used by the object 'o' and everything it references,
+ * using the usable size reported by the allocator for every allocation.
+ *
+ * Nested containers with more than 'samples' elements are not scanned
+ * entirely: only the first 'samples' elements are measured and the result
+ * is extrapolated to the whole container. When 'samples' is zero every
+ * element is measured. */
+// 返回对象 o 及其引用的所有数据所占用的内存字节数
+//
+// 对于元素数量大于 samples 的容器，只计算前 samples 个元素的大小，
+// 然后根据元素数量估算整个容器的大小
+// samples 为 0 时计算所有元素
+size_t objectComputeSize(robj *o, size_t samples) {
+    size_t asize, elesize = 0, samplecount = 0;
+
+    // 带标记的整数不使用任何内存
+    if (objectIsTaggedInt(o)) return 0;
+
+    if (o->type == REDIS_STRING) {
+        asize = stringObjectAllocSize(o);
+
+    } else if (o->type == REDIS_LIST) {
+        asize = zmalloc_size(o);
+        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            asize += zmalloc_size(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+            list *l = o->ptr;
+            listNode *ln;
+            listIter li;
+
+            asize += zmalloc_size(l);
+            listRewind(l,&li);
+            while ((samples == 0 || samplecount < samples) &&
+                   (ln = listNext(&li)) != NULL)
+            {
+                elesize += zmalloc_size(ln) + stringObjectAllocSize(ln->value);
+                samplecount++;
+            }
+            if (samplecount)
+                asize += (double)elesize/samplecount*listLength(l);
+        } else {
+            redisPanic("Unknown list encoding");
+        }
+
+    } else if (o->type == REDIS_SET) {
+        asize = zmalloc_size(o);
+        if (o->encoding == REDIS_ENCODING_INTSET) {
+            asize += zmalloc_size(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_HT) {
+            asize += dictTablesAllocSize(o->ptr) +
+                     dictEntriesAllocSize(o->ptr,samples,0);
+        } else {
+            redisPanic("Unknown set encoding");
+        }
+
+    } else if (o->type == REDIS_ZSET) {
+        asize = zmalloc_size(o);
+        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            asize += zmalloc_size(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_SKIPLIST) {
+            zset *zs = o->ptr;
+            zskiplist *zsl = zs->zsl;
+            zskiplistNode *zn = zsl->header->level[0].forward;
+
+            // 字典的值指向跳跃表节点中的分值，成员对象由两者共享，
+            // 所以字典部分只计算结构和节点，成员对象在遍历跳跃表时计算
+            asize += zmalloc_size(zs) + dictTablesAllocSize(zs->dict) +
+                     dictSize(zs->dict)*sizeof(dictEntry) +
+                     zmalloc_size(zsl) + zmalloc_size(zsl->header);
+            while ((samples == 0 || samplecount < samples) && zn != NULL) {
+                elesize += zmalloc_size(zn) + stringObjectAllocSize(zn->obj);
+                samplecount++;
+                zn = zn->level[0].forward;
+            }
+            if (samplecount)
+                asize += (double)elesize/samplecount*zsl->length;
+        } else if (o->encoding == REDIS_ENCODING_BTREE) {
+            zset *zs = o->ptr;
+            zbtree *zbt = zs->zbt;
+            zbtreeLeaf *leaf = zbt->head;
+            size_t leafsize = 0, leaves = 0;
+            int j;
+
+            // 分值保存在字典节点中，成员对象由字典和 B+ 树共享
+            asize += zmalloc_size(zs) + dictTablesAllocSize(zs->dict) +
+                     dictSize(zs->dict)*sizeof(dictEntry) + zmalloc_size(zbt);
+            while ((samples == 0 || samplecount < samples) && leaf != NULL) {
+                leafsize += zmalloc_size(leaf);
+                leaves++;
+                for (j = 0; j < leaf->hdr.count; j++) {
+                    elesize += stringObjectAllocSize(leaf->objs[j]);
+                    samplecount++;
+                }
+                leaf = leaf->next;
+            }
+            if (samplecount) {
+                // 按取样得出的每个元素的平均大小估算叶子节点和成员对象，
+                // 内部节点的数量约为叶子节点数量的 1/(扇出-1)
+                double perele = (double)(elesize+leafsize)/samplecount;
+                double nleaves = (double)leaves/samplecount*zbt->length;
+                asize += perele*zbt->length +
+                         nleaves/(ZBTREE_FANOUT-1)*sizeof(zbtreeInner);
+            }
+        } else if (o->encoding == REDIS_ENCODING_BLOCKS) {
+            zblocks *zb = o->ptr;
+            unsigned int j;
+
+            // 块的数量很少，所以总是计算所有块
+            asize += zmalloc_size(zb);
+            if (zb->nblocks)
+                asize += zmalloc_size(zb->zls) + zmalloc_size(zb->first) +
+                         zmalloc_size(zb->counts);
+            for (j = 0; j < zb->nblocks; j++)
+                asize += zmalloc_size(zb->zls[j]);
+        } else {
+            redisPanic("Unknown sorted set encoding");
+        }
+
+    } else if (o->type == REDIS_HASH) {
+        asize = zmalloc_size(o);
+        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            asize += zmalloc_size(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_HT) {
+            asize += dictTablesAllocSize(o->ptr) +
+                     dictEntriesAllocSize(o->ptr,samples,1);
+        } else {
+            redisPanic("Unknown hash encoding");
+        }
+
+    } else {
+        redisPanic("Unknown object type");
+    }
+    return asize;
+}
+
+/* Return the memory used by a key of the keyspace: the dictionary entry,
+ * the key sds, the expire info allocated out of line for volatile keys,
+ * and the value. */
+// 返回数据库中一个键值对占用的内存，包括字典节点、键、过期信息和值
+size_t keyComputeSize(dictEntry *de, size_t samples) {
+    return zmalloc_size(de) + sdsZmallocSize(dictGetKey(de)) +
+           dbEntryExpireInfoSize(de) +
+           objectComputeSize(dictGetVal(de),samples);
+}
+
+/* The keyspace histogram is computed incrementally: every call to
+ * OBJECT MEMSTATS samples a bounded number of random keys of the current
+ * database and accumulates the result here, so that the estimate gets
+ * better at every call without ever blocking the server for a full scan.
+ * The accumulated state is reset when OBJECT MEMSTATS is called against
+ * a different DB, or with the RESET option. */
+// 键空间内存直方图
+//
+// 每次执行 OBJECT MEMSTATS 都会随机采样一定数量的 key ，并将结果累积到这里，
+// 所以估算的结果会随着调用次数的增加而越来越准确，
+// 并且服务器永远不必为了统计而遍历整个数据库
+typedef struct memoryHistogram {
+    // 统计所属的数据库
+    int dbid;
+    // 已采样的 key 总数
+    unsigned long long samples;
+    // 每种类型已采样的 key 数量
+    unsigned long long keys[REDIS_HASH+1];
+    // 每种类型已采样的 key 的总字节数
+    unsigned long long bytes[REDIS_HASH+1];
+    // 每种类型的大小分布
+    unsigned long long buckets[REDIS_HASH+1][REDIS_MEMHIST_BUCKETS];
+} memoryHistogram;
+
+static memoryHistogram memhist = { -1 };
+
+// 重置直方图
+static void memoryHistogramReset(int dbid) {
+    memset(&memhist,0,sizeof(memhist));
+    memhist.dbid = dbid;
+}
+
+// 返回 size 所属的直方图桶
+static int memoryHistogramBucket(size_t size) {
+    int bucket = 0;
+
+    size >>= REDIS_MEMHIST_MIN_BITS;
+    while (size && bucket < REDIS_MEMHIST_BUCKETS-1) {
+        size >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// 从 db 中随机采样 count 个 key ，并将它们的大小累积到直方图中
+static void memoryHistogramSample(redisDb *db, long count, size_t samples) {
+    if (memhist.dbid != db->id) memoryHistogramReset(db->id);
+    if (dictSize(db->dict) == 0) return;
+
+    while (count--) {
+        dictEntry *de = dictGetRandomKey(db->dict);
+        robj *val = dictGetVal(de);
+        int type = objectType(val);
+        size_t size = keyComputeSize(de,samples);
+
+        memhist.samples++;
+        memhist.keys[type]++;
+        memhist.bytes[type] += size;
+        memhist.buckets[type][memoryHistogramBucket(size)]++;
+    }
+}
+
+// 返回类型的名字
+static char *strType(int type) {
+    switch(type) {
+    case REDIS_STRING: return "string";
+    case REDIS_LIST: return "list";
+    case REDIS_SET: return "set";
+    case REDIS_ZSET: return "zset";
+    case REDIS_HASH: return "hash";
+    default: return "unknown";
+    }
+}
+
+/* Reply with the accumulated histogram. For every type we report the number
+ * of sampled keys, the average size, the estimated total memory used by
+ * keys of that type in the whole DB, and the size distribution. */
+// 回复累积的直方图
+static void memoryHistogramReply(redisClient *c) {
+    unsigned long long dbsize = dictSize(c->db->dict);
+    int type, j;
+
+    addReplyMultiBulkLen(c,4+(REDIS_HASH+1));
+    addReplyBulkCString(c,"samples");
+    addReplyLongLong(c,memhist.samples);
+    addReplyBulkCString(c,"keys");
+    addReplyLongLong(c,dbsize);
+    for (type = 0; type <= REDIS_HASH; type++) {
+        unsigned long long avg = 0, estimate = 0;
+
+        if (memhist.keys[type]) {
+            avg = memhist.bytes[type] / memhist.keys[type];
+            // 按照该类型在样本中所占的比例，估算整个数据库中该类型的内存
+            estimate = (double)memhist.bytes[type]/memhist.samples*dbsize;
+        }
+        addReplyMultiBulkLen(c,10);
+        addReplyBulkCString(c,"type");
+        addReplyBulkCString(c,strType(type));
+        addReplyBulkCString(c,"sampled-keys");
+        addReplyLongLong(c,memhist.keys[type]);
+        addReplyBulkCString(c,"avg-bytes");
+        addReplyLongLong(c,avg);
+        addReplyBulkCString(c,"estimated-bytes");
+        addReplyLongLong(c,estimate);
+        addReplyBulkCString(c,"histogram");
+        addReplyMultiBulkLen(c,REDIS_MEMHIST_BUCKETS);
+        for (j = 0; j < REDIS_MEMHIST_BUCKETS; j++)
+            addReplyLongLong(c,memhist.buckets[type][j]);
+    }
+}
+
 /* This is an helper function for the DEBUG command. We need to lookup keys
  * without any modification of LRU or other parameters. */
 // 一个 DEBUG 辅助函数
@@ -576,7 +1565,7 @@ robj *objectCommandLookup(redisClient *c, robj *key) {
     dictEntry *de;
 
     if ((de = dictFind(c->db->dict,key->ptr)) == NULL) return NULL;
-    return (robj*) dictGetVal(de);
+    return dictGetVal(de);
 }
 
 // lookup 或返回一个回应
@@ -592,20 +1581,99 @@ robj *objectCommandLookupOrReply(redisClient *c, robj *key, robj *reply) {
 // OBJECT 命令的实现
 void objectCommand(redisClient *c) {
     robj *o;
+    dictEntry *de;
 
     if (!strcasecmp(c->argv[1]->ptr,"refcount") && c->argc == 3) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
                 == NULL) return;
-        addReplyLongLong(c,o->refcount);
+        // 带标记的整数只被数据库引用
+        addReplyLongLong(c,objectIsTaggedInt(o) ? 1 : o->refcount);
     } else if (!strcasecmp(c->argv[1]->ptr,"encoding") && c->argc == 3) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
                 == NULL) return;
-        addReplyBulkCString(c,strEncoding(o->encoding));
+        addReplyBulkCString(c,strEncoding(objectIsTaggedInt(o) ?
+            REDIS_ENCODING_INT : o->encoding));
     } else if (!strcasecmp(c->argv[1]->ptr,"idletime") && c->argc == 3) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
                 == NULL) return;
-        addReplyLongLong(c,estimateObjectIdleTime(o));
+        // LFU 策略下 lru 属性保存的不是访问时间
+        if (maxmemoryPolicyIsLFU(server.maxmemory_policy)) {
+            addReplyError(c,"An LFU maxmemory policy is selected, idle time not tracked.");
+            return;
+        }
+        // 带标记的整数没有访问信息（它们只在没有设置 maxmemory 时使用）
+        addReplyLongLong(c,objectIsTaggedInt(o) ? 0 :
+                           estimateObjectIdleTime(o)/1000);
+    } else if (!strcasecmp(c->argv[1]->ptr,"freq") && c->argc == 3) {
+        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
+                == NULL) return;
+        // 只有在使用 LFU 策略时，对象才会记录访问频率
+        if (!maxmemoryPolicyIsLFU(server.maxmemory_policy)) {
+            addReplyError(c,"An LFU maxmemory policy is not selected, access frequency not tracked.");
+            return;
+        }
+        addReplyLongLong(c,objectIsTaggedInt(o) ? 0 : LFUDecrAndReturn(o));
+    } else if (!strcasecmp(c->argv[1]->ptr,"memory") && c->argc >= 3) {
+        long samples = REDIS_MEMORY_SAMPLES_DEFAULT;
+
+        // OBJECT MEMORY <key> [SAMPLES <count>]
+        if (c->argc == 5 && !strcasecmp(c->argv[3]->ptr,"samples")) {
+            if (getLongFromObjectOrReply(c,c->argv[4],&samples,NULL)
+                != REDIS_OK) return;
+            if (samples < 0) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        } else if (c->argc != 3) {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        // keyComputeSize() 需要字典节点本身，所以直接查找它
+        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+            addReply(c,shared.nullbulk);
+            return;
+        }
+        addReplyLongLong(c,keyComputeSize(de,samples));
+    } else if (!strcasecmp(c->argv[1]->ptr,"memstats")) {
+        long count = REDIS_MEMHIST_COUNT_DEFAULT;
+        long samples = REDIS_MEMORY_SAMPLES_DEFAULT;
+        int j;
+
+        // OBJECT MEMSTATS RESET
+        if (c->argc == 3 && !strcasecmp(c->argv[2]->ptr,"reset")) {
+            memoryHistogramReset(c->db->id);
+            addReply(c,shared.ok);
+            return;
+        }
+
+        // OBJECT MEMSTATS [COUNT <keys>] [SAMPLES <count>]
+        for (j = 2; j < c->argc; j += 2) {
+            long *target;
+
+            if (j+1 >= c->argc) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            if (!strcasecmp(c->argv[j]->ptr,"count")) {
+                target = &count;
+            } else if (!strcasecmp(c->argv[j]->ptr,"samples")) {
+                target = &samples;
+            } else {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            if (getLongFromObjectOrReply(c,c->argv[j+1],target,NULL)
+                != REDIS_OK) return;
+            if (*target < 0) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+        // 需要更多采样的话，多次调用即可，结果会被累积
+        if (count > REDIS_MEMHIST_COUNT_MAX) count = REDIS_MEMHIST_COUNT_MAX;
+        memoryHistogramSample(c->db,count,samples);
+        memoryHistogramReply(c);
     } else {
-        addReplyError(c,"Syntax error. Try OBJECT (refcount|encoding|idletime)");
+        addReplyError(c,"Syntax error. Try OBJECT (refcount|encoding|idletime|freq|memory|memstats)");
     }
 }
@@ -394,7 +394,11 @@ void luaMaskCountHook(lua_State *lua, lua_Debug *ar) {
     REDIS_NOTUSED(ar);
     REDIS_NOTUSED(lua);
 
-    elapsed = (ustime()/1000) - server.lua_time_start;
+    /* The cached time is refreshed here since the event loop is not
+     * running, but the time snapshot of the script stays frozen. */
+    // 更新缓存的时间，脚本的过期检查时间不会改变
+    updateCachedMstime();
+    elapsed = server.mstime - server.lua_time_start;
     if (elapsed >= server.lua_time_limit && server.lua_timedout == 0) {
         redisLog(REDIS_WARNING,"Lua slow script detected: still in execution after %lld milliseconds. You can try killing the script using the SCRIPT KILL command.",elapsed);
         server.lua_timedout = 1;
@@ -870,7 +874,12 @@ void evalGenericCommand(redisClient *c, int evalsha) {
      * make the Lua script execution slower. */
     // 实现超时检测和处理
     server.lua_caller = c;
-    server.lua_time_start = ustime()/1000;
+    /* The cached time may be as old as the start of the event loop
+     * iteration: refresh it, or time already spent by the previous
+     * commands would be counted against the script. */
+    // 先更新缓存的时间，否则之前的命令花费的时间也会被算到脚本头上
+    updateCachedMstime();
+    server.lua_time_start = server.mstime;
     server.lua_kill = 0;
     if (server.lua_time_limit > 0 && server.masterhost == NULL) {
         lua_sethook(lua,luaMaskCountHook,LUA_MASKCOUNT,100000);
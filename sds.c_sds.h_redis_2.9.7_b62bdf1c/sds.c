@@ -166,6 +166,15 @@ size_t sdsAllocSize(sds s) {
     return sizeof(*sh) + sh->len + sh->free + 1;
 }
 
+/* Return the pointer of the actual allocation of the sds string (normally
+ * the pointer returned by zmalloc is not the one of the string, because
+ * of the header that precedes it). This is useful in order to obtain the
+ * usable size of the allocation with zmalloc_size(). */
+// 返回 sds 实际分配的内存的起始地址（也即是 sdshdr 的地址）
+void *sdsAllocPtr(const sds s) {
+    return (void*) (s-(sizeof(struct sdshdr)));
+}
+
 /* Increment the sds length and decrements the left free space at the
  * end of the string accordingly to 'incr'. Also set the null term
  * in the new end of the string.
@@ -735,6 +744,69 @@ sds sdsmapchars(sds s, const char *from, const char *to, size_t setlen) {
     return s;
 }
 
+/* Create a bump arena of 'size' bytes. Strings allocated from the arena
+ * with sdsArenaNewLen() are reclaimed all together by sdsArenaReset(),
+ * so that short lived strings (like the arguments of a command) don't
+ * need a malloc/free pair each. */
+// 创建一个大小为 size 字节的 arena
+sdsarena *sdsArenaCreate(size_t size) {
+    sdsarena *a = zmalloc(sizeof(*a));
+
+    a->buf = zmalloc(size);
+    a->size = size;
+    a->used = 0;
+    return a;
+}
+
+// 释放 arena ，以及其中的所有 sds
+void sdsArenaRelease(sdsarena *a) {
+    if (a == NULL) return;
+    zfree(a->buf);
+    zfree(a);
+}
+
+/* Reclaim every string allocated from the arena. The caller must make
+ * sure that no reference to such strings survives the reset. */
+// 回收 arena 中的所有 sds
+// 调用者必须确保在此之后，没有任何地方继续引用这些 sds
+void sdsArenaReset(sdsarena *a) {
+    a->used = 0;
+}
+
+/* Like sdsnewlen() but the string is carved from the arena. NULL is
+ * returned when the arena has not enough space left, in that case the
+ * caller should fall back to sdsnewlen(). */
+// 和 sdsnewlen() 类似，但 sds 的空间从 arena 中分配
+// 如果 arena 的剩余空间不足，那么返回 NULL ，
+// 调用者应该改为使用 sdsnewlen()
+sds sdsArenaNewLen(sdsarena *a, const void *init, size_t initlen) {
+    struct sdshdr *sh;
+    size_t need = sizeof(struct sdshdr)+initlen+1;
+
+    // 对齐到指针长度，确保下一个 sdshdr 的地址是对齐的
+    need = (need+sizeof(void*)-1) & ~(sizeof(void*)-1);
+    if (a->size - a->used < need) return NULL;
+
+    sh = (void*) (a->buf+a->used);
+    a->used += need;
+
+    sh->len = initlen;
+    // 预留空间不能被使用，因此 free 总是 0
+    sh->free = 0;
+    if (initlen && init)
+        memcpy(sh->buf, init, initlen);
+    else if (initlen)
+        memset(sh->buf, 0, initlen);
+    sh->buf[initlen] = '\0';
+
+    return (char*)sh->buf;
+}
+
+// 检查 sds 是否从给定 arena 中分配
+int sdsArenaContains(sdsarena *a, const sds s) {
+    return a != NULL && s > a->buf && s < a->buf+a->size;
+}
+
 #ifdef SDS_TEST_MAIN
 #include <stdio.h>
 #include "testhelp.h"
@@ -839,6 +911,29 @@ int main(void) {
             test_cond("sdsIncrLen() -- len", sh->len == 2);
             test_cond("sdsIncrLen() -- free", sh->free == oldfree-1);
         }
+
+        {
+            sdsarena *a = sdsArenaCreate(64);
+            sds p, q;
+
+            p = sdsArenaNewLen(a,"foo",3);
+            q = sdsArenaNewLen(a,"barbaz",6);
+            test_cond("sdsArenaNewLen() -- content",
+                sdslen(p) == 3 && memcmp(p,"foo\0",4) == 0 &&
+                sdslen(q) == 6 && memcmp(q,"barbaz\0",7) == 0);
+            test_cond("sdsArenaContains()",
+                sdsArenaContains(a,p) && sdsArenaContains(a,q) &&
+                !sdsArenaContains(a,x));
+            test_cond("sdsArenaNewLen() -- aligned",
+                ((unsigned long)q % sizeof(void*)) == 0);
+            test_cond("sdsArenaNewLen() -- full arena",
+                sdsArenaNewLen(a,NULL,64) == NULL);
+            sdsArenaReset(a);
+            q = sdsArenaNewLen(a,"x",1);
+            test_cond("sdsArenaReset() reuses the space",
+                q == p && sdslen(q) == 1);
+            sdsArenaRelease(a);
+        }
     }
     test_report()
     return 0;
@@ -107,5 +107,30 @@ sds sdsMakeRoomFor(sds s, size_t addlen);
 void sdsIncrLen(sds s, int incr);
 sds sdsRemoveFreeSpace(sds s);
 size_t sdsAllocSize(sds s);
+void *sdsAllocPtr(const sds s);
+
+/* Bump arena for short lived strings */
+// arena 的默认大小
+#define SDS_ARENA_DEFAULT_SIZE (16*1024)
+
+// 用于分配临时 sds 的 bump arena
+//
+// 从 arena 中分配的 sds 不能被 sdsfree() 释放，
+// 也不能被任何可能引起 zrealloc 的函数（sdscat 、 sdsMakeRoomFor 等）修改，
+// 它们的空间在 sdsArenaReset() 时被一次性回收
+typedef struct sdsarena {
+    // 分配空间的起始地址
+    char *buf;
+    // buf 的总大小
+    size_t size;
+    // buf 中已被分配的字节数
+    size_t used;
+} sdsarena;
+
+sdsarena *sdsArenaCreate(size_t size);
+void sdsArenaRelease(sdsarena *a);
+void sdsArenaReset(sdsarena *a);
+sds sdsArenaNewLen(sdsarena *a, const void *init, size_t initlen);
+int sdsArenaContains(sdsarena *a, const sds s);
 
 #endif
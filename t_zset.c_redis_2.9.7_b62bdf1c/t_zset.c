@@ -25,13 +25,226 @@ typedef struct zskiplist {                  // 跳跃表
     int level;                              // 层数
 } zskiplist;
 
+// B+ 树编码
+#define REDIS_ENCODING_BTREE 9  // Encoded as B+tree
+
+// 每个 B+ 树节点最多保存的元素（或子节点）数量，
+// 16 个分值正好占用两个 64 字节的缓存行
+#define ZBTREE_FANOUT 16
+
+struct zbtreeInner;
+
+typedef struct zbtreeNode {                 // B+ 树节点的公共头部
+    struct zbtreeInner *parent;             // 父节点，根节点为 NULL
+    unsigned leaf:1;                        // 是否为叶子节点
+    unsigned count:31;                      // 元素数量（叶子）或子节点数量
+} zbtreeNode;
+
+typedef struct zbtreeLeaf {                 // B+ 树叶子节点
+    zbtreeNode hdr;
+    struct zbtreeLeaf *prev, *next;         // 前一个和后一个叶子节点
+    double scores[ZBTREE_FANOUT];           // 分值
+    robj *objs[ZBTREE_FANOUT];              // 成员
+} zbtreeLeaf;
+
+typedef struct zbtreeInner {                // B+ 树内部节点
+    zbtreeNode hdr;
+    double scores[ZBTREE_FANOUT];           // 子节点的分隔元素的分值
+    robj *objs[ZBTREE_FANOUT];              // 子节点的分隔元素的成员
+    zbtreeNode *children[ZBTREE_FANOUT];    // 子节点
+    unsigned long counts[ZBTREE_FANOUT];    // 每个子树中的元素数量
+} zbtreeInner;
+
+typedef struct zbtree {                     // B+ 树
+    zbtreeNode *root;                       // 根节点
+    zbtreeLeaf *head, *tail;                // 第一个和最后一个叶子节点
+    unsigned long length;                   // 元素数量
+} zbtree;
+
+typedef struct zbtreeIter {                 // B+ 树迭代器
+    zbtreeLeaf *leaf;                       // 当前叶子节点，为 NULL 表示迭代结束
+    int pos;                                // 元素在叶子节点中的位置
+} zbtreeIter;
+
+#define zbtIterScore(it) ((it)->leaf->scores[(it)->pos])
+#define zbtIterObj(it) ((it)->leaf->objs[(it)->pos])
+
 typedef struct zset {   // zset 结构
     dict *dict;         // 字典
-    zskiplist *zsl;     // 跳跃表
+    zskiplist *zsl;     // 跳跃表， B+ 树编码时为 NULL
+    zbtree *zbt;        // B+ 树，跳跃表编码时为 NULL
 } zset;
 
+// 跳跃表编码的有序集合的元素数量超过这个值时，转换为 B+ 树编码，
+// 为 0 时不使用 B+ 树编码
+#define REDIS_ZSET_MAX_SKIPLIST_ENTRIES 1024
+
+struct redisServer {
+    // 其他属性 ...
+    size_t zset_max_skiplist_entries;   // 配置项 zset-max-skiplist-entries
+    // 其他属性 ...
+};
+
+// 返回有序集合字典节点中保存的分值：
+// 跳跃表编码的字典值指向跳跃表节点中的分值，
+// B+ 树编码的分值则直接保存在字典节点中
+// （从 t_zset.c 移到 redis.h ，因为 rdb.c 、 aof.c 和 debug.c 也需要它）
+#define zsetDictScore(encoding,de) \
+    ((encoding) == REDIS_ENCODING_BTREE ? dictGetDoubleVal(de) : \
+                                          *(double*)dictGetVal(de))
+
+// B+ 树编码的有序集合和跳跃表编码的一样，以 REDIS_RDB_TYPE_ZSET 格式保存，
+// 所以 RDB 文件和 DUMP 的数据格式不变：
+//
+// rdb.c 的 rdbSaveObjectType() 对 REDIS_ENCODING_SKIPLIST 和
+// REDIS_ENCODING_BTREE 都保存 REDIS_RDB_TYPE_ZSET ，
+// rdbSaveObject() 的跳跃表分支也处理 B+ 树编码，
+// 它遍历 zs->dict ，并将分值改为通过下面的方式取出：
+//     rdbSaveDoubleValue(rdb,zsetDictScore(o->encoding,de));
+// rdbLoadObject() 载入 REDIS_RDB_TYPE_ZSET 之后，
+// 在 zset-max-ziplist-* 的转换之外调用 zsetConvertToBtreeIfNeeded(o)
+//
+// aof.c 的 rewriteSortedSetObject() 和 debug.c 的 DEBUG DIGEST 同样让
+// 跳跃表分支处理 B+ 树编码，并用 zsetDictScore() 取出分值
+//
+// sort.c 的 sortCommand() 在排序之前调用
+// zsetConvert(sortval,REDIS_ENCODING_SKIPLIST) ，
+// zsetConvert() 支持从 B+ 树编码转换，所以不需要修改
+
+// 块目录编码
+#define REDIS_ENCODING_BLOCKS 10  // Encoded as ziplist blocks + directory
+
+// 每个块最多保存的元素数量
+#define ZBLOCK_MAX_ENTRIES 64
+
+typedef struct zblocks {                    // 块目录编码的有序集合
+    unsigned char **zls;                    // 每个块的 ziplist
+    double *first;                          // 每个块第一个元素的分值
+    unsigned int *counts;                   // 每个块的元素数量
+    unsigned int nblocks;                   // 块数量
+    unsigned long length;                   // 元素总数
+} zblocks;
+
+typedef struct zblkIter {                   // 块目录迭代器
+    zblocks *zb;
+    unsigned int blk;                       // 当前块
+    unsigned char *eptr, *sptr;             // 当前元素的成员和分值，
+                                            // eptr 为 NULL 表示迭代结束
+} zblkIter;
+
+// ziplist 编码的有序集合的元素数量超过 zset_max_ziplist_entries ，
+// 但不超过这个值时，使用块目录编码，为 0 时不使用块目录编码
+#define REDIS_ZSET_MAX_BLOCKS_ENTRIES 512
+
+struct redisServer {
+    // 其他属性 ...
+    size_t zset_max_blocks_entries;     // 配置项 zset-max-blocks-entries
+    // 其他属性 ...
+};
+
+// 块目录编码只存在于内存中，它以 ziplist 编码的有序集合的格式保存，
+// 所以 RDB 文件和 DUMP 的数据格式不变：
+//
+// rdb.c 的 rdbSaveObjectType() 对 REDIS_ENCODING_BLOCKS 保存
+// REDIS_RDB_TYPE_ZSET_ZIPLIST ，rdbSaveObject() 将所有块合并为一个 ziplist ：
+//     unsigned char *zl = zblkToZiplist(o->ptr);
+//     if ((n = rdbSaveRawString(rdb,zl,ziplistBlobLen(zl))) == -1) {
+//         zfree(zl);
+//         return -1;
+//     }
+//     nwritten += n;
+//     zfree(zl);
+// rdbLoadObject() 载入 REDIS_RDB_TYPE_ZSET_ZIPLIST 之后，
+// 将原来只在超过 zset_max_ziplist_entries 时转换为跳跃表的代码改为
+//     zsetConvert(o,zsetEncodingForSize(zsetLength(o),0));
+// （ ziplist 中的成员都不超过 zset_max_ziplist_value ）
+//
+// aof.c 的 rewriteSortedSetObject() 和 debug.c 的 DEBUG DIGEST 使用
+// zblkFirst() 和 zblkNext() 遍历块目录编码的有序集合，
+// 成员和分值的读取方式和 ziplist 编码相同（ it.eptr 和 zzlGetScore(it.sptr) ）
+//
+// sort.c 的 zsetConvert(sortval,REDIS_ENCODING_SKIPLIST) 支持从块目录编码转换
+
+// 输入的元素总数超过这个值时， ZUNIONSTORE 和 ZINTERSTORE 使用多个线程执行，
+// 为 0 时总是使用单线程
+#define REDIS_ZSET_PARALLEL_THRESHOLD 1000000
+// 执行 ZUNIONSTORE 和 ZINTERSTORE 的线程数量
+#define REDIS_ZSET_PARALLEL_THREADS 4
+
+struct redisServer {
+    // 其他属性 ...
+    unsigned long zset_parallel_threshold;  // 配置项 zset-parallel-threshold
+    int zset_parallel_threads;              // 配置项 zset-parallel-threads
+    // 其他属性 ...
+};
+
+// 元素数量不少于这个值的 ZRANGE 和 ZRANGEBYSCORE 回复会被分批生成，
+// 为 0 时总是一次生成全部回复
+#define REDIS_ZSET_STREAM_THRESHOLD 10000
+// 每批生成的元素数量
+#define REDIS_ZSET_STREAM_CHUNK 1000
+
+// 客户端正在分批接收一个范围回复
+#define REDIS_ZSTREAM (1<<14)
+
+typedef struct zrangeStream {               // 分批生成的范围回复
+    robj *zobj;                             // 有序集合，持有它的一个引用
+    unsigned long remaining;                // 还没有生成回复的元素数量
+    int reverse;                            // 是否逆序
+    int withscores;                         // 是否回复分值
+    union {
+        zskiplistNode *ln;                  // 跳跃表编码
+        zbtreeIter bt;                      // B+ 树编码
+        zblkIter blk;                       // 块目录编码
+    } it;                                   // 下一个元素
+} zrangeStream;
+
+typedef struct redisClient {
+    // 其他属性 ...
+    zrangeStream *zstream;                  // 正在生成的范围回复，没有时为 NULL
+    // 其他属性 ...
+} redisClient;
+
+struct redisServer {
+    // 其他属性 ...
+    unsigned long zset_stream_threshold;    // 配置项 zset-stream-threshold
+    unsigned long zset_stream_chunk;        // 配置项 zset-stream-chunk
+    // 其他属性 ...
+};
+
+// networking.c 中：
+// createClient() 将 c->zstream 设为 NULL ，
+// freeClient() 调用 zrangeStreamRelease() 释放未完成的回复；
+// processInputBuffer() 不处理带有 REDIS_ZSTREAM 标志的客户端的命令；
+// sendReplyToClient() 在回复缓冲区全部写入套接字并删除写事件之后，
+// 如果客户端带有 REDIS_ZSTREAM 标志，那么调用 zrangeStreamContinue() ，
+// 函数返回 1 （回复已经完成）时，调用 processInputBuffer() 处理之后的命令
+
+// rdb.h 中：
+// ziplist 编码的有序集合以 ziplist 的原始内容保存在 RDB 文件以及 DUMP 的数据中，
+// 其中的分值可能使用 ZZL_SCORE_TAG 开头的二进制格式，旧版本无法正确读取，
+// 所以 RDB 版本从 6 增加到 7 ：
+#define REDIS_RDB_VERSION 7
+// 旧版本的 rdbLoad() 、 verifyDumpPayload() （ RESTORE ）以及作为附属节点
+// 进行完整同步时，都会拒绝版本号更高的数据，而不会把二进制分值当作文本读取；
+// 新版本仍然可以读取版本 6 及以下的数据，因为文本格式的分值仍然被支持
+
+// 在栈上初始化一个 raw 编码的字符串对象，_ptr 必须是一个 sds
+// （ sds 不在 arena 中，所以 arena 标志必须为 0 ）
+#define initStaticStringObject(_var,_ptr) do { \
+    _var.refcount = 1; \
+    _var.type = REDIS_STRING; \
+    _var.encoding = REDIS_ENCODING_RAW; \
+    _var.arena = 0; \
+    _var.ptr = _ptr; \
+} while(0);
+
 */
 #include <math.h>
+#include "endianconv.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*-----------------------------------------------------------------------------
  * Sorted set API
@@ -109,45 +322,45 @@ void zslFree(zskiplist *zsl) {
 /* Returns a random level for the new skiplist node we are going to create.
  * The return value of this function is between 1 and ZSKIPLIST_MAXLEVEL
  * (both inclusive), with a powerlaw-alike distribution where higher
- * levels are less likely to be returned. */
+ * levels are less likely to be returned.
+ *
+ * With ZSKIPLIST_P = 1/4 every pair of random bits promotes the node one
+ * level with probability 1/4 (both bits zero), so instead of calling the
+ * generator once per level the level is derived from the number of
+ * trailing zero bits of a single 64 bit random word. */
 // 返回一个随机数，作为新见层的层数
 //
 // 返回值是一个大于等于 1 ，且小于等于 ZSKIPLIST_MAXLEVEL 的值
 // 根据 powerlaw 分布，越大的随机数返回的几率越小
+//
+// ZSKIPLIST_P 为 1/4 ，每两个为 0 的低位代表升高一层，
+// 所以只需要一个随机数和一次 ctz 就可以算出层数
 int zslRandomLevel(void) {
-    int level = 1;
-    while ((random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
-        level += 1;
+    uint64_t r = dictRandom();
+    int level;
+
+    /* The trick above only works for ZSKIPLIST_P = 1/4: fail to compile
+     * if it is changed. */
+    // ZSKIPLIST_P 被修改时编译失败
+    (void)sizeof(char[(ZSKIPLIST_P == 0.25) ? 1 : -1]);
+
+    if (r == 0) return ZSKIPLIST_MAXLEVEL;
+    level = 1 + __builtin_ctzll(r)/2;
     return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
 }
 
-zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned int rank[ZSKIPLIST_MAXLEVEL];
+/* Link a new node holding 'score' and 'obj' after the nodes stored in the
+ * 'update' vector, whose ranks are stored in 'rank'. This is the second half
+ * of zslInsert(), shared with the bulk insertion code that computes the
+ * insertion point by itself. Both vectors must have ZSKIPLIST_MAXLEVEL
+ * slots, as the levels added to the skiplist are filled here. */
+// 在 update 数组记录的各层节点之后插入一个新节点
+static zskiplistNode *zslLinkNode(zskiplist *zsl, zskiplistNode **update,
+                                  unsigned int *rank, double score, robj *obj)
+{
+    zskiplistNode *x;
     int i, level;
 
-    redisAssert(!isnan(score));
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* store rank that is crossed to reach the insert position */
-        // 更新新节点插入时经过的所有节点的 rank 值
-        rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
-        while (x->level[i].forward &&
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                compareStringObjects(x->level[i].forward->obj,obj) < 0))) {
-            // 并计算新的 rank 值
-            rank[i] += x->level[i].span;
-            // 向前移动指针
-            x = x->level[i].forward;
-        }
-        // 记录所有被修改过的节点
-        update[i] = x;
-    }
-    /* we assume the key is not already inside, since we allow duplicated
-     * scores, and the re-insertion of score and redis object should never
-     * happpen since the caller of zslInsert() should test in the hash table
-     * if the element is already inside or not. */
     // 获取新节点的 level
     level = zslRandomLevel();
     // 如果新节点的 level 比 zsl->level 要大
@@ -194,6 +407,73 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj) {
     return x;
 }
 
+zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    unsigned int rank[ZSKIPLIST_MAXLEVEL];
+    int i;
+
+    redisAssert(!isnan(score));
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        /* store rank that is crossed to reach the insert position */
+        // 更新新节点插入时经过的所有节点的 rank 值
+        rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                compareStringObjects(x->level[i].forward->obj,obj) < 0))) {
+            // 并计算新的 rank 值
+            rank[i] += x->level[i].span;
+            // 向前移动指针
+            x = x->level[i].forward;
+        }
+        // 记录所有被修改过的节点
+        update[i] = x;
+    }
+    /* we assume the key is not already inside, since we allow duplicated
+     * scores, and the re-insertion of score and redis object should never
+     * happpen since the caller of zslInsert() should test in the hash table
+     * if the element is already inside or not. */
+    return zslLinkNode(zsl,update,rank,score,obj);
+}
+
+/* Store in 'update' and 'rank' the last node of every level of the skiplist
+ * and its rank, that is, the vectors zslInsert() computes for an element
+ * greater than all the elements already inside. */
+// 记录跳跃表每一层的最后一个节点及其排位，
+// 用于将元素直接添加到跳跃表的表尾
+static void zslTailPath(zskiplist *zsl, zskiplistNode **update, unsigned int *rank) {
+    zskiplistNode *x = zsl->header;
+    int i;
+
+    for (i = zsl->level-1; i >= 0; i--) {
+        rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
+        while (x->level[i].forward) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+}
+
+/* Append a new node at the tail of the skiplist using (and updating) the
+ * vectors computed by zslTailPath(). The caller must make sure the element
+ * is greater than the current tail. */
+// 将新节点添加到跳跃表的表尾，并更新表尾路径
+static zskiplistNode *zslAppend(zskiplist *zsl, zskiplistNode **update,
+                                unsigned int *rank, double score, robj *obj)
+{
+    zskiplistNode *x = zslLinkNode(zsl,update,rank,score,obj);
+    int i;
+
+    // 新节点成为它所在各层的最后一个节点
+    for (i = 0; i < zsl->level && update[i]->level[i].forward == x; i++) {
+        update[i] = x;
+        rank[i] = zsl->length;
+    }
+    return x;
+}
+
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
 // 删除给定节点
 void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
@@ -263,6 +543,54 @@ static int zslValueLteMax(double value, zrangespec *spec) {
     return spec->maxex ? (value < spec->max) : (value <= spec->max);
 }
 
+/* The two functions below scan an array of 'count' sorted scores, like the
+ * ones of the B+tree nodes or of the block directory. The whole array is
+ * compared without branches, two scores at a time when SSE2 is available:
+ * since the array is sorted, the number of scores on one side of the range
+ * is also the position of the first score on the other side. */
+
+// 返回有序分值数组中小于区间最小值的分值数量，
+// 也即第一个满足 zslValueGteMin 的分值的索引
+static int zslScoresBelowMin(double *scores, int count, zrangespec *spec) {
+    int j = 0, below = 0;
+#ifdef __SSE2__
+    __m128d min = _mm_set1_pd(spec->min);
+    int mask;
+
+    for (; j+2 <= count; j += 2) {
+        __m128d v = _mm_loadu_pd(scores+j);
+
+        mask = _mm_movemask_pd(spec->minex ? _mm_cmple_pd(v,min) :
+                                             _mm_cmplt_pd(v,min));
+        below += (mask & 1) + (mask >> 1);
+    }
+#endif
+    for (; j < count; j++)
+        below += !zslValueGteMin(scores[j],spec);
+    return below;
+}
+
+// 返回有序分值数组中满足 zslValueLteMax 的分值数量，
+// 也即第一个大于区间最大值的分值的索引
+static int zslScoresLteMax(double *scores, int count, zrangespec *spec) {
+    int j = 0, lte = 0;
+#ifdef __SSE2__
+    __m128d max = _mm_set1_pd(spec->max);
+    int mask;
+
+    for (; j+2 <= count; j += 2) {
+        __m128d v = _mm_loadu_pd(scores+j);
+
+        mask = _mm_movemask_pd(spec->maxex ? _mm_cmplt_pd(v,max) :
+                                             _mm_cmple_pd(v,max));
+        lte += (mask & 1) + (mask >> 1);
+    }
+#endif
+    for (; j < count; j++)
+        lte += zslValueLteMax(scores[j],spec);
+    return lte;
+}
+
 /* Returns if there is a part of the zset is in range. */
 // 检查 zsl 是否包含给定 score 区间值
 int zslIsInRange(zskiplist *zsl, zrangespec *range) {
@@ -496,166 +824,847 @@ static int zslParseRange(robj *min, robj *max, zrangespec *spec) {
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * B+tree-backed sorted set API
  *----------------------------------------------------------------------------*/
 
-double zzlGetScore(unsigned char *sptr) {
-    unsigned char *vstr;
-    unsigned int vlen;
-    long long vlong;
-    char buf[128];
-    double score;
+/* Big sorted sets can be encoded as a B+tree instead of a skiplist
+ * (REDIS_ENCODING_BTREE). The skiplist allocates every element in its own
+ * node and every level of the search chases a pointer to a different node,
+ * so range queries on big sets are dominated by cache misses. In the B+tree
+ * elements are stored sorted by (score, member) inside leaves of
+ * ZBTREE_FANOUT entries, with scores and members in two separated arrays,
+ * so that a search touches one or two cache lines per level. Inner nodes
+ * store, for every child, the first element of the child (the separator)
+ * and the number of elements of the subtree, so that rank operations are
+ * O(log(N)) like with the skiplist span.
+ *
+ * Leaves are linked in a doubly linked list to allow forward and backward
+ * iteration, using a zbtreeIter (leaf, position) cursor.
+ *
+ * The separator of the first child of an inner node is never used. Other
+ * separators are just lower bounds of the elements of the child, so they
+ * don't need to be updated when the first element of a child is deleted:
+ * since the separator may then point to an object not referenced by any
+ * leaf, separators hold their own reference to the member object.
+ *
+ * Leaves are merged with a sibling when they get less than 1/4 full and
+ * the two fit in a single leaf. Inner nodes are only removed when they
+ * have no children, and the root is collapsed when it has a single child.
+ *
+ * Like the skiplist, the B+tree is paired with a dictionary mapping members
+ * to scores. Since elements move across leaves, the dictionary can't point
+ * to the score in the tree, so with this encoding the score is stored
+ * directly into the dictionary entry value (see zsetDictScore()). */
+
+// 创建一个空的叶子节点
+static zbtreeLeaf *zbtCreateLeaf(void) {
+    zbtreeLeaf *leaf = zmalloc(sizeof(*leaf));
+
+    leaf->hdr.parent = NULL;
+    leaf->hdr.leaf = 1;
+    leaf->hdr.count = 0;
+    leaf->prev = leaf->next = NULL;
+    return leaf;
+}
 
-    redisAssert(sptr != NULL);
-    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+// 创建一个空的内部节点
+static zbtreeInner *zbtCreateInner(void) {
+    zbtreeInner *in = zmalloc(sizeof(*in));
 
-    if (vstr) {
-        memcpy(buf,vstr,vlen);
-        buf[vlen] = '\0';
-        score = strtod(buf,NULL);
+    in->hdr.parent = NULL;
+    in->hdr.leaf = 0;
+    in->hdr.count = 0;
+    in->objs[0] = NULL;
+    return in;
+}
+
+// 创建一棵空的 B+ 树
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbtreeLeaf *leaf = zbtCreateLeaf();
+
+    zbt->root = &leaf->hdr;
+    zbt->head = zbt->tail = leaf;
+    zbt->length = 0;
+    return zbt;
+}
+
+// 释放节点及其所有子节点，以及它们引用的对象
+static void zbtFreeNode(zbtreeNode *n) {
+    int j;
+
+    if (n->leaf) {
+        zbtreeLeaf *leaf = (zbtreeLeaf*)n;
+
+        for (j = 0; j < n->count; j++) decrRefCount(leaf->objs[j]);
     } else {
-        score = vlong;
+        zbtreeInner *in = (zbtreeInner*)n;
+
+        for (j = 0; j < n->count; j++) {
+            if (j > 0) decrRefCount(in->objs[j]);
+            zbtFreeNode(in->children[j]);
+        }
     }
+    zfree(n);
+}
 
-    return score;
+// 释放 B+ 树
+void zbtFree(zbtree *zbt) {
+    zbtFreeNode(zbt->root);
+    zfree(zbt);
 }
 
-/* Compare element in sorted set with given element. */
-int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int clen) {
-    unsigned char *vstr;
-    unsigned int vlen;
-    long long vlong;
-    unsigned char vbuf[32];
-    int minlen, cmp;
+/* Compare the elements (s1,o1) and (s2,o2) using the same order of the
+ * skiplist: by score first, then lexicographically by member. */
+// 按照和跳跃表相同的顺序对比两个元素
+static int zbtCompare(double s1, robj *o1, double s2, robj *o2) {
+    if (s1 < s2) return -1;
+    if (s1 > s2) return 1;
+    return compareStringObjects(o1,o2);
+}
 
-    redisAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
-    if (vstr == NULL) {
-        /* Store string representation of long long in buf. */
-        vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
-        vstr = vbuf;
+/* Return the index of the first element in [lo,hi) of the sorted arrays
+ * 'scores' and 'objs' that is greater than (score,obj), or that is greater
+ * or equal if 'equal' is true. 'hi' is returned if there is no such
+ * element. Scores are compared first, so members are only compared for
+ * elements with the same score. */
+// 二分查找第一个大于（ equal 为真时大于等于）给定元素的位置
+static int zbtSearch(double *scores, robj **objs, int lo, int hi,
+                     double score, robj *obj, int equal)
+{
+    while (lo < hi) {
+        int mid = (lo+hi) >> 1;
+        int cmp = zbtCompare(scores[mid],objs[mid],score,obj);
+
+        if (cmp > 0 || (equal && cmp == 0))
+            hi = mid;
+        else
+            lo = mid+1;
     }
+    return lo;
+}
 
-    minlen = (vlen < clen) ? vlen : clen;
-    cmp = memcmp(vstr,cstr,minlen);
-    if (cmp == 0) return vlen-clen;
-    return cmp;
+// 返回内部节点中，给定元素所属的子节点的索引
+static int zbtChildFor(zbtreeInner *in, double score, robj *obj) {
+    return zbtSearch(in->scores,in->objs,1,in->hdr.count,score,obj,0)-1;
 }
 
-unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+// 返回 child 在父节点中的索引
+static int zbtChildIndex(zbtreeInner *parent, zbtreeNode *child) {
+    int j;
+
+    for (j = 0; j < parent->hdr.count; j++)
+        if (parent->children[j] == child) return j;
+    redisPanic("B+tree child not found in its parent");
+    return -1;
 }
 
-/* Move to next entry based on the values in eptr and sptr. Both are set to
- * NULL when there is no next entry. */
-void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
-    unsigned char *_eptr, *_sptr;
-    redisAssert(*eptr != NULL && *sptr != NULL);
+// 返回以 n 为根的子树中的元素数量
+static unsigned long zbtNodeCount(zbtreeNode *n) {
+    zbtreeInner *in;
+    unsigned long count = 0;
+    int j;
 
-    _eptr = ziplistNext(zl,*sptr);
-    if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
-        redisAssert(_sptr != NULL);
-    } else {
-        /* No next entry. */
-        _sptr = NULL;
-    }
+    if (n->leaf) return n->count;
+    in = (zbtreeInner*)n;
+    for (j = 0; j < n->count; j++) count += in->counts[j];
+    return count;
+}
 
-    *eptr = _eptr;
-    *sptr = _sptr;
+// 查找给定元素所属的叶子节点
+static zbtreeLeaf *zbtFindLeaf(zbtree *zbt, double score, robj *obj) {
+    zbtreeNode *n = zbt->root;
+
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        n = in->children[zbtChildFor(in,score,obj)];
+    }
+    return (zbtreeLeaf*)n;
 }
 
-/* Move to the previous entry based on the values in eptr and sptr. Both are
- * set to NULL when there is no next entry. */
-void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
-    unsigned char *_eptr, *_sptr;
-    redisAssert(*eptr != NULL && *sptr != NULL);
+/* Update the subtree counts of all the ancestors of 'n' by 'delta'. */
+// 将 n 的所有祖先节点中的子树计数加上 delta
+static void zbtUpdateCounts(zbtreeNode *n, long delta) {
+    while (n->parent) {
+        zbtreeInner *parent = n->parent;
 
-    _sptr = ziplistPrev(zl,*eptr);
-    if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
-        redisAssert(_eptr != NULL);
-    } else {
-        /* No previous entry. */
-        _eptr = NULL;
+        parent->counts[zbtChildIndex(parent,n)] += delta;
+        n = &parent->hdr;
     }
+}
 
-    *eptr = _eptr;
-    *sptr = _sptr;
+/* Insert 'child' at position 'pos' of the inner node 'in', using
+ * (score,obj) as separator. The node must not be full. */
+// 将子节点插入到内部节点的 pos 位置，节点必须还有空位
+static void zbtInnerInsertAt(zbtreeInner *in, int pos, zbtreeNode *child,
+                             double score, robj *obj, unsigned long count)
+{
+    int move = in->hdr.count-pos;
+
+    memmove(in->children+pos+1,in->children+pos,sizeof(in->children[0])*move);
+    memmove(in->counts+pos+1,in->counts+pos,sizeof(in->counts[0])*move);
+    memmove(in->scores+pos+1,in->scores+pos,sizeof(in->scores[0])*move);
+    memmove(in->objs+pos+1,in->objs+pos,sizeof(in->objs[0])*move);
+    in->children[pos] = child;
+    in->counts[pos] = count;
+    in->scores[pos] = score;
+    in->objs[pos] = obj;
+    if (obj) incrRefCount(obj);
+    in->hdr.count++;
+    child->parent = in;
 }
 
-/* Returns if there is a part of the zset is in range. Should only be used
- * internally by zzlFirstInRange and zzlLastInRange. */
-int zzlIsInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *p;
-    double score;
+/* Add to the tree the node 'right', just obtained splitting 'left', with
+ * (score,obj) as separator, splitting the ancestors of 'left' as needed. */
+// 将从 left 中分裂出来的 right 节点加入到 left 的父节点中，
+// 如果父节点已满，那么继续分裂父节点
+static void zbtInsertInParent(zbtree *zbt, zbtreeNode *left,
+                              zbtreeNode *right, double score, robj *obj)
+{
+    zbtreeInner *parent = left->parent, *sibling;
+    double sepscore;
+    robj *sepobj;
+    int idx, half, j;
+
+    // left 是根节点，创建新的根节点
+    if (parent == NULL) {
+        zbtreeInner *root = zbtCreateInner();
+
+        zbtInnerInsertAt(root,0,left,0,NULL,zbtNodeCount(left));
+        zbtInnerInsertAt(root,1,right,score,obj,zbtNodeCount(right));
+        zbt->root = &root->hdr;
+        return;
+    }
 
-    /* Test for ranges that will always be empty. */
-    if (range->min > range->max ||
-            (range->min == range->max && (range->minex || range->maxex)))
-        return 0;
+    idx = zbtChildIndex(parent,left);
+    parent->counts[idx] = zbtNodeCount(left);
+    if (parent->hdr.count < ZBTREE_FANOUT) {
+        zbtInnerInsertAt(parent,idx+1,right,score,obj,zbtNodeCount(right));
+        return;
+    }
 
-    p = ziplistIndex(zl,-1); /* Last score. */
-    if (p == NULL) return 0; /* Empty sorted set */
-    score = zzlGetScore(p);
-    if (!zslValueGteMin(score,range))
-        return 0;
+    /* The parent is full: move the upper half of its children into a new
+     * sibling. The separator of the first moved child becomes the separator
+     * of the sibling in the grandparent. */
+    // 父节点已满，将它的后一半子节点移动到新的兄弟节点中
+    sibling = zbtCreateInner();
+    half = ZBTREE_FANOUT/2;
+    for (j = half; j < ZBTREE_FANOUT; j++) {
+        int k = j-half;
+
+        sibling->children[k] = parent->children[j];
+        sibling->counts[k] = parent->counts[j];
+        sibling->scores[k] = parent->scores[j];
+        sibling->objs[k] = parent->objs[j];
+        sibling->children[k]->parent = sibling;
+    }
+    sibling->hdr.count = ZBTREE_FANOUT-half;
+    parent->hdr.count = half;
+    sepscore = sibling->scores[0];
+    sepobj = sibling->objs[0];
+    sibling->objs[0] = NULL;
+
+    if (idx+1 <= half)
+        zbtInnerInsertAt(parent,idx+1,right,score,obj,zbtNodeCount(right));
+    else
+        zbtInnerInsertAt(sibling,idx+1-half,right,score,obj,
+                         zbtNodeCount(right));
 
-    p = ziplistIndex(zl,1); /* First score. */
-    redisAssert(p != NULL);
-    score = zzlGetScore(p);
-    if (!zslValueLteMax(score,range))
-        return 0;
+    zbtInsertInParent(zbt,&parent->hdr,&sibling->hdr,sepscore,sepobj);
+    // 新的分隔元素已经持有自己的引用
+    decrRefCount(sepobj);
+}
 
-    return 1;
+/* Insert a new element. The caller must make sure the element is not
+ * already in the tree, and the reference to 'obj' is owned by the tree
+ * (the caller should increment the refcount if needed, like with
+ * zslInsert()). */
+// 将元素插入到 B+ 树中，调用者需要确保元素不存在
+void zbtInsert(zbtree *zbt, double score, robj *obj) {
+    zbtreeLeaf *leaf = zbtFindLeaf(zbt,score,obj);
+    int pos;
+
+    /* The leaf is full: split it in two halves. When appending at the
+     * tail of the tree, as it happens when elements are added in order,
+     * a new empty leaf is used instead, so that leaves are left full. */
+    // 叶子节点已满，将它分裂为两个节点，
+    // 如果新元素被追加到整棵树的末尾，那么直接创建一个新的空叶子节点
+    if (leaf->hdr.count == ZBTREE_FANOUT) {
+        zbtreeLeaf *right = zbtCreateLeaf();
+        int last = ZBTREE_FANOUT-1;
+        int append = leaf == zbt->tail &&
+            zbtCompare(score,obj,leaf->scores[last],leaf->objs[last]) > 0;
+        int half = append ? ZBTREE_FANOUT : ZBTREE_FANOUT/2;
+
+        memcpy(right->scores,leaf->scores+half,
+               sizeof(leaf->scores[0])*(ZBTREE_FANOUT-half));
+        memcpy(right->objs,leaf->objs+half,
+               sizeof(leaf->objs[0])*(ZBTREE_FANOUT-half));
+        right->hdr.count = ZBTREE_FANOUT-half;
+        leaf->hdr.count = half;
+
+        right->prev = leaf;
+        right->next = leaf->next;
+        if (leaf->next) leaf->next->prev = right; else zbt->tail = right;
+        leaf->next = right;
+
+        if (append) {
+            zbtInsertInParent(zbt,&leaf->hdr,&right->hdr,score,obj);
+            leaf = right;
+        } else {
+            zbtInsertInParent(zbt,&leaf->hdr,&right->hdr,
+                              right->scores[0],right->objs[0]);
+            if (zbtCompare(score,obj,right->scores[0],right->objs[0]) > 0)
+                leaf = right;
+        }
+    }
+
+    pos = zbtSearch(leaf->scores,leaf->objs,0,leaf->hdr.count,score,obj,1);
+    memmove(leaf->scores+pos+1,leaf->scores+pos,
+            sizeof(leaf->scores[0])*(leaf->hdr.count-pos));
+    memmove(leaf->objs+pos+1,leaf->objs+pos,
+            sizeof(leaf->objs[0])*(leaf->hdr.count-pos));
+    leaf->scores[pos] = score;
+    leaf->objs[pos] = obj;
+    leaf->hdr.count++;
+    zbtUpdateCounts(&leaf->hdr,1);
+    zbt->length++;
 }
 
-/* Find pointer to the first element contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
-    double score;
+/* Remove the child at position 'pos' of the inner node 'in' (the child
+ * itself is not freed). Inner nodes left without children are removed
+ * from the tree, and the root is collapsed when it has a single child. */
+// 从内部节点中移除 pos 位置的子节点
+static void zbtInnerRemoveAt(zbtree *zbt, zbtreeInner *in, int pos) {
+    int move = in->hdr.count-pos-1;
+
+    if (pos > 0) decrRefCount(in->objs[pos]);
+    memmove(in->children+pos,in->children+pos+1,sizeof(in->children[0])*move);
+    memmove(in->counts+pos,in->counts+pos+1,sizeof(in->counts[0])*move);
+    memmove(in->scores+pos,in->scores+pos+1,sizeof(in->scores[0])*move);
+    memmove(in->objs+pos,in->objs+pos+1,sizeof(in->objs[0])*move);
+    in->hdr.count--;
+
+    // 第一个子节点的分隔元素不会被使用
+    if (pos == 0 && in->hdr.count > 0) {
+        decrRefCount(in->objs[0]);
+        in->objs[0] = NULL;
+    }
 
-    /* If everything is out of range, return early. */
-    if (!zzlIsInRange(zl,&range)) return NULL;
+    if (in->hdr.count == 0) {
+        if (in->hdr.parent) {
+            zbtreeInner *parent = in->hdr.parent;
 
-    while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
-        redisAssert(sptr != NULL);
+            zbtInnerRemoveAt(zbt,parent,zbtChildIndex(parent,&in->hdr));
+        } else {
+            // 树已经为空，使用一个空的叶子节点作为根
+            zbtreeLeaf *leaf = zbtCreateLeaf();
 
-        score = zzlGetScore(sptr);
-        if (zslValueGteMin(score,&range)) {
-            /* Check if score <= max. */
-            if (zslValueLteMax(score,&range))
-                return eptr;
-            return NULL;
+            zbt->root = &leaf->hdr;
+            zbt->head = zbt->tail = leaf;
         }
-
-        /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        zfree(in);
+    } else if (in->hdr.count == 1 && in->hdr.parent == NULL) {
+        // 根节点只有一个子节点，将子节点作为新的根
+        zbt->root = in->children[0];
+        zbt->root->parent = NULL;
+        zfree(in);
     }
+}
 
-    return NULL;
+// 将叶子节点从叶子链表中移除
+static void zbtUnlinkLeaf(zbtree *zbt, zbtreeLeaf *leaf) {
+    if (leaf->prev) leaf->prev->next = leaf->next; else zbt->head = leaf->next;
+    if (leaf->next) leaf->next->prev = leaf->prev; else zbt->tail = leaf->prev;
 }
 
-/* Find pointer to the last element contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-unsigned char *zzlLastInRange(unsigned char *zl, zrangespec range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
-    double score;
+/* Move all the elements of 'right' into 'left', its left sibling under the
+ * same parent, and remove 'right' from the tree. */
+// 将 right 的所有元素合并到它左边的兄弟节点 left 中，并删除 right
+static void zbtMergeLeaves(zbtree *zbt, zbtreeLeaf *left, zbtreeLeaf *right,
+                           int rightidx)
+{
+    zbtreeInner *parent = left->hdr.parent;
+
+    memcpy(left->scores+left->hdr.count,right->scores,
+           sizeof(right->scores[0])*right->hdr.count);
+    memcpy(left->objs+left->hdr.count,right->objs,
+           sizeof(right->objs[0])*right->hdr.count);
+    left->hdr.count += right->hdr.count;
+    parent->counts[rightidx-1] += right->hdr.count;
+    parent->counts[rightidx] = 0;
+
+    zbtUnlinkLeaf(zbt,right);
+    zbtInnerRemoveAt(zbt,parent,rightidx);
+    zfree(right);
+}
 
-    /* If everything is out of range, return early. */
-    if (!zzlIsInRange(zl,&range)) return NULL;
+/* Called after an element was removed from 'leaf': free the leaf if it
+ * is empty, or merge it with a sibling if it is less than 1/4 full and
+ * they fit into a single leaf. */
+// 在叶子节点中删除元素之后，释放空的叶子节点，
+// 或者将元素过少的叶子节点和兄弟节点合并
+static void zbtRebalanceLeaf(zbtree *zbt, zbtreeLeaf *leaf) {
+    zbtreeInner *parent = leaf->hdr.parent;
+    int idx;
+
+    if (parent == NULL) return;
+    idx = zbtChildIndex(parent,&leaf->hdr);
+
+    if (leaf->hdr.count == 0) {
+        zbtUnlinkLeaf(zbt,leaf);
+        zbtInnerRemoveAt(zbt,parent,idx);
+        zfree(leaf);
+        return;
+    }
+    if (leaf->hdr.count >= ZBTREE_FANOUT/4) return;
 
-    while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
-        redisAssert(sptr != NULL);
+    if (idx+1 < parent->hdr.count) {
+        zbtreeLeaf *right = (zbtreeLeaf*)parent->children[idx+1];
 
-        score = zzlGetScore(sptr);
-        if (zslValueLteMax(score,&range)) {
-            /* Check if score >= min. */
-            if (zslValueGteMin(score,&range))
-                return eptr;
-            return NULL;
+        if (leaf->hdr.count + right->hdr.count <= ZBTREE_FANOUT) {
+            zbtMergeLeaves(zbt,leaf,right,idx+1);
+            return;
+        }
+    }
+    if (idx > 0) {
+        zbtreeLeaf *left = (zbtreeLeaf*)parent->children[idx-1];
+
+        if (left->hdr.count + leaf->hdr.count <= ZBTREE_FANOUT)
+            zbtMergeLeaves(zbt,left,leaf,idx);
+    }
+}
+
+/* Delete an element with matching score/object from the B+tree.
+ * Returns 1 if the element was found and deleted, 0 otherwise. Like
+ * zslDelete() the reference owned by the tree is released. */
+// 从 B+ 树中删除给定元素，删除成功返回 1 ，元素不存在返回 0
+int zbtDelete(zbtree *zbt, double score, robj *obj) {
+    zbtreeLeaf *leaf = zbtFindLeaf(zbt,score,obj);
+    int pos;
+
+    pos = zbtSearch(leaf->scores,leaf->objs,0,leaf->hdr.count,score,obj,1);
+    if (pos == leaf->hdr.count || leaf->scores[pos] != score ||
+        !equalStringObjects(leaf->objs[pos],obj)) return 0;
+
+    decrRefCount(leaf->objs[pos]);
+    memmove(leaf->scores+pos,leaf->scores+pos+1,
+            sizeof(leaf->scores[0])*(leaf->hdr.count-pos-1));
+    memmove(leaf->objs+pos,leaf->objs+pos+1,
+            sizeof(leaf->objs[0])*(leaf->hdr.count-pos-1));
+    leaf->hdr.count--;
+    zbtUpdateCounts(&leaf->hdr,-1);
+    zbt->length--;
+    zbtRebalanceLeaf(zbt,leaf);
+    return 1;
+}
+
+// 将迭代器指向第一个元素，树为空时返回 0
+int zbtFirst(zbtree *zbt, zbtreeIter *it) {
+    it->leaf = zbt->length ? zbt->head : NULL;
+    it->pos = 0;
+    return it->leaf != NULL;
+}
+
+// 将迭代器指向最后一个元素，树为空时返回 0
+int zbtLast(zbtree *zbt, zbtreeIter *it) {
+    it->leaf = zbt->length ? zbt->tail : NULL;
+    it->pos = it->leaf ? it->leaf->hdr.count-1 : 0;
+    return it->leaf != NULL;
+}
+
+// 将迭代器移动到下一个元素，没有下一个元素时返回 0
+int zbtNext(zbtreeIter *it) {
+    if (++it->pos == it->leaf->hdr.count) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    return it->leaf != NULL;
+}
+
+// 将迭代器移动到上一个元素，没有上一个元素时返回 0
+int zbtPrev(zbtreeIter *it) {
+    if (it->pos-- == 0) {
+        it->leaf = it->leaf->prev;
+        if (it->leaf) it->pos = it->leaf->hdr.count-1;
+    }
+    return it->leaf != NULL;
+}
+
+/* Returns if there is a part of the zset is in range. */
+// 检查 B+ 树是否包含给定 score 区间内的元素
+int zbtIsInRange(zbtree *zbt, zrangespec *range) {
+    zbtreeLeaf *leaf;
+
+    /* Test for ranges that will always be empty. */
+    if (range->min > range->max ||
+            (range->min == range->max && (range->minex || range->maxex)))
+        return 0;
+    if (zbt->length == 0) return 0;
+    leaf = zbt->tail;
+    if (!zslValueGteMin(leaf->scores[leaf->hdr.count-1],range)) return 0;
+    leaf = zbt->head;
+    if (!zslValueLteMax(leaf->scores[0],range)) return 0;
+    return 1;
+}
+
+/* Point 'it' to the first element that is contained in the specified
+ * range. Returns 0 when no element is contained in the range. */
+// 将迭代器指向区间内的第一个元素，区间内没有元素时返回 0
+int zbtFirstInRange(zbtree *zbt, zrangespec range, zbtreeIter *it) {
+    zbtreeNode *n = zbt->root;
+    zbtreeLeaf *leaf;
+    int j;
+
+    /* If everything is out of range, return early. */
+    if (!zbtIsInRange(zbt,&range)) return 0;
+
+    /* Descend into the last child whose separator is *OUT* of range: all
+     * the elements of the previous children are smaller. */
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+
+        j = 1+zslScoresBelowMin(in->scores+1,n->count-1,&range);
+        n = in->children[j-1];
+    }
+
+    leaf = (zbtreeLeaf*)n;
+    j = zslScoresBelowMin(leaf->scores,leaf->hdr.count,&range);
+    it->leaf = leaf;
+    it->pos = j;
+    /* The first element in range may be the first of the next leaf. */
+    if (j == leaf->hdr.count) {
+        it->pos--;
+        zbtNext(it);
+    }
+    /* This is an inner range, so the element can't be missing. */
+    redisAssert(it->leaf != NULL);
+
+    /* Check if score <= max. */
+    return zslValueLteMax(zbtIterScore(it),&range);
+}
+
+/* Point 'it' to the last element that is contained in the specified
+ * range. Returns 0 when no element is contained in the range. */
+// 将迭代器指向区间内的最后一个元素，区间内没有元素时返回 0
+int zbtLastInRange(zbtree *zbt, zrangespec range, zbtreeIter *it) {
+    zbtreeNode *n = zbt->root;
+    zbtreeLeaf *leaf;
+    int j;
+
+    /* If everything is out of range, return early. */
+    if (!zbtIsInRange(zbt,&range)) return 0;
+
+    /* Descend into the last child whose separator is *IN* range: all the
+     * elements of the next children are bigger. */
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+
+        j = 1+zslScoresLteMax(in->scores+1,n->count-1,&range);
+        n = in->children[j-1];
+    }
+
+    leaf = (zbtreeLeaf*)n;
+    j = zslScoresLteMax(leaf->scores,leaf->hdr.count,&range)-1;
+    it->leaf = leaf;
+    it->pos = j;
+    /* The last element in range may be the last of the previous leaf. */
+    if (j < 0) {
+        it->pos = 0;
+        zbtPrev(it);
+    }
+    /* This is an inner range, so the element can't be missing. */
+    redisAssert(it->leaf != NULL);
+
+    /* Check if score >= min. */
+    return zslValueGteMin(zbtIterScore(it),&range);
+}
+
+/* Find the rank for an element by both score and key.
+ * Returns 0 when the element cannot be found, rank otherwise.
+ * Note that the rank is 1-based like with zslGetRank(). */
+// 返回给定元素在 B+ 树中的排位（从 1 开始），元素不存在时返回 0
+unsigned long zbtGetRank(zbtree *zbt, double score, robj *o) {
+    zbtreeNode *n = zbt->root;
+    zbtreeLeaf *leaf;
+    unsigned long rank = 0;
+    int j, pos;
+
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        int idx = zbtChildFor(in,score,o);
+
+        // 累加左边所有子树的元素数量
+        for (j = 0; j < idx; j++) rank += in->counts[j];
+        n = in->children[idx];
+    }
+
+    leaf = (zbtreeLeaf*)n;
+    pos = zbtSearch(leaf->scores,leaf->objs,0,leaf->hdr.count,score,o,1);
+    if (pos == leaf->hdr.count || leaf->scores[pos] != score ||
+        !equalStringObjects(leaf->objs[pos],o)) return 0;
+    return rank+pos+1;
+}
+
+/* Point 'it' to the element with the specified rank. The rank argument
+ * needs to be 1-based. Returns 0 if the rank is out of range. */
+// 将迭代器指向给定排位（从 1 开始）的元素，排位超出范围时返回 0
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtreeIter *it) {
+    zbtreeNode *n = zbt->root;
+    int j;
+
+    if (rank == 0 || rank > zbt->length) {
+        it->leaf = NULL;
+        return 0;
+    }
+
+    rank--;
+    while (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+
+        for (j = 0; j < n->count-1 && rank >= in->counts[j]; j++)
+            rank -= in->counts[j];
+        n = in->children[j];
+    }
+    it->leaf = (zbtreeLeaf*)n;
+    it->pos = rank;
+    return 1;
+}
+
+/* Delete from both the tree and the dictionary the element 'it' points to.
+ * The iterator is no longer valid after the call. */
+// 同时从 B+ 树和字典中删除迭代器指向的元素
+static void zbtDeleteAtIter(zbtree *zbt, zbtreeIter *it, dict *dict) {
+    robj *obj = zbtIterObj(it);
+    double score = zbtIterScore(it);
+
+    // 字典的删除会减少对象的引用计数，先保证对象不会被释放
+    incrRefCount(obj);
+    dictDelete(dict,obj);
+    redisAssert(zbtDelete(zbt,score,obj));
+    decrRefCount(obj);
+}
+
+/* Delete all the elements with score between min and max from the B+tree.
+ * Like zslDeleteRangeByScore(), the elements are removed from the hash
+ * table view of the sorted set as well. */
+// 移除给定分值范围内的所有元素
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec range, dict *dict) {
+    unsigned long removed = 0;
+    zbtreeIter it;
+
+    while (zbtFirstInRange(zbt,range,&it)) {
+        zbtDeleteAtIter(zbt,&it,dict);
+        removed++;
+    }
+    return removed;
+}
+
+/* Delete all the elements with rank between start and end from the B+tree.
+ * Start and end are inclusive. Note that start and end need to be 1-based */
+// 移除给定排位范围内的所有元素
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned int start, unsigned int end, dict *dict) {
+    unsigned long removed = 0;
+    zbtreeIter it;
+
+    while (start+removed <= end && zbtGetElementByRank(zbt,start,&it)) {
+        zbtDeleteAtIter(zbt,&it,dict);
+        removed++;
+    }
+    return removed;
+}
+
+/*-----------------------------------------------------------------------------
+ * Ziplist-backed sorted set API
+ *----------------------------------------------------------------------------*/
+
+/* Scores are stored in the ziplist as integers when they are integral and
+ * exactly representable, so that the ziplist uses its compact integer
+ * encoding. Any other score is stored as the 8 bytes of the double (little
+ * endian) prefixed by ZZL_SCORE_TAG. The tag is never the first byte of a
+ * score in text form, so the scores written by older versions are still
+ * read correctly, and the ziplist never tries to encode these entries as
+ * integers. Older versions can't read the binary scores, so the RDB
+ * version was bumped to 7 when they were introduced. */
+#define ZZL_SCORE_TAG 0xff
+#define ZZL_SCORE_LEN (1+sizeof(double))
+
+/* Store in 'buf' the ziplist representation of 'score', returning its
+ * length. 'buf' must be at least 32 bytes. */
+// 将分值的 ziplist 表示保存到 buf 中，并返回它的长度
+static int zzlEncodeScore(unsigned char *buf, size_t len, double score) {
+    /* -0 is stored as a double, so that its sign is preserved. */
+    if (score > -9007199254740992.0 && score < 9007199254740992.0 &&
+        score == floor(score) && (score != 0 || !signbit(score)))
+        return ll2string((char*)buf,len,(long long)score);
+
+    buf[0] = ZZL_SCORE_TAG;
+    memcpy(buf+1,&score,sizeof(score));
+    memrev64ifbe(buf+1);
+    return ZZL_SCORE_LEN;
+}
+
+double zzlGetScore(unsigned char *sptr) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char buf[128];
+    double score;
+
+    redisAssert(sptr != NULL);
+    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+
+    if (vstr == NULL) {
+        score = vlong;
+    } else if (vlen == ZZL_SCORE_LEN && vstr[0] == ZZL_SCORE_TAG) {
+        memcpy(&score,vstr+1,sizeof(score));
+        memrev64ifbe(&score);
+    } else {
+        /* Score in text form, written by an older version. */
+        memcpy(buf,vstr,vlen);
+        buf[vlen] = '\0';
+        score = strtod(buf,NULL);
+    }
+
+    return score;
+}
+
+/* Compare element in sorted set with given element. */
+int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int clen) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    unsigned char vbuf[32];
+    int minlen, cmp;
+
+    redisAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    if (vstr == NULL) {
+        /* Store string representation of long long in buf. */
+        vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
+        vstr = vbuf;
+    }
+
+    minlen = (vlen < clen) ? vlen : clen;
+    cmp = memcmp(vstr,cstr,minlen);
+    if (cmp == 0) return vlen-clen;
+    return cmp;
+}
+
+unsigned int zzlLength(unsigned char *zl) {
+    return ziplistLen(zl)/2;
+}
+
+/* Move to next entry based on the values in eptr and sptr. Both are set to
+ * NULL when there is no next entry. */
+void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
+    unsigned char *_eptr, *_sptr;
+    redisAssert(*eptr != NULL && *sptr != NULL);
+
+    _eptr = ziplistNext(zl,*sptr);
+    if (_eptr != NULL) {
+        _sptr = ziplistNext(zl,_eptr);
+        redisAssert(_sptr != NULL);
+    } else {
+        /* No next entry. */
+        _sptr = NULL;
+    }
+
+    *eptr = _eptr;
+    *sptr = _sptr;
+}
+
+/* Move to the previous entry based on the values in eptr and sptr. Both are
+ * set to NULL when there is no next entry. */
+void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
+    unsigned char *_eptr, *_sptr;
+    redisAssert(*eptr != NULL && *sptr != NULL);
+
+    _sptr = ziplistPrev(zl,*eptr);
+    if (_sptr != NULL) {
+        _eptr = ziplistPrev(zl,_sptr);
+        redisAssert(_eptr != NULL);
+    } else {
+        /* No previous entry. */
+        _eptr = NULL;
+    }
+
+    *eptr = _eptr;
+    *sptr = _sptr;
+}
+
+/* Returns if there is a part of the zset is in range. Should only be used
+ * internally by zzlFirstInRange and zzlLastInRange. */
+int zzlIsInRange(unsigned char *zl, zrangespec *range) {
+    unsigned char *p;
+    double score;
+
+    /* Test for ranges that will always be empty. */
+    if (range->min > range->max ||
+            (range->min == range->max && (range->minex || range->maxex)))
+        return 0;
+
+    p = ziplistIndex(zl,-1); /* Last score. */
+    if (p == NULL) return 0; /* Empty sorted set */
+    score = zzlGetScore(p);
+    if (!zslValueGteMin(score,range))
+        return 0;
+
+    p = ziplistIndex(zl,1); /* First score. */
+    redisAssert(p != NULL);
+    score = zzlGetScore(p);
+    if (!zslValueLteMax(score,range))
+        return 0;
+
+    return 1;
+}
+
+/* Find pointer to the first element contained in the specified range.
+ * Returns NULL when no element is contained in the range. */
+unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec range) {
+    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    double score;
+
+    /* If everything is out of range, return early. */
+    if (!zzlIsInRange(zl,&range)) return NULL;
+
+    while (eptr != NULL) {
+        sptr = ziplistNext(zl,eptr);
+        redisAssert(sptr != NULL);
+
+        score = zzlGetScore(sptr);
+        if (zslValueGteMin(score,&range)) {
+            /* Check if score <= max. */
+            if (zslValueLteMax(score,&range))
+                return eptr;
+            return NULL;
+        }
+
+        /* Move to next element. */
+        eptr = ziplistNext(zl,sptr);
+    }
+
+    return NULL;
+}
+
+/* Find pointer to the last element contained in the specified range.
+ * Returns NULL when no element is contained in the range. */
+unsigned char *zzlLastInRange(unsigned char *zl, zrangespec range) {
+    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    double score;
+
+    /* If everything is out of range, return early. */
+    if (!zzlIsInRange(zl,&range)) return NULL;
+
+    while (eptr != NULL) {
+        sptr = ziplistNext(zl,eptr);
+        redisAssert(sptr != NULL);
+
+        score = zzlGetScore(sptr);
+        if (zslValueLteMax(score,&range)) {
+            /* Check if score >= min. */
+            if (zslValueGteMin(score,&range))
+                return eptr;
+            return NULL;
         }
 
         /* Move to previous element by moving to the score of previous element.
@@ -706,15 +1715,15 @@ unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
 
 unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, robj *ele, double score) {
     unsigned char *sptr;
-    char scorebuf[128];
+    unsigned char scorebuf[32];
     int scorelen;
     size_t offset;
 
-    redisAssertWithInfo(NULL,ele,ele->encoding == REDIS_ENCODING_RAW);
-    scorelen = d2string(scorebuf,sizeof(scorebuf),score);
+    redisAssertWithInfo(NULL,ele,sdsEncodedObject(ele));
+    scorelen = zzlEncodeScore(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
         zl = ziplistPush(zl,ele->ptr,sdslen(ele->ptr),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = ziplistPush(zl,scorebuf,scorelen,ZIPLIST_TAIL);
     } else {
         /* Keep offset relative to zl, as it might be re-allocated. */
         offset = eptr-zl;
@@ -723,7 +1732,7 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, robj *ele, do
 
         /* Insert score after the element. */
         redisAssertWithInfo(NULL,ele,(sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        zl = ziplistInsert(zl,sptr,scorebuf,scorelen);
     }
 
     return zl;
@@ -767,6 +1776,22 @@ unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score) {
     return zl;
 }
 
+/* Push a copy of the entry 'p' of another ziplist on the tail of 'zl'. */
+// 将另一个 ziplist 中的节点 p 复制到 zl 的表尾
+static unsigned char *zzlPushEntry(unsigned char *zl, unsigned char *p) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    unsigned char vbuf[32];
+
+    redisAssert(ziplistGet(p,&vstr,&vlen,&vlong));
+    if (vstr == NULL) {
+        vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
+        vstr = vbuf;
+    }
+    return ziplistPush(zl,vstr,vlen,ZIPLIST_TAIL);
+}
+
 unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec range, unsigned long *deleted) {
     unsigned char *eptr, *sptr;
     double score;
@@ -805,6 +1830,388 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
     return zl;
 }
 
+/*-----------------------------------------------------------------------------
+ * Block directory sorted set API
+ *----------------------------------------------------------------------------*/
+
+/* Medium sized sorted sets are stored as a list of small ziplists (blocks),
+ * each one holding a run of at most ZBLOCK_MAX_ENTRIES (element,score)
+ * pairs, plus a directory with the first score and the number of elements
+ * of every block. Score seeks scan the (short) array of first scores of the
+ * directory and then a single block, and rank lookups walk the block counts
+ * instead of the elements, while the memory usage stays close to the one of
+ * a single ziplist. */
+
+// 创建一个空的块目录
+zblocks *zblkCreate(void) {
+    zblocks *zb = zmalloc(sizeof(*zb));
+
+    zb->zls = NULL;
+    zb->first = NULL;
+    zb->counts = NULL;
+    zb->nblocks = 0;
+    zb->length = 0;
+    return zb;
+}
+
+// 释放块目录以及所有块
+void zblkFree(zblocks *zb) {
+    unsigned int j;
+
+    for (j = 0; j < zb->nblocks; j++) zfree(zb->zls[j]);
+    zfree(zb->zls);
+    zfree(zb->first);
+    zfree(zb->counts);
+    zfree(zb);
+}
+
+// 在块 pos 被修改之后，更新它在目录中的数据
+static void zblkUpdateBlock(zblocks *zb, unsigned int pos) {
+    zb->counts[pos] = zzlLength(zb->zls[pos]);
+    if (zb->counts[pos])
+        zb->first[pos] = zzlGetScore(ziplistIndex(zb->zls[pos],1));
+}
+
+// 将 ziplist zl 作为新块插入到目录的 pos 位置
+static void zblkInsertBlock(zblocks *zb, unsigned int pos, unsigned char *zl) {
+    unsigned int n = zb->nblocks;
+
+    zb->zls = zrealloc(zb->zls,sizeof(unsigned char*)*(n+1));
+    zb->first = zrealloc(zb->first,sizeof(double)*(n+1));
+    zb->counts = zrealloc(zb->counts,sizeof(unsigned int)*(n+1));
+    memmove(zb->zls+pos+1,zb->zls+pos,sizeof(unsigned char*)*(n-pos));
+    memmove(zb->first+pos+1,zb->first+pos,sizeof(double)*(n-pos));
+    memmove(zb->counts+pos+1,zb->counts+pos,sizeof(unsigned int)*(n-pos));
+    zb->zls[pos] = zl;
+    zb->first[pos] = 0;
+    zb->nblocks++;
+    zblkUpdateBlock(zb,pos);
+}
+
+// 从目录中移除块 pos ，并释放它的 ziplist
+static void zblkRemoveBlock(zblocks *zb, unsigned int pos) {
+    unsigned int n = zb->nblocks-pos-1;
+
+    zfree(zb->zls[pos]);
+    memmove(zb->zls+pos,zb->zls+pos+1,sizeof(unsigned char*)*n);
+    memmove(zb->first+pos,zb->first+pos+1,sizeof(double)*n);
+    memmove(zb->counts+pos,zb->counts+pos+1,sizeof(unsigned int)*n);
+    zb->nblocks--;
+}
+
+/* Move the second half of block 'pos' to a new block when it holds more
+ * than ZBLOCK_MAX_ENTRIES elements. */
+// 如果块 pos 的元素数量超过了限制，那么将它的后半部分移动到一个新块
+static void zblkSplitBlock(zblocks *zb, unsigned int pos) {
+    unsigned char *zl = zb->zls[pos], *newzl, *p;
+    unsigned int keep;
+
+    if (zb->counts[pos] <= ZBLOCK_MAX_ENTRIES) return;
+    keep = zb->counts[pos]/2;
+    newzl = ziplistNew();
+    for (p = ziplistIndex(zl,2*keep); p != NULL; p = ziplistNext(zl,p))
+        newzl = zzlPushEntry(newzl,p);
+    zb->zls[pos] = ziplistDeleteRange(zl,2*keep,2*(zb->counts[pos]-keep));
+    zblkUpdateBlock(zb,pos);
+    zblkInsertBlock(zb,pos+1,newzl);
+}
+
+/* Merge block 'pos' with the next one when together they fill less than
+ * half a block, so that deletions don't leave many almost empty blocks. */
+// 如果块 pos 和它的下一个块都很小，那么将两个块合并
+static void zblkMergeBlock(zblocks *zb, unsigned int pos) {
+    unsigned char *next, *p;
+
+    if (pos+1 >= zb->nblocks ||
+        zb->counts[pos]+zb->counts[pos+1] > ZBLOCK_MAX_ENTRIES/2) return;
+    next = zb->zls[pos+1];
+    for (p = ziplistIndex(next,0); p != NULL; p = ziplistNext(next,p))
+        zb->zls[pos] = zzlPushEntry(zb->zls[pos],p);
+    zblkUpdateBlock(zb,pos);
+    zblkRemoveBlock(zb,pos+1);
+}
+
+/* Called after elements were deleted from block 'pos'. */
+// 在块 pos 的元素被删除之后，移除空块或者合并过小的块
+static void zblkRebalance(zblocks *zb, unsigned int pos) {
+    if (pos >= zb->nblocks) return;
+    if (zb->counts[pos] == 0) {
+        zblkRemoveBlock(zb,pos);
+        if (pos > 0) zblkMergeBlock(zb,pos-1);
+        return;
+    }
+    zblkMergeBlock(zb,pos);
+    if (pos > 0) zblkMergeBlock(zb,pos-1);
+}
+
+/* Called after a range of elements was deleted: 'start' is the first block
+ * that was modified, and 'end' is the block after the last modified one.
+ * The blocks in the middle were emptied and already removed, so only the
+ * blocks at the two edges of the range may be left almost empty. The end
+ * block is handled first, so that 'start' is still valid afterwards. */
+// 在删除一个范围的元素之后，合并范围两端过小的块
+static void zblkRebalanceRange(zblocks *zb, unsigned int start, unsigned int end) {
+    if (end > start+1) zblkRebalance(zb,end-1);
+    zblkRebalance(zb,start);
+}
+
+/* Return the block where the element with the given score and (decoded)
+ * member belongs: the last block whose first element is not greater. */
+// 二分查找目录，返回元素应该被插入的块
+static unsigned int zblkBlockFor(zblocks *zb, double score, robj *ele) {
+    int lo = 0, hi = zb->nblocks-1, mid, cmp;
+    unsigned int pos = 0;
+
+    while (lo <= hi) {
+        mid = (lo+hi)/2;
+        if (zb->first[mid] != score)
+            cmp = (zb->first[mid] < score) ? -1 : 1;
+        else
+            cmp = zzlCompareElements(ziplistIndex(zb->zls[mid],0),
+                                     ele->ptr,sdslen(ele->ptr));
+        if (cmp <= 0) {
+            pos = mid;
+            lo = mid+1;
+        } else {
+            hi = mid-1;
+        }
+    }
+    return pos;
+}
+
+// 将元素添加到块目录中
+void zblkInsert(zblocks *zb, robj *ele, double score) {
+    unsigned int pos = 0;
+
+    ele = getDecodedObject(ele);
+    if (zb->nblocks == 0)
+        zblkInsertBlock(zb,0,ziplistNew());
+    else
+        pos = zblkBlockFor(zb,score,ele);
+    zb->zls[pos] = zzlInsert(zb->zls[pos],ele,score);
+    zb->length++;
+    zblkUpdateBlock(zb,pos);
+    zblkSplitBlock(zb,pos);
+    decrRefCount(ele);
+}
+
+/* Append an element greater than all the others, filling the blocks up to
+ * ZBLOCK_MAX_ENTRIES elements. Used to build a new sorted set from elements
+ * sorted in advance. */
+// 将一个比所有已有元素都大的元素添加到块目录的末尾
+void zblkAppend(zblocks *zb, robj *ele, double score) {
+    unsigned int last;
+
+    if (zb->nblocks == 0 || zb->counts[zb->nblocks-1] == ZBLOCK_MAX_ENTRIES)
+        zblkInsertBlock(zb,zb->nblocks,ziplistNew());
+    last = zb->nblocks-1;
+    zb->zls[last] = zzlInsertAt(zb->zls[last],NULL,ele,score);
+    if (zb->counts[last]++ == 0) zb->first[last] = score;
+    zb->length++;
+}
+
+// 和 zblkAppend 类似，但是从另一个 ziplist 中复制成员和分值
+static void zblkAppendEntry(zblocks *zb, unsigned char *eptr, unsigned char *sptr) {
+    unsigned int last;
+
+    if (zb->nblocks == 0 || zb->counts[zb->nblocks-1] == ZBLOCK_MAX_ENTRIES)
+        zblkInsertBlock(zb,zb->nblocks,ziplistNew());
+    last = zb->nblocks-1;
+    zb->zls[last] = zzlPushEntry(zb->zls[last],eptr);
+    zb->zls[last] = zzlPushEntry(zb->zls[last],sptr);
+    if (zb->counts[last]++ == 0) zb->first[last] = zzlGetScore(sptr);
+    zb->length++;
+}
+
+// 将迭代器指向块 pos 中的 eptr 元素
+static int zblkIterSet(zblocks *zb, zblkIter *it, unsigned int pos,
+                       unsigned char *eptr)
+{
+    it->zb = zb;
+    it->blk = pos;
+    it->eptr = eptr;
+    it->sptr = eptr ? ziplistNext(zb->zls[pos],eptr) : NULL;
+    return eptr != NULL;
+}
+
+/* Look up the member 'ele'. Members are not indexed, so every block is
+ * scanned like a single ziplist would be. */
+// 查找成员，找到时将分值保存到 *score ，并将迭代器指向它
+int zblkFind(zblocks *zb, robj *ele, double *score, zblkIter *it) {
+    unsigned char *eptr = NULL;
+    unsigned int j;
+
+    for (j = 0; j < zb->nblocks; j++)
+        if ((eptr = zzlFind(zb->zls[j],ele,score)) != NULL) break;
+    return zblkIterSet(zb,it,j,eptr);
+}
+
+// 删除迭代器指向的元素，迭代器在删除之后失效
+void zblkDeleteAt(zblocks *zb, zblkIter *it) {
+    unsigned int pos = it->blk;
+
+    zb->zls[pos] = zzlDelete(zb->zls[pos],it->eptr);
+    zb->length--;
+    zblkUpdateBlock(zb,pos);
+    zblkRebalance(zb,pos);
+}
+
+// 将迭代器指向第一个元素，没有元素时返回 0
+int zblkFirst(zblocks *zb, zblkIter *it) {
+    return zblkIterSet(zb,it,0,zb->nblocks ? ziplistIndex(zb->zls[0],0) : NULL);
+}
+
+// 将迭代器指向最后一个元素，没有元素时返回 0
+int zblkLast(zblocks *zb, zblkIter *it) {
+    unsigned int last = zb->nblocks ? zb->nblocks-1 : 0;
+
+    return zblkIterSet(zb,it,last,
+                       zb->nblocks ? ziplistIndex(zb->zls[last],-2) : NULL);
+}
+
+// 将迭代器移动到下一个元素，没有下一个元素时返回 0
+int zblkNext(zblkIter *it) {
+    zblocks *zb = it->zb;
+
+    zzlNext(zb->zls[it->blk],&it->eptr,&it->sptr);
+    if (it->eptr == NULL && it->blk+1 < zb->nblocks) {
+        it->blk++;
+        zblkIterSet(zb,it,it->blk,ziplistIndex(zb->zls[it->blk],0));
+    }
+    return it->eptr != NULL;
+}
+
+// 将迭代器移动到上一个元素，没有上一个元素时返回 0
+int zblkPrev(zblkIter *it) {
+    zblocks *zb = it->zb;
+
+    zzlPrev(zb->zls[it->blk],&it->eptr,&it->sptr);
+    if (it->eptr == NULL && it->blk > 0) {
+        it->blk--;
+        zblkIterSet(zb,it,it->blk,ziplistIndex(zb->zls[it->blk],-2));
+    }
+    return it->eptr != NULL;
+}
+
+/* Return the last block whose first score is out of range on the min side
+ * (or 0): the first element in range, if any, is either in this block or
+ * at the head of the next one. */
+// 返回第一个可能包含给定范围内元素的块
+static unsigned int zblkSeekMin(zblocks *zb, zrangespec *range) {
+    int below = zslScoresBelowMin(zb->first,zb->nblocks,range);
+
+    return below ? below-1 : 0;
+}
+
+// 将迭代器指向给定范围内的第一个元素，范围内没有元素时返回 0
+int zblkFirstInRange(zblocks *zb, zrangespec range, zblkIter *it) {
+    unsigned int pos = zblkSeekMin(zb,&range), end = pos+2;
+    unsigned char *eptr;
+
+    for (; pos < zb->nblocks && pos < end; pos++)
+        if ((eptr = zzlFirstInRange(zb->zls[pos],range)) != NULL)
+            return zblkIterSet(zb,it,pos,eptr);
+    return zblkIterSet(zb,it,0,NULL);
+}
+
+/* The last element in range, if any, is in the last block whose first
+ * score is not greater than max. */
+// 将迭代器指向给定范围内的最后一个元素，范围内没有元素时返回 0
+int zblkLastInRange(zblocks *zb, zrangespec range, zblkIter *it) {
+    int pos = zslScoresLteMax(zb->first,zb->nblocks,&range)-1;
+
+    if (pos == -1) return zblkIterSet(zb,it,0,NULL);
+    return zblkIterSet(zb,it,pos,zzlLastInRange(zb->zls[pos],range));
+}
+
+/* Point the iterator to the element at the 0-based 'rank'. */
+// 将迭代器指向排位为 rank 的元素（从 0 开始），元素不存在时返回 0
+int zblkGetElementByRank(zblocks *zb, unsigned long rank, zblkIter *it) {
+    unsigned int pos = 0;
+
+    if (rank >= zb->length) return zblkIterSet(zb,it,0,NULL);
+    while (rank >= zb->counts[pos]) rank -= zb->counts[pos++];
+    return zblkIterSet(zb,it,pos,ziplistIndex(zb->zls[pos],2*rank));
+}
+
+/* Return the 0-based rank of the element pointed by the iterator. */
+// 返回迭代器指向的元素的排位（从 0 开始）
+unsigned long zblkGetRank(zblkIter *it) {
+    zblocks *zb = it->zb;
+    unsigned char *zl = zb->zls[it->blk], *p;
+    unsigned long rank = 0;
+    unsigned int j;
+
+    for (j = 0; j < it->blk; j++) rank += zb->counts[j];
+    for (p = ziplistIndex(zl,0); p != it->eptr; p = ziplistNext(zl,ziplistNext(zl,p)))
+        rank++;
+    return rank;
+}
+
+// 删除分值在给定范围内的元素，返回被删除元素的数量
+unsigned long zblkDeleteRangeByScore(zblocks *zb, zrangespec range) {
+    unsigned int start = zblkSeekMin(zb,&range), pos = start;
+    unsigned long deleted = 0, num;
+
+    while (pos < zb->nblocks) {
+        /* The blocks after the range are left untouched. */
+        if (pos > start && !zslValueLteMax(zb->first[pos],&range)) break;
+        zb->zls[pos] = zzlDeleteRangeByScore(zb->zls[pos],range,&num);
+        zb->length -= num;
+        deleted += num;
+        zblkUpdateBlock(zb,pos);
+        if (zb->counts[pos] == 0)
+            zblkRemoveBlock(zb,pos);
+        else
+            pos++;
+    }
+    zblkRebalanceRange(zb,start,pos);
+    return deleted;
+}
+
+/* Delete the elements with 1-based rank between start and end, inclusive. */
+// 删除排位在给定范围内的元素，返回被删除元素的数量
+unsigned long zblkDeleteRangeByRank(zblocks *zb, unsigned int start, unsigned int end) {
+    unsigned long skip = start-1, todel = (end-start)+1, deleted = 0, num;
+    unsigned int pos = 0, first;
+
+    while (pos < zb->nblocks && skip >= zb->counts[pos])
+        skip -= zb->counts[pos++];
+    first = pos;
+    while (todel && pos < zb->nblocks) {
+        num = zb->counts[pos]-skip;
+        if (num > todel) num = todel;
+        zb->zls[pos] = ziplistDeleteRange(zb->zls[pos],2*skip,2*num);
+        zb->length -= num;
+        todel -= num;
+        deleted += num;
+        skip = 0;
+        zblkUpdateBlock(zb,pos);
+        if (zb->counts[pos] == 0)
+            zblkRemoveBlock(zb,pos);
+        else
+            pos++;
+    }
+    zblkRebalanceRange(zb,first,pos);
+    return deleted;
+}
+
+/* Return a new ziplist with all the elements of the directory, in the same
+ * format of a ziplist encoded sorted set. BLOCKS sorted sets are saved into
+ * RDB files and DUMP payloads this way. */
+// 将所有块中的元素合并为一个新的 ziplist ，
+// 块目录编码的有序集合以 ziplist 编码的格式保存到 RDB 中
+unsigned char *zblkToZiplist(zblocks *zb) {
+    unsigned char *zl = ziplistNew(), *p;
+    unsigned int j;
+
+    for (j = 0; j < zb->nblocks; j++)
+        for (p = ziplistIndex(zb->zls[j],0); p != NULL;
+             p = ziplistNext(zb->zls[j],p))
+            zl = zzlPushEntry(zl,p);
+    return zl;
+}
+
 /*-----------------------------------------------------------------------------
  * Common sorted set API
  *----------------------------------------------------------------------------*/
@@ -815,91 +2222,701 @@ unsigned int zsetLength(robj *zobj) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         length = ((zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        length = ((zset*)zobj->ptr)->zbt->length;
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        length = ((zblocks*)zobj->ptr)->length;
+    } else {
+        redisPanic("Unknown sorted set encoding");
+    }
+    return length;
+}
+
+/* Return the encoding a sorted set with 'len' elements, the longest being
+ * 'maxelelen' bytes long, should use. */
+// 返回一个有 len 个元素，最长成员为 maxelelen 字节的有序集合应该使用的编码
+int zsetEncodingForSize(unsigned long len, size_t maxelelen) {
+    if (maxelelen <= server.zset_max_ziplist_value) {
+        if (len <= server.zset_max_ziplist_entries)
+            return REDIS_ENCODING_ZIPLIST;
+        if (len <= server.zset_max_blocks_entries)
+            return REDIS_ENCODING_BLOCKS;
+    }
+    if (server.zset_max_skiplist_entries &&
+        len > server.zset_max_skiplist_entries)
+        return REDIS_ENCODING_BTREE;
+    return REDIS_ENCODING_SKIPLIST;
+}
+
+/* Add the elements of the ziplist 'zl' to 'zs', which uses the skiplist
+ * or the B+tree encoding according to 'encoding'. */
+// 将 ziplist 中的所有元素添加到跳跃表或者 B+ 树编码的 zset 中
+static void zsetLoadZiplist(zset *zs, int encoding, unsigned char *zl) {
+    unsigned char *eptr, *sptr;
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    zskiplistNode *node;
+    dictEntry *de;
+    robj *ele;
+    double score;
+
+    eptr = ziplistIndex(zl,0);
+    while (eptr != NULL) {
+        sptr = ziplistNext(zl,eptr);
+        redisAssert(sptr != NULL);
+        score = zzlGetScore(sptr);
+        redisAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+        if (vstr == NULL)
+            ele = createStringObjectFromLongLong(vlong);
+        else
+            ele = createStringObject((char*)vstr,vlen);
+
+        /* Has incremented refcount since it was just created. */
+        if (encoding == REDIS_ENCODING_SKIPLIST) {
+            node = zslInsert(zs->zsl,score,ele);
+            redisAssertWithInfo(NULL,ele,dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+        } else {
+            zbtInsert(zs->zbt,score,ele);
+            de = dictAddRaw(zs->dict,ele);
+            redisAssertWithInfo(NULL,ele,de != NULL);
+            dictSetDoubleVal(de,score);
+        }
+        incrRefCount(ele); /* Added to dictionary. */
+        eptr = ziplistNext(zl,sptr);
+    }
+}
+
+void zsetConvert(robj *zobj, int encoding) {
+    zset *zs;
+    zskiplistNode *node, *next;
+    zbtreeIter it;
+    dictEntry *de;
+    robj *ele;
+
+    if (zobj->encoding == encoding) return;
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST &&
+        encoding == REDIS_ENCODING_BLOCKS)
+    {
+        unsigned char *zl = zobj->ptr, *eptr, *sptr;
+        zblocks *zb = zblkCreate();
+
+        // 将 ziplist 切分为多个块
+        eptr = ziplistIndex(zl,0);
+        while (eptr != NULL) {
+            sptr = ziplistNext(zl,eptr);
+            redisAssertWithInfo(NULL,zobj,sptr != NULL);
+            zblkAppendEntry(zb,eptr,sptr);
+            eptr = ziplistNext(zl,sptr);
+        }
+
+        zfree(zobj->ptr);
+        zobj->ptr = zb;
+        zobj->encoding = REDIS_ENCODING_BLOCKS;
+    } else if (zobj->encoding == REDIS_ENCODING_ZIPLIST ||
+               zobj->encoding == REDIS_ENCODING_BLOCKS)
+    {
+        unsigned int j;
+
+        if (encoding != REDIS_ENCODING_SKIPLIST &&
+            encoding != REDIS_ENCODING_BTREE)
+            redisPanic("Unknown target encoding");
+
+        zs = zmalloc(sizeof(*zs));
+        zs->dict = dictCreate(&zsetDictType,NULL);
+        zs->zsl = (encoding == REDIS_ENCODING_SKIPLIST) ? zslCreate() : NULL;
+        zs->zbt = (encoding == REDIS_ENCODING_BTREE) ? zbtCreate() : NULL;
+
+        /* The ziplist may be empty when a new sorted set is converted
+         * before the elements are added (see zaddBulk()). */
+        if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+            zsetLoadZiplist(zs,encoding,zobj->ptr);
+            zfree(zobj->ptr);
+        } else {
+            zblocks *zb = zobj->ptr;
+
+            for (j = 0; j < zb->nblocks; j++)
+                zsetLoadZiplist(zs,encoding,zb->zls[j]);
+            zblkFree(zb);
+        }
+
+        zobj->ptr = zs;
+        zobj->encoding = encoding;
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST &&
+               encoding == REDIS_ENCODING_BTREE)
+    {
+        /* The elements are visited in order, so they are always appended
+         * at the tail of the tree, leaving full leaves. */
+        // 按顺序将跳跃表中的元素添加到 B+ 树，
+        // 并将分值直接保存到字典节点中
+        zs = zobj->ptr;
+        zs->zbt = zbtCreate();
+        node = zs->zsl->header->level[0].forward;
+        while (node) {
+            zbtInsert(zs->zbt,node->score,node->obj);
+            incrRefCount(node->obj); /* Added to the B+tree. */
+            de = dictFind(zs->dict,node->obj);
+            redisAssertWithInfo(NULL,node->obj,de != NULL);
+            dictSetDoubleVal(de,node->score);
+            node = node->level[0].forward;
+        }
+        zslFree(zs->zsl);
+        zs->zsl = NULL;
+        zobj->encoding = REDIS_ENCODING_BTREE;
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        unsigned char *zl = ziplistNew();
+
+        if (encoding != REDIS_ENCODING_ZIPLIST)
+            redisPanic("Unknown target encoding");
+
+        /* Approach similar to zslFree(), since we want to free the skiplist at
+         * the same time as creating the ziplist. */
+        zs = zobj->ptr;
+        dictRelease(zs->dict);
+        node = zs->zsl->header->level[0].forward;
+        zfree(zs->zsl->header);
+        zfree(zs->zsl);
+
+        while (node) {
+            ele = getDecodedObject(node->obj);
+            zl = zzlInsertAt(zl,NULL,ele,node->score);
+            decrRefCount(ele);
+
+            next = node->level[0].forward;
+            zslFreeNode(node);
+            node = next;
+        }
+
+        zfree(zs);
+        zobj->ptr = zl;
+        zobj->encoding = REDIS_ENCODING_ZIPLIST;
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zs = zobj->ptr;
+
+        if (encoding == REDIS_ENCODING_SKIPLIST) {
+            // 将元素添加到跳跃表，并让字典重新指向跳跃表节点中的分值
+            zs->zsl = zslCreate();
+            if (zbtFirst(zs->zbt,&it)) do {
+                ele = zbtIterObj(&it);
+                node = zslInsert(zs->zsl,zbtIterScore(&it),ele);
+                incrRefCount(ele); /* Added to the skiplist. */
+                de = dictFind(zs->dict,ele);
+                redisAssertWithInfo(NULL,ele,de != NULL);
+                dictGetVal(de) = &node->score;
+            } while (zbtNext(&it));
+            zbtFree(zs->zbt);
+            zs->zbt = NULL;
+            zobj->encoding = REDIS_ENCODING_SKIPLIST;
+        } else if (encoding == REDIS_ENCODING_ZIPLIST) {
+            unsigned char *zl = ziplistNew();
+
+            if (zbtFirst(zs->zbt,&it)) do {
+                ele = getDecodedObject(zbtIterObj(&it));
+                zl = zzlInsertAt(zl,NULL,ele,zbtIterScore(&it));
+                decrRefCount(ele);
+            } while (zbtNext(&it));
+            dictRelease(zs->dict);
+            zbtFree(zs->zbt);
+            zfree(zs);
+            zobj->ptr = zl;
+            zobj->encoding = REDIS_ENCODING_ZIPLIST;
+        } else {
+            redisPanic("Unknown target encoding");
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
-    return length;
 }
 
-void zsetConvert(robj *zobj, int encoding) {
-    zset *zs;
-    zskiplistNode *node, *next;
-    robj *ele;
+/* Convert a skiplist encoded sorted set to the B+tree encoding if it
+ * is now bigger than zset_max_skiplist_entries. */
+// 如果跳跃表编码的有序集合的元素数量超过了限制，那么将它转换为 B+ 树编码
+void zsetConvertToBtreeIfNeeded(robj *zobj) {
+    if (zobj->encoding == REDIS_ENCODING_SKIPLIST &&
+        server.zset_max_skiplist_entries &&
+        ((zset*)zobj->ptr)->zsl->length > server.zset_max_skiplist_entries)
+        zsetConvert(zobj,REDIS_ENCODING_BTREE);
+}
+
+/* Return a copy of the sorted set object 'o' with the same encoding. The
+ * member objects are shared between the two sorted sets. */
+// 创建有序集合对象的副本，副本和原对象共享成员对象
+robj *zsetDup(robj *o) {
+    robj *zobj;
+
+    redisAssertWithInfo(NULL,o,o->type == REDIS_ZSET);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        size_t len = ziplistBlobLen(o->ptr);
+        unsigned char *zl = zmalloc(len);
+
+        memcpy(zl,o->ptr,len);
+        zobj = createObject(REDIS_ZSET,zl);
+        zobj->encoding = REDIS_ENCODING_ZIPLIST;
+    } else if (o->encoding == REDIS_ENCODING_BLOCKS) {
+        zblocks *zb = o->ptr, *copy = zblkCreate();
+        unsigned int j;
+        size_t len;
+
+        if (zb->nblocks) {
+            copy->zls = zmalloc(sizeof(unsigned char*)*zb->nblocks);
+            copy->first = zmalloc(sizeof(double)*zb->nblocks);
+            copy->counts = zmalloc(sizeof(unsigned int)*zb->nblocks);
+            memcpy(copy->first,zb->first,sizeof(double)*zb->nblocks);
+            memcpy(copy->counts,zb->counts,sizeof(unsigned int)*zb->nblocks);
+            for (j = 0; j < zb->nblocks; j++) {
+                len = ziplistBlobLen(zb->zls[j]);
+                copy->zls[j] = zmalloc(len);
+                memcpy(copy->zls[j],zb->zls[j],len);
+            }
+        }
+        copy->nblocks = zb->nblocks;
+        copy->length = zb->length;
+        zobj = createObject(REDIS_ZSET,copy);
+        zobj->encoding = REDIS_ENCODING_BLOCKS;
+    } else if (o->encoding == REDIS_ENCODING_SKIPLIST ||
+               o->encoding == REDIS_ENCODING_BTREE)
+    {
+        zset *zs = o->ptr, *dup;
+
+        zobj = createZsetObject();
+        if (o->encoding == REDIS_ENCODING_BTREE)
+            zsetConvert(zobj,REDIS_ENCODING_BTREE);
+        dup = zobj->ptr;
+        dictExpand(dup->dict,dictSize(zs->dict));
+
+        /* The elements are visited in order, so they are always appended
+         * at the tail of the skiplist or B+tree. */
+        if (o->encoding == REDIS_ENCODING_SKIPLIST) {
+            zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *ln, *node;
+            unsigned int rank[ZSKIPLIST_MAXLEVEL];
+
+            zslTailPath(dup->zsl,update,rank);
+            for (ln = zs->zsl->header->level[0].forward; ln != NULL;
+                 ln = ln->level[0].forward)
+            {
+                node = zslAppend(dup->zsl,update,rank,ln->score,ln->obj);
+                dictAdd(dup->dict,ln->obj,&node->score);
+                incrRefCount(ln->obj); /* Added to the skiplist. */
+                incrRefCount(ln->obj); /* Added to the dictionary. */
+            }
+        } else {
+            zbtreeIter it;
+            dictEntry *de;
+            robj *ele;
+
+            if (zbtFirst(zs->zbt,&it)) do {
+                ele = zbtIterObj(&it);
+                zbtInsert(dup->zbt,zbtIterScore(&it),ele);
+                de = dictAddRaw(dup->dict,ele);
+                dictSetDoubleVal(de,zbtIterScore(&it));
+                incrRefCount(ele); /* Added to the B+tree. */
+                incrRefCount(ele); /* Added to the dictionary. */
+            } while (zbtNext(&it));
+        }
+    } else {
+        redisPanic("Unknown sorted set encoding");
+    }
+    return zobj;
+}
+
+/*-----------------------------------------------------------------------------
+ * Sorted set commands 
+ *----------------------------------------------------------------------------*/
+
+/* Big ZADD calls don't insert the elements one after the other: the
+ * (score,member) pairs are sorted once, the members are looked up in bulk,
+ * and the final encoding is selected before modifying the sorted set, so
+ * that it is never converted midway. Ziplists and block directories are
+ * rebuilt with a single merge, while skiplists get the sorted elements appended at the tail
+ * whenever possible. */
+// ZADD 的元素数量达到这个值时，使用批量插入
+#define ZADD_BULK_THRESHOLD 32
+
+#define ZADD_PAIR_SKIP 0    // 元素已经存在，并且分值没有变化
+#define ZADD_PAIR_NEW 1     // 新元素
+#define ZADD_PAIR_UPDATE 2  // 元素已经存在，但分值有变化
+
+typedef struct zaddPair {
+    double score;       // 新分值
+    double oldscore;    // 元素已经存在时，它的旧分值
+    robj *ele;          // 成员
+    int idx;            // 元素在命令参数中的位置
+    int state;          // ZADD_PAIR_*
+} zaddPair;
+
+// 按成员排序，成员相同时按参数位置排序
+static int zaddPairCompareByMember(const void *a, const void *b) {
+    const zaddPair *pa = a, *pb = b;
+    int cmp = compareStringObjects(pa->ele,pb->ele);
+
+    if (cmp != 0) return cmp;
+    return pa->idx - pb->idx;
+}
+
+// 按分值排序，分值相同时按成员排序，和有序集合的顺序一致
+static int zaddPairCompareByScore(const void *a, const void *b) {
+    const zaddPair *pa = a, *pb = b;
+
+    if (pa->score < pb->score) return -1;
+    if (pa->score > pb->score) return 1;
+    return compareStringObjects(pa->ele,pb->ele);
+}
+
+/* Return the pair of the first 'count' pairs (sorted by member) having
+ * the member stored at 'eptr', or NULL. */
+// 在按成员排序的元素中二分查找 eptr 处的成员
+static zaddPair *zaddBulkSearchMember(zaddPair *pairs, int count,
+                                      unsigned char *eptr)
+{
+    int lo = 0, hi = count-1, mid, cmp;
+
+    while (lo <= hi) {
+        mid = (lo+hi)/2;
+        cmp = zzlCompareElements(eptr,pairs[mid].ele->ptr,
+                                 sdslen(pairs[mid].ele->ptr));
+        if (cmp == 0) return pairs+mid;
+        if (cmp < 0) hi = mid-1; else lo = mid+1;
+    }
+    return NULL;
+}
+
+/* Look up in the ziplist (or in the blocks of a block directory) the
+ * members of the first 'count' pairs, setting their state. Returns the
+ * number of new members, and stores the length of the longest new member
+ * in *maxelelen.
+ *
+ * The pairs are sorted by member at this point: a block directory, that
+ * can hold many more elements than a ziplist, is scanned only once, and
+ * every element is searched among the pairs. */
+// 在 ziplist 或者块目录中查找各个成员，设置它们的状态，返回新元素的数量
+static int zaddBulkLookupZiplist(robj *zobj, zaddPair *pairs, int count,
+                                 size_t *maxelelen)
+{
+    int j, found, added = 0;
+    double curscore;
+    zblkIter it;
+    zaddPair *pair;
+
+    if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        for (j = 0; j < count; j++) pairs[j].state = ZADD_PAIR_NEW;
+        if (zblkFirst(zobj->ptr,&it)) do {
+            pair = zaddBulkSearchMember(pairs,count,it.eptr);
+            if (pair == NULL) continue;
+            pair->oldscore = zzlGetScore(it.sptr);
+            pair->state = (pair->oldscore == pair->score) ?
+                          ZADD_PAIR_SKIP : ZADD_PAIR_UPDATE;
+        } while (zblkNext(&it));
+    }
+
+    *maxelelen = 0;
+    for (j = 0; j < count; j++) {
+        if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+            found = zzlFind(zobj->ptr,pairs[j].ele,&curscore) != NULL;
+        } else {
+            found = pairs[j].state != ZADD_PAIR_NEW;
+            curscore = pairs[j].oldscore;
+        }
+        if (found) {
+            pairs[j].oldscore = curscore;
+            pairs[j].state = (curscore == pairs[j].score) ?
+                             ZADD_PAIR_SKIP : ZADD_PAIR_UPDATE;
+        } else {
+            pairs[j].state = ZADD_PAIR_NEW;
+            if (sdslen(pairs[j].ele->ptr) > *maxelelen)
+                *maxelelen = sdslen(pairs[j].ele->ptr);
+            added++;
+        }
+    }
+    return added;
+}
+
+/* Same as zaddBulkLookupZiplist() for the skiplist and B+tree encodings.
+ * The members are encoded first, and existing members are replaced by the
+ * object shared by the dictionary and the ordered index. */
+// 在字典中查找各个成员，设置它们的状态，返回新元素的数量
+static int zaddBulkLookupDict(redisClient *c, robj *zobj, zaddPair *pairs,
+                              int count)
+{
+    zset *zs = zobj->ptr;
+    dictEntry *de;
+    int j, added = 0;
+
+    for (j = 0; j < count; j++) {
+        pairs[j].ele = c->argv[3+pairs[j].idx*2] =
+            tryObjectEncoding(c->argv[3+pairs[j].idx*2]);
+        de = dictFind(zs->dict,pairs[j].ele);
+        if (de != NULL) {
+            pairs[j].ele = dictGetKey(de);
+            pairs[j].oldscore = zsetDictScore(zobj->encoding,de);
+            pairs[j].state = (pairs[j].oldscore == pairs[j].score) ?
+                             ZADD_PAIR_SKIP : ZADD_PAIR_UPDATE;
+        } else {
+            pairs[j].state = ZADD_PAIR_NEW;
+            added++;
+        }
+    }
+    return added;
+}
+
+/* Drop the pairs that don't modify the sorted set, returning how many
+ * pairs are left. */
+// 移除不会修改有序集合的元素，返回剩余元素的数量
+static int zaddBulkCompact(zaddPair *pairs, int count) {
+    int j, pending = 0;
+
+    for (j = 0; j < count; j++)
+        if (pairs[j].state != ZADD_PAIR_SKIP) pairs[pending++] = pairs[j];
+    return pending;
+}
+
+/* Rebuild the ziplist merging its entries with the sorted pairs. */
+// 合并 ziplist 原有的元素和排序后的新元素，创建一个新的 ziplist
+static void zaddBulkMergeZiplist(robj *zobj, zaddPair *pairs, int pending) {
+    unsigned char *zl = zobj->ptr, *newzl = ziplistNew();
+    unsigned char *eptr, *sptr = NULL;
+    double score = 0;
+    int j, k = 0;
+
+    /* Remove the updated members, they are merged again with the new
+     * score like the other pairs. */
+    for (j = 0; j < pending; j++) {
+        if (pairs[j].state != ZADD_PAIR_UPDATE) continue;
+        redisAssert((eptr = zzlFind(zl,pairs[j].ele,&score)) != NULL);
+        zl = zzlDelete(zl,eptr);
+    }
+
+    qsort(pairs,pending,sizeof(zaddPair),zaddPairCompareByScore);
+
+    eptr = ziplistIndex(zl,0);
+    while (eptr != NULL || k < pending) {
+        if (eptr != NULL) {
+            sptr = ziplistNext(zl,eptr);
+            redisAssert(sptr != NULL);
+            score = zzlGetScore(sptr);
+        }
+
+        if (k < pending &&
+            (eptr == NULL || pairs[k].score < score ||
+             (pairs[k].score == score &&
+              zzlCompareElements(eptr,pairs[k].ele->ptr,
+                                 sdslen(pairs[k].ele->ptr)) > 0)))
+        {
+            newzl = zzlInsertAt(newzl,NULL,pairs[k].ele,pairs[k].score);
+            k++;
+        } else {
+            newzl = zzlPushEntry(newzl,eptr);
+            newzl = zzlPushEntry(newzl,sptr);
+            eptr = ziplistNext(zl,sptr);
+        }
+    }
+
+    zfree(zl);
+    zobj->ptr = newzl;
+}
+
+// 按旧分值排序，旧分值相同时按成员排序，和元素在有序集合中原来的顺序一致
+static int zaddPairCompareByOldScore(const void *a, const void *b) {
+    const zaddPair *pa = *(zaddPair**)a, *pb = *(zaddPair**)b;
+
+    if (pa->oldscore < pb->oldscore) return -1;
+    if (pa->oldscore > pb->oldscore) return 1;
+    return compareStringObjects(pa->ele,pb->ele);
+}
+
+/* Same as zaddBulkMergeZiplist() for the block directory encoding: the
+ * directory is rebuilt merging the old elements with the sorted pairs.
+ * The old elements of the updated members are skipped while merging:
+ * sorted by their old score they show up in the same order as in the
+ * directory, so a second cursor is enough and no lookup is needed. */
+// 合并块目录原有的元素和排序后的新元素，创建一个新的块目录
+static void zaddBulkMergeBlocks(robj *zobj, zaddPair *pairs, int pending) {
+    zblocks *zb = zobj->ptr, *newzb = zblkCreate();
+    zaddPair **updated = zmalloc(sizeof(zaddPair*)*(pending ? pending : 1));
+    int j, k = 0, u = 0, nupdated = 0;
+    zblkIter it;
     double score;
 
-    if (zobj->encoding == encoding) return;
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
-        unsigned char *zl = zobj->ptr;
-        unsigned char *eptr, *sptr;
-        unsigned char *vstr;
-        unsigned int vlen;
-        long long vlong;
+    qsort(pairs,pending,sizeof(zaddPair),zaddPairCompareByScore);
+    for (j = 0; j < pending; j++)
+        if (pairs[j].state == ZADD_PAIR_UPDATE) updated[nupdated++] = pairs+j;
+    qsort(updated,nupdated,sizeof(zaddPair*),zaddPairCompareByOldScore);
 
-        if (encoding != REDIS_ENCODING_SKIPLIST)
-            redisPanic("Unknown target encoding");
+    if (zblkFirst(zb,&it)) do {
+        score = zzlGetScore(it.sptr);
 
-        zs = zmalloc(sizeof(*zs));
-        zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
+        // 跳过分值被更新的成员的旧元素
+        if (u < nupdated && updated[u]->oldscore == score &&
+            zzlCompareElements(it.eptr,updated[u]->ele->ptr,
+                               sdslen(updated[u]->ele->ptr)) == 0)
+        {
+            u++;
+            continue;
+        }
 
-        eptr = ziplistIndex(zl,0);
-        redisAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
-        redisAssertWithInfo(NULL,zobj,sptr != NULL);
+        // 先添加所有排在这个元素之前的新元素
+        while (k < pending &&
+               (pairs[k].score < score ||
+                (pairs[k].score == score &&
+                 zzlCompareElements(it.eptr,pairs[k].ele->ptr,
+                                    sdslen(pairs[k].ele->ptr)) > 0)))
+        {
+            zblkAppend(newzb,pairs[k].ele,pairs[k].score);
+            k++;
+        }
+        zblkAppendEntry(newzb,it.eptr,it.sptr);
+    } while (zblkNext(&it));
+    redisAssert(u == nupdated);
 
-        while (eptr != NULL) {
-            score = zzlGetScore(sptr);
-            redisAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
-            if (vstr == NULL)
-                ele = createStringObjectFromLongLong(vlong);
-            else
-                ele = createStringObject((char*)vstr,vlen);
+    for (; k < pending; k++)
+        zblkAppend(newzb,pairs[k].ele,pairs[k].score);
 
-            /* Has incremented refcount since it was just created. */
-            node = zslInsert(zs->zsl,score,ele);
-            redisAssertWithInfo(NULL,zobj,dictAdd(zs->dict,ele,&node->score) == DICT_OK);
-            incrRefCount(ele); /* Added to dictionary. */
-            zzlNext(zl,&eptr,&sptr);
+    zfree(updated);
+    zblkFree(zb);
+    zobj->ptr = newzb;
+}
+
+/* Insert the sorted pairs in the skiplist or B+tree encoded sorted set. */
+// 将排序后的元素添加到跳跃表或者 B+ 树编码的有序集合中
+static void zaddBulkInsertDict(redisClient *c, robj *zobj, zaddPair *pairs,
+                               int pending, int added)
+{
+    zset *zs = zobj->ptr;
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *znode = NULL;
+    unsigned int rank[ZSKIPLIST_MAXLEVEL];
+    int j, tailpath = 0;
+    dictEntry *de;
+
+    /* Remove the updated members from the ordered index: the dictionary
+     * still has a reference to them. */
+    for (j = 0; j < pending; j++) {
+        if (pairs[j].state != ZADD_PAIR_UPDATE) continue;
+        if (zobj->encoding == REDIS_ENCODING_SKIPLIST)
+            redisAssertWithInfo(c,pairs[j].ele,
+                zslDelete(zs->zsl,pairs[j].oldscore,pairs[j].ele));
+        else
+            redisAssertWithInfo(c,pairs[j].ele,
+                zbtDelete(zs->zbt,pairs[j].oldscore,pairs[j].ele));
+    }
+
+    // 一次性扩展字典，避免在添加元素的过程中多次 rehash
+    if (added && !dictIsRehashing(zs->dict))
+        dictExpand(zs->dict,dictSize(zs->dict)+added);
+
+    qsort(pairs,pending,sizeof(zaddPair),zaddPairCompareByScore);
+
+    for (j = 0; j < pending; j++) {
+        double score = pairs[j].score;
+        robj *ele = pairs[j].ele;
+
+        if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+            zskiplistNode *tail = zs->zsl->tail;
+
+            /* Elements greater than the tail are appended without searching
+             * the insertion point: the tail path stays valid until an
+             * element is inserted in the middle of the skiplist. */
+            if (tail == NULL || tail->score < score ||
+                (tail->score == score &&
+                 compareStringObjects(tail->obj,ele) < 0))
+            {
+                if (!tailpath) {
+                    zslTailPath(zs->zsl,update,rank);
+                    tailpath = 1;
+                }
+                znode = zslAppend(zs->zsl,update,rank,score,ele);
+            } else {
+                znode = zslInsert(zs->zsl,score,ele);
+                tailpath = 0;
+            }
+        } else {
+            zbtInsert(zs->zbt,score,ele);
         }
+        incrRefCount(ele); /* Inserted in the ordered index. */
 
-        zfree(zobj->ptr);
-        zobj->ptr = zs;
-        zobj->encoding = REDIS_ENCODING_SKIPLIST;
-    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        if (pairs[j].state == ZADD_PAIR_NEW) {
+            de = dictAddRaw(zs->dict,ele);
+            redisAssertWithInfo(c,ele,de != NULL);
+            incrRefCount(ele); /* Added to dictionary. */
+        } else {
+            de = dictFind(zs->dict,ele);
+            redisAssertWithInfo(c,ele,de != NULL);
+        }
+        if (zobj->encoding == REDIS_ENCODING_SKIPLIST)
+            dictSetVal(zs->dict,de,&znode->score);
+        else
+            dictSetDoubleVal(de,score);
+    }
+}
 
-        if (encoding != REDIS_ENCODING_ZIPLIST)
-            redisPanic("Unknown target encoding");
+/* Add the 'elements' (score,member) pairs of a ZADD call to 'zobj'.
+ * Returns the number of new elements, and stores in *changed the number of
+ * elements that were added or had their score updated. */
+// 批量地将 ZADD 的所有元素添加到有序集合，返回新元素的数量
+static int zaddBulk(redisClient *c, robj *zobj, double *scores, int elements,
+                    int *changed)
+{
+    zaddPair *pairs = zmalloc(sizeof(zaddPair)*elements);
+    int j, unique = 0, added = 0, pending, encoding;
+    size_t maxelelen, newlen;
 
-        /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
-        zs = zobj->ptr;
-        dictRelease(zs->dict);
-        node = zs->zsl->header->level[0].forward;
-        zfree(zs->zsl->header);
-        zfree(zs->zsl);
+    for (j = 0; j < elements; j++) {
+        pairs[j].score = scores[j];
+        pairs[j].ele = c->argv[3+j*2];
+        pairs[j].idx = j;
+    }
 
-        while (node) {
-            ele = getDecodedObject(node->obj);
-            zl = zzlInsertAt(zl,NULL,ele,node->score);
-            decrRefCount(ele);
+    /* Sort by member so that repeated members are adjacent: like when the
+     * elements are added one after the other, the last score wins. */
+    // 去除重复的成员，只保留最后一个分值
+    qsort(pairs,elements,sizeof(zaddPair),zaddPairCompareByMember);
+    for (j = 0; j < elements; j++) {
+        if (j+1 < elements && equalStringObjects(pairs[j].ele,pairs[j+1].ele))
+            continue;
+        pairs[unique++] = pairs[j];
+    }
 
-            next = node->level[0].forward;
-            zslFreeNode(node);
-            node = next;
+    /* Select the final encoding up front. A ziplist (or a block directory)
+     * can't hold more than zset_max_ziplist_entries (zset_max_blocks_entries)
+     * elements, so the lookup is only performed when the unique members may
+     * fit. The ziplist based encodings are never selected again once the
+     * sorted set outgrew them. */
+    // 在修改有序集合之前决定它最终的编码
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST ||
+        zobj->encoding == REDIS_ENCODING_BLOCKS)
+    {
+        encoding = zsetEncodingForSize(unique,0);
+        if (encoding == REDIS_ENCODING_SKIPLIST ||
+            encoding == REDIS_ENCODING_BTREE) {
+            zsetConvert(zobj,encoding);
+        } else {
+            added = zaddBulkLookupZiplist(zobj,pairs,unique,&maxelelen);
+            newlen = zsetLength(zobj)+added;
+            encoding = zsetEncodingForSize(newlen,maxelelen);
+            if (encoding != REDIS_ENCODING_ZIPLIST &&
+                encoding != zobj->encoding)
+                zsetConvert(zobj,encoding);
         }
+    }
 
-        zfree(zs);
-        zobj->ptr = zl;
-        zobj->encoding = REDIS_ENCODING_ZIPLIST;
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        pending = zaddBulkCompact(pairs,unique);
+        zaddBulkMergeZiplist(zobj,pairs,pending);
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        pending = zaddBulkCompact(pairs,unique);
+        zaddBulkMergeBlocks(zobj,pairs,pending);
     } else {
-        redisPanic("Unknown sorted set encoding");
+        added = zaddBulkLookupDict(c,zobj,pairs,unique);
+        if (zobj->encoding == REDIS_ENCODING_SKIPLIST &&
+            server.zset_max_skiplist_entries &&
+            zsetLength(zobj)+added > server.zset_max_skiplist_entries)
+            zsetConvert(zobj,REDIS_ENCODING_BTREE);
+        pending = zaddBulkCompact(pairs,unique);
+        zaddBulkInsertDict(c,zobj,pairs,pending,added);
     }
-}
 
-/*-----------------------------------------------------------------------------
- * Sorted set commands 
- *----------------------------------------------------------------------------*/
+    zfree(pairs);
+    *changed = pending;
+    return added;
+}
 
 /* This generic command implements both ZADD and ZINCRBY. */
 void zaddGenericCommand(redisClient *c, int incr) {
@@ -944,11 +2961,28 @@ void zaddGenericCommand(redisClient *c, int incr) {
         }
         dbAdd(c->db,key,zobj);
     } else {
-        if (zobj->type != REDIS_ZSET) {
+        if (objectType(zobj) != REDIS_ZSET) {
             addReply(c,shared.wrongtypeerr);
             zfree(scores);
             return;
         }
+        // 有序集合可能正在被分批回复，修改它的副本
+        zobj = dbUnshareZsetValue(c->db,key,zobj);
+    }
+
+    /* Big ZADD calls use the batch insertion path. */
+    // 元素数量较多的 ZADD 使用批量插入
+    if (!incr && elements >= ZADD_BULK_THRESHOLD) {
+        int changed;
+
+        added = zaddBulk(c,zobj,scores,elements,&changed);
+        if (changed) {
+            signalModifiedKey(c->db,key);
+            server.dirty += changed;
+        }
+        zfree(scores);
+        addReplyLongLong(c,added);
+        return;
     }
 
     // 将所有 elements 加入到 sorted set （可能是 ZIPLIST 或 ZSET）
@@ -984,16 +3018,55 @@ void zaddGenericCommand(redisClient *c, int incr) {
                 /* Optimize: check if the element is too large or the list
                  * becomes too long *before* executing zzlInsert. */
                 zobj->ptr = zzlInsert(zobj->ptr,ele,score);
-                if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries)
-                    zsetConvert(zobj,REDIS_ENCODING_SKIPLIST);
-                if (sdslen(ele->ptr) > server.zset_max_ziplist_value)
-                    zsetConvert(zobj,REDIS_ENCODING_SKIPLIST);
+                if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
+                    sdslen(ele->ptr) > server.zset_max_ziplist_value)
+                    zsetConvert(zobj,zsetEncodingForSize(zzlLength(zobj->ptr),
+                                                         sdslen(ele->ptr)));
 
                 signalModifiedKey(c->db,key);
                 server.dirty++;
                 if (!incr) added++;
             }
-        } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+            zblocks *zb = zobj->ptr;
+            zblkIter it;
+
+            ele = c->argv[3+j*2];
+            if (zblkFind(zb,ele,&curscore,&it)) {
+                if (incr) {
+                    score += curscore;
+                    if (isnan(score)) {
+                        addReplyError(c,nanerr);
+                        /* Don't need to check if the sorted set is empty
+                         * because we know it has at least one element. */
+                        zfree(scores);
+                        return;
+                    }
+                }
+
+                /* Remove and re-insert when score changed. */
+                if (score != curscore) {
+                    zblkDeleteAt(zb,&it);
+                    zblkInsert(zb,ele,score);
+
+                    signalModifiedKey(c->db,key);
+                    server.dirty++;
+                }
+            } else {
+                // 元素数量过多或者成员过长时，转换为跳跃表或者 B+ 树编码
+                zblkInsert(zb,ele,score);
+                if (zb->length > server.zset_max_blocks_entries ||
+                    sdslen(ele->ptr) > server.zset_max_ziplist_value)
+                    zsetConvert(zobj,zsetEncodingForSize(zb->length,
+                                                         sdslen(ele->ptr)));
+
+                signalModifiedKey(c->db,key);
+                server.dirty++;
+                if (!incr) added++;
+            }
+        } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST ||
+                   zobj->encoding == REDIS_ENCODING_BTREE)
+        {
             zset *zs = zobj->ptr;
             zskiplistNode *znode;
             dictEntry *de;
@@ -1004,7 +3077,7 @@ void zaddGenericCommand(redisClient *c, int incr) {
             if (de != NULL) {
                 // 修改已有节点
                 curobj = dictGetKey(de);
-                curscore = *(double*)dictGetVal(de);
+                curscore = zsetDictScore(zobj->encoding,de);
 
                 if (incr) {
                     score += curscore;
@@ -1021,15 +3094,22 @@ void zaddGenericCommand(redisClient *c, int incr) {
                  * delete the key object from the skiplist, since the
                  * dictionary still has a reference to it. */
                 if (score != curscore) {
-                    redisAssertWithInfo(c,curobj,zslDelete(zs->zsl,curscore,curobj));
-                    znode = zslInsert(zs->zsl,score,curobj);
-                    incrRefCount(curobj); /* Re-inserted in skiplist. */
-                    dictGetVal(de) = &znode->score; /* Update score ptr. */
+                    if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+                        redisAssertWithInfo(c,curobj,zslDelete(zs->zsl,curscore,curobj));
+                        znode = zslInsert(zs->zsl,score,curobj);
+                        incrRefCount(curobj); /* Re-inserted in skiplist. */
+                        dictGetVal(de) = &znode->score; /* Update score ptr. */
+                    } else {
+                        redisAssertWithInfo(c,curobj,zbtDelete(zs->zbt,curscore,curobj));
+                        zbtInsert(zs->zbt,score,curobj);
+                        incrRefCount(curobj); /* Re-inserted in B+tree. */
+                        dictSetDoubleVal(de,score); /* Update score. */
+                    }
 
                     signalModifiedKey(c->db,key);
                     server.dirty++;
                 }
-            } else {
+            } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
                 // 新建节点到 zsl 和 dict
                 znode = zslInsert(zs->zsl,score,ele);
                 incrRefCount(ele); /* Inserted in skiplist. */
@@ -1037,6 +3117,21 @@ void zaddGenericCommand(redisClient *c, int incr) {
                 redisAssertWithInfo(c,NULL,dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
                 incrRefCount(ele); /* Added to dictionary. */
 
+                // 元素数量过多时转换为 B+ 树编码
+                zsetConvertToBtreeIfNeeded(zobj);
+
+                signalModifiedKey(c->db,key);
+                server.dirty++;
+                if (!incr) added++;
+            } else {
+                // 新建元素到 B+ 树和 dict ，分值直接保存在字典节点中
+                zbtInsert(zs->zbt,score,ele);
+                incrRefCount(ele); /* Inserted in B+tree. */
+                de = dictAddRaw(zs->dict,ele);
+                redisAssertWithInfo(c,NULL,de != NULL);
+                dictSetDoubleVal(de,score);
+                incrRefCount(ele); /* Added to dictionary. */
+
                 signalModifiedKey(c->db,key);
                 server.dirty++;
                 if (!incr) added++;
@@ -1068,6 +3163,7 @@ void zremCommand(redisClient *c) {
     // 如果 key 不存在或者类型不是有序集，那么返回
     if ((zobj = lookupKeyWriteOrReply(c,key,shared.czero)) == NULL ||
         checkType(c,zobj,REDIS_ZSET)) return;
+    zobj = dbUnshareZsetValue(c->db,key,zobj);
 
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *eptr;
@@ -1083,7 +3179,24 @@ void zremCommand(redisClient *c) {
                 }
             }
         }
-    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblocks *zb = zobj->ptr;
+        zblkIter it;
+        double score;
+
+        for (j = 2; j < c->argc; j++) {
+            if (zblkFind(zb,c->argv[j],&score,&it)) {
+                deleted++;
+                zblkDeleteAt(zb,&it);
+                if (zb->length == 0) {
+                    dbDelete(c->db,key);
+                    break;
+                }
+            }
+        }
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST ||
+               zobj->encoding == REDIS_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
         dictEntry *de;
         double score;
@@ -1093,10 +3206,13 @@ void zremCommand(redisClient *c) {
             if (de != NULL) {
                 deleted++;
 
-                /* Delete from the skiplist */
-                score = *(double*)dictGetVal(de);
-                // 在 zsl 删除
-                redisAssertWithInfo(c,c->argv[j],zslDelete(zs->zsl,score,c->argv[j]));
+                /* Delete from the skiplist (or the B+tree) */
+                score = zsetDictScore(zobj->encoding,de);
+                // 在 zsl 或者 B+ 树中删除
+                if (zobj->encoding == REDIS_ENCODING_SKIPLIST)
+                    redisAssertWithInfo(c,c->argv[j],zslDelete(zs->zsl,score,c->argv[j]));
+                else
+                    redisAssertWithInfo(c,c->argv[j],zbtDelete(zs->zbt,score,c->argv[j]));
 
                 /* Delete from the hash table */
                 // 在字典删除
@@ -1133,15 +3249,25 @@ void zremrangebyscoreCommand(redisClient *c) {
 
     if ((zobj = lookupKeyWriteOrReply(c,key,shared.czero)) == NULL ||
         checkType(c,zobj,REDIS_ZSET)) return;
+    zobj = dbUnshareZsetValue(c->db,key,zobj);
 
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         zobj->ptr = zzlDeleteRangeByScore(zobj->ptr,range,&deleted);
         if (zzlLength(zobj->ptr) == 0) dbDelete(c->db,key);
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblocks *zb = zobj->ptr;
+        deleted = zblkDeleteRangeByScore(zb,range);
+        if (zb->length == 0) dbDelete(c->db,key);
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         deleted = zslDeleteRangeByScore(zs->zsl,range,zs->dict);
         if (htNeedsResize(zs->dict)) dictResize(zs->dict);
         if (dictSize(zs->dict) == 0) dbDelete(c->db,key);
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        deleted = zbtDeleteRangeByScore(zs->zbt,range,zs->dict);
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        if (dictSize(zs->dict) == 0) dbDelete(c->db,key);
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1178,11 +3304,18 @@ void zremrangebyrankCommand(redisClient *c) {
         return;
     }
     if (end >= llen) end = llen-1;
+    zobj = dbUnshareZsetValue(c->db,key,zobj);
 
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         /* Correct for 1-based rank. */
         zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
         if (zzlLength(zobj->ptr) == 0) dbDelete(c->db,key);
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblocks *zb = zobj->ptr;
+
+        /* Correct for 1-based rank. */
+        deleted = zblkDeleteRangeByRank(zb,start+1,end+1);
+        if (zb->length == 0) dbDelete(c->db,key);
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
 
@@ -1190,6 +3323,13 @@ void zremrangebyrankCommand(redisClient *c) {
         deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
         if (htNeedsResize(zs->dict)) dictResize(zs->dict);
         if (dictSize(zs->dict) == 0) dbDelete(c->db,key);
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+
+        /* Correct for 1-based rank. */
+        deleted = zbtDeleteRangeByRank(zs->zbt,start+1,end+1,zs->dict);
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        if (dictSize(zs->dict) == 0) dbDelete(c->db,key);
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1229,6 +3369,14 @@ typedef struct {
                 zset *zs;
                 zskiplistNode *node;
             } sl;
+            struct {
+                zset *zs;
+                zbtreeIter it;
+            } bt;
+            struct {
+                zblocks *zb;
+                zblkIter it;
+            } blk;
         } zset;
     } iter;
 } zsetopsrc;
@@ -1286,6 +3434,12 @@ void zuiInitIterator(zsetopsrc *op) {
         } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
             it->sl.zs = op->subject->ptr;
             it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            it->bt.zs = op->subject->ptr;
+            zbtFirst(it->bt.zs->zbt,&it->bt.it);
+        } else if (op->encoding == REDIS_ENCODING_BLOCKS) {
+            it->blk.zb = op->subject->ptr;
+            zblkFirst(it->blk.zb,&it->blk.it);
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -1309,9 +3463,11 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == REDIS_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == REDIS_ENCODING_ZIPLIST) {
+        if (op->encoding == REDIS_ENCODING_ZIPLIST ||
+            op->encoding == REDIS_ENCODING_BLOCKS) {
             REDIS_NOTUSED(it); /* skip */
-        } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
+        } else if (op->encoding == REDIS_ENCODING_SKIPLIST ||
+                   op->encoding == REDIS_ENCODING_BTREE) {
             REDIS_NOTUSED(it); /* skip */
         } else {
             redisPanic("Unknown sorted set encoding");
@@ -1340,6 +3496,10 @@ int zuiLength(zsetopsrc *op) {
             return zzlLength(it->zl.zl);
         } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
             return it->sl.zs->zsl->length;
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            return it->bt.zs->zbt->length;
+        } else if (op->encoding == REDIS_ENCODING_BLOCKS) {
+            return it->blk.zb->length;
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -1402,6 +3562,22 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->sl.node = it->sl.node->level[0].forward;
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            if (it->bt.it.leaf == NULL)
+                return 0;
+            val->ele = zbtIterObj(&it->bt.it);
+            val->score = zbtIterScore(&it->bt.it);
+
+            /* Move to next element. */
+            zbtNext(&it->bt.it);
+        } else if (op->encoding == REDIS_ENCODING_BLOCKS) {
+            if (it->blk.it.eptr == NULL)
+                return 0;
+            redisAssert(ziplistGet(it->blk.it.eptr,&val->estr,&val->elen,&val->ell));
+            val->score = zzlGetScore(it->blk.it.sptr);
+
+            /* Move to next element. */
+            zblkNext(&it->blk.it);
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -1419,7 +3595,7 @@ int zuiLongLongFromValue(zsetopval *val) {
             if (val->ele->encoding == REDIS_ENCODING_INT) {
                 val->ell = (long)val->ele->ptr;
                 val->flags |= OPVAL_VALID_LL;
-            } else if (val->ele->encoding == REDIS_ENCODING_RAW) {
+            } else if (sdsEncodedObject(val->ele)) {
                 if (string2ll(val->ele->ptr,sdslen(val->ele->ptr),&val->ell))
                     val->flags |= OPVAL_VALID_LL;
             } else {
@@ -1454,7 +3630,7 @@ int zuiBufferFromValue(zsetopval *val) {
             if (val->ele->encoding == REDIS_ENCODING_INT) {
                 val->elen = ll2string((char*)val->_buf,sizeof(val->_buf),(long)val->ele->ptr);
                 val->estr = val->_buf;
-            } else if (val->ele->encoding == REDIS_ENCODING_RAW) {
+            } else if (sdsEncodedObject(val->ele)) {
                 val->elen = sdslen(val->ele->ptr);
                 val->estr = val->ele->ptr;
             } else {
@@ -1506,46 +3682,518 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
-        } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
+        } else if (op->encoding == REDIS_ENCODING_BLOCKS) {
+            zblkIter bi;
+            return zblkFind(it->blk.zb,val->ele,score,&bi);
+        } else if (op->encoding == REDIS_ENCODING_SKIPLIST ||
+                   op->encoding == REDIS_ENCODING_BTREE) {
+            zset *zs = (op->encoding == REDIS_ENCODING_SKIPLIST) ?
+                        it->sl.zs : it->bt.zs;
             dictEntry *de;
-            if ((de = dictFind(it->sl.zs->dict,val->ele)) != NULL) {
-                *score = *(double*)dictGetVal(de);
+            if ((de = dictFind(zs->dict,val->ele)) != NULL) {
+                *score = zsetDictScore(op->encoding,de);
                 return 1;
             } else {
-                return 0;
+                return 0;
+            }
+        } else {
+            redisPanic("Unknown sorted set encoding");
+        }
+    } else {
+        redisPanic("Unsupported type");
+    }
+}
+
+int zuiCompareByCardinality(const void *s1, const void *s2) {
+    return zuiLength((zsetopsrc*)s1) - zuiLength((zsetopsrc*)s2);
+}
+
+#define REDIS_AGGR_SUM 1
+#define REDIS_AGGR_MIN 2
+#define REDIS_AGGR_MAX 3
+
+inline static void zunionInterAggregate(double *target, double val, int aggregate) {
+    if (aggregate == REDIS_AGGR_SUM) {
+        *target = *target + val;
+        /* The result of adding two doubles is NaN when one variable
+         * is +inf and the other is -inf. When these numbers are added,
+         * we maintain the convention of the result being 0.0. */
+        if (isnan(*target)) *target = 0.0;
+    } else if (aggregate == REDIS_AGGR_MIN) {
+        *target = val < *target ? val : *target;
+    } else if (aggregate == REDIS_AGGR_MAX) {
+        *target = val > *target ? val : *target;
+    } else {
+        /* safety net */
+        redisPanic("Unknown ZUNION/INTER aggregate type");
+    }
+}
+
+/* ZUNIONSTORE and ZINTERSTORE accumulate the result in a scratch table keyed
+ * by the member bytes, so that no object is created while the inputs are
+ * scanned. The members are copied, as sds strings, in a chunked arena and
+ * the table uses open addressing with linear probing, so there is no
+ * allocation per element either. The destination sorted set is built at the
+ * end, in a single pass over the members sorted by score. */
+
+// arena 每个内存块的大小
+#define ZACC_ARENA_CHUNK (64*1024)
+// 累加表的最小槽数量
+#define ZACC_MIN_SIZE 64
+
+typedef struct zaccEntry {
+    sds ele;            // 成员，保存在 arena 中，为 NULL 表示空槽
+    unsigned int hash;  // 成员的哈希值
+    int hits;           // 包含这个成员的输入数量（交集运算使用）
+    double score;       // 聚合后的分值
+} zaccEntry;
+
+typedef struct zaccChunk {
+    struct zaccChunk *next;
+    size_t used, size;
+    char buf[];
+} zaccChunk;
+
+typedef struct zacc {
+    zaccEntry *table;       // 槽数组
+    unsigned long size;     // 槽数量，总是 2 的幂
+    unsigned long used;     // 已使用的槽数量
+    zaccChunk *arena;       // 保存成员的内存块链表，第一个块为当前块
+    int part, parts;        // 表负责的分区，以及分区的数量
+} zacc;
+
+/* Initialize the table, 'hint' is the expected number of members. The
+ * table only accumulates the members of partition 'part' out of 'parts'
+ * (see zaccOwns()), the serial code uses a single partition. */
+// 初始化累加表，hint 为预计的成员数量
+static void zaccInit(zacc *acc, unsigned long hint, int part, int parts) {
+    unsigned long size = ZACC_MIN_SIZE;
+
+    /* Keep the load factor under 1/2. */
+    while (size < hint*2) size *= 2;
+    acc->table = zcalloc(sizeof(zaccEntry)*size);
+    acc->size = size;
+    acc->used = 0;
+    acc->arena = NULL;
+    acc->part = part;
+    acc->parts = parts;
+}
+
+/* Return the hash of the member stored in 'val'. */
+// 计算成员的哈希值
+static unsigned int zaccHash(zsetopval *val) {
+    zuiBufferFromValue(val);
+    return dictGenHashFunction(val->estr,val->elen);
+}
+
+/* Return true if the member with the given hash belongs to the partition
+ * of the table. The partition is selected with the high bits of the hash,
+ * as the low bits select the slot. */
+// 检查成员是否属于累加表负责的分区
+#define zaccOwns(acc,hash) \
+    ((acc)->parts == 1 || \
+     (int)(((unsigned long long)(hash)*(acc)->parts) >> 32) == (acc)->part)
+
+// 释放累加表和 arena
+static void zaccRelease(zacc *acc) {
+    zaccChunk *chunk = acc->arena, *next;
+
+    while (chunk) {
+        next = chunk->next;
+        zfree(chunk);
+        chunk = next;
+    }
+    zfree(acc->table);
+}
+
+/* Copy 'len' bytes at 'p' into the arena as an sds string, so that the
+ * member can be passed to sdslen() and used as a dictionary lookup key. */
+// 将成员复制到 arena 中，并返回一个 sds
+static sds zaccArenaCopy(zacc *acc, unsigned char *p, size_t len) {
+    struct sdshdr *sh;
+    /* Keep the headers aligned. */
+    size_t need = (sizeof(struct sdshdr)+len+1+7) & ~(size_t)7;
+    zaccChunk *chunk = acc->arena;
+
+    if (chunk == NULL || chunk->size - chunk->used < need) {
+        size_t size = need > ZACC_ARENA_CHUNK ? need : ZACC_ARENA_CHUNK;
+
+        chunk = zmalloc(sizeof(*chunk)+size);
+        chunk->next = acc->arena;
+        chunk->used = 0;
+        chunk->size = size;
+        acc->arena = chunk;
+    }
+    sh = (struct sdshdr*)(chunk->buf+chunk->used);
+    chunk->used += need;
+    sh->len = len;
+    sh->free = 0;
+    memcpy(sh->buf,p,len);
+    sh->buf[len] = '\0';
+    return sh->buf;
+}
+
+/* Return the slot of the member 'p' of length 'len': the slot holding it,
+ * or the empty slot where it should be added. */
+// 返回保存成员的槽，或者成员应该被添加到的空槽
+static zaccEntry *zaccSlot(zacc *acc, unsigned char *p, size_t len,
+                           unsigned int hash)
+{
+    unsigned long mask = acc->size-1, idx = hash & mask;
+    zaccEntry *e;
+
+    while (1) {
+        e = acc->table+idx;
+        if (e->ele == NULL ||
+            (e->hash == hash && sdslen(e->ele) == len &&
+             memcmp(e->ele,p,len) == 0)) return e;
+        idx = (idx+1) & mask;
+    }
+}
+
+// 将累加表的槽数量扩大一倍
+static void zaccGrow(zacc *acc) {
+    zaccEntry *old = acc->table, *e;
+    unsigned long oldsize = acc->size, j;
+
+    acc->size *= 2;
+    acc->table = zcalloc(sizeof(zaccEntry)*acc->size);
+    for (j = 0; j < oldsize; j++) {
+        unsigned long idx;
+
+        if (old[j].ele == NULL) continue;
+        idx = old[j].hash & (acc->size-1);
+        while (acc->table[idx].ele != NULL) idx = (idx+1) & (acc->size-1);
+        e = acc->table+idx;
+        *e = old[j];
+    }
+    zfree(old);
+}
+
+/* Find the member stored in 'val', whose hash was computed by zaccHash(),
+ * returning NULL if it is not in the table. */
+// 在累加表中查找成员
+static zaccEntry *zaccFind(zacc *acc, zsetopval *val, unsigned int hash) {
+    zaccEntry *e = zaccSlot(acc,val->estr,val->elen,hash);
+
+    return e->ele ? e : NULL;
+}
+
+/* Find the member stored in 'val', whose hash was computed by zaccHash(),
+ * adding it to the table when missing. *created is set to 1 when the
+ * member is new. */
+// 在累加表中查找成员，成员不存在时添加它
+static zaccEntry *zaccAdd(zacc *acc, zsetopval *val, unsigned int hash,
+                          int *created)
+{
+    zaccEntry *e = zaccSlot(acc,val->estr,val->elen,hash);
+
+    if (e->ele != NULL) {
+        *created = 0;
+        return e;
+    }
+
+    if ((acc->used+1)*2 > acc->size) {
+        zaccGrow(acc);
+        e = zaccSlot(acc,val->estr,val->elen,hash);
+    }
+    e->ele = zaccArenaCopy(acc,val->estr,val->elen);
+    e->hash = hash;
+    e->hits = 0;
+    e->score = 0;
+    acc->used++;
+    *created = 1;
+    return e;
+}
+
+/* Intersect the members still alive in the table (the ones with 'hits'
+ * equal to 'round') with the input 'op'. Small inputs, and inputs without a
+ * dictionary, are scanned once looking up every element in the table, while
+ * for the others the live members are probed into the input dictionary.
+ * Probing is not allowed from the worker threads ('canprobe' is 0), since
+ * dictFind() may perform a rehashing step. Returns the number of members
+ * still alive. */
+// 将累加表中仍然存活的成员和输入 op 进行交集运算，返回仍然存活的成员数量
+static unsigned long zaccIntersect(zacc *acc, zsetopsrc *op, int round,
+                                   unsigned long live, int aggregate,
+                                   int canprobe)
+{
+    unsigned long alive = 0, j;
+    dict *d = NULL;
+    zsetopval zval;
+    zaccEntry *e;
+    double value;
+
+    if (op->type == REDIS_SET && op->encoding == REDIS_ENCODING_HT)
+        d = op->iter.set.ht.dict;
+    else if (op->type == REDIS_ZSET && op->encoding == REDIS_ENCODING_SKIPLIST)
+        d = op->iter.zset.sl.zs->dict;
+    else if (op->type == REDIS_ZSET && op->encoding == REDIS_ENCODING_BTREE)
+        d = op->iter.zset.bt.zs->dict;
+
+    if (canprobe && d != NULL && live < (unsigned long)zuiLength(op)) {
+        for (j = 0; j < acc->size; j++) {
+            robj key;
+            dictEntry *de;
+
+            e = acc->table+j;
+            if (e->ele == NULL || e->hits != round) continue;
+            initStaticStringObject(key,e->ele);
+            if ((de = dictFind(d,&key)) == NULL) continue;
+            value = (op->type == REDIS_SET) ? 1.0 :
+                    zsetDictScore(op->encoding,de);
+            zunionInterAggregate(&e->score,value*op->weight,aggregate);
+            e->hits++;
+            alive++;
+        }
+    } else {
+        memset(&zval,0,sizeof(zval));
+        while (zuiNext(op,&zval)) {
+            unsigned int hash = zaccHash(&zval);
+
+            if (!zaccOwns(acc,hash) ||
+                (e = zaccFind(acc,&zval,hash)) == NULL ||
+                e->hits != round) continue;
+            zunionInterAggregate(&e->score,zval.score*op->weight,aggregate);
+            e->hits++;
+            alive++;
+        }
+    }
+    return alive;
+}
+
+/* Accumulate in the table the intersection of the 'setnum' inputs, sorted
+ * from the smallest to the largest. The members present in every input are
+ * the ones with 'hits' equal to 'setnum'. */
+// 计算所有输入的交集，结果保存在累加表中
+static void zaccInter(zacc *acc, zsetopsrc *src, int setnum, int aggregate,
+                      int canprobe)
+{
+    unsigned long live = 0;
+    zsetopval zval;
+    zaccEntry *e;
+    int j, created;
+
+    /* Load the smallest input in the table, then intersect it with the
+     * other inputs, from the smallest to the largest. */
+    memset(&zval,0,sizeof(zval));
+    while (zuiNext(&src[0],&zval)) {
+        unsigned int hash = zaccHash(&zval);
+        double score = src[0].weight * zval.score;
+
+        if (!zaccOwns(acc,hash)) continue;
+        if (isnan(score)) score = 0;
+        e = zaccAdd(acc,&zval,hash,&created);
+        e->score = score;
+        e->hits = 1;
+        live++;
+    }
+    for (j = 1; j < setnum && live; j++)
+        live = zaccIntersect(acc,&src[j],j,live,aggregate,canprobe);
+}
+
+/* Accumulate in the table the union of the 'setnum' inputs. */
+// 计算所有输入的并集，结果保存在累加表中
+static void zaccUnion(zacc *acc, zsetopsrc *src, int setnum, int aggregate) {
+    zsetopval zval;
+    zaccEntry *e;
+    int i, created;
+
+    memset(&zval,0,sizeof(zval));
+    for (i = 0; i < setnum; i++) {
+        if (zuiLength(&src[i]) == 0)
+            continue;
+
+        while (zuiNext(&src[i],&zval)) {
+            unsigned int hash = zaccHash(&zval);
+            double value = src[i].weight * zval.score;
+
+            if (!zaccOwns(acc,hash)) continue;
+            e = zaccAdd(acc,&zval,hash,&created);
+            if (created) {
+                /* Initialize score */
+                if (isnan(value)) value = 0;
+                e->score = value;
+                e->hits = 1;
+            } else {
+                zunionInterAggregate(&e->score,value,aggregate);
+            }
+        }
+    }
+}
+
+// 按分值排序，分值相同时按成员排序，和有序集合的顺序一致
+static int zaccCompareByScore(const void *a, const void *b) {
+    const zaccEntry *ea = *(zaccEntry**)a, *eb = *(zaccEntry**)b;
+
+    if (ea->score < eb->score) return -1;
+    if (ea->score > eb->score) return 1;
+    return sdscmp(ea->ele,eb->ele);
+}
+
+/* Build the destination sorted set with the members of the 'numacc' tables
+ * (one per partition) that have at least 'minhits' hits, selecting the
+ * encoding up front. Returns NULL when there are no such members. */
+// 使用累加表中的成员创建有序集合，没有成员时返回 NULL
+static robj *zaccCreateZset(zacc *accs, int numacc, int minhits) {
+    zaccEntry **ents;
+    unsigned long count = 0, used = 0, j;
+    size_t maxelelen = 0;
+    robj *zobj;
+    int k, encoding;
+
+    for (k = 0; k < numacc; k++) used += accs[k].used;
+    ents = zmalloc(sizeof(zaccEntry*)*(used ? used : 1));
+    for (k = 0; k < numacc; k++) {
+        for (j = 0; j < accs[k].size; j++) {
+            zaccEntry *e = accs[k].table+j;
+
+            if (e->ele == NULL || e->hits < minhits) continue;
+            ents[count++] = e;
+            if (sdslen(e->ele) > maxelelen) maxelelen = sdslen(e->ele);
+        }
+    }
+    if (count == 0) {
+        zfree(ents);
+        return NULL;
+    }
+    qsort(ents,count,sizeof(zaccEntry*),zaccCompareByScore);
+
+    encoding = zsetEncodingForSize(count,maxelelen);
+    if (encoding == REDIS_ENCODING_ZIPLIST) {
+        zobj = createZsetZiplistObject();
+        for (j = 0; j < count; j++) {
+            robj ele;
+
+            initStaticStringObject(ele,ents[j]->ele);
+            zobj->ptr = zzlInsertAt(zobj->ptr,NULL,&ele,ents[j]->score);
+        }
+    } else if (encoding == REDIS_ENCODING_BLOCKS) {
+        zobj = createZsetZiplistObject();
+        zsetConvert(zobj,REDIS_ENCODING_BLOCKS);
+        for (j = 0; j < count; j++) {
+            robj ele;
+
+            initStaticStringObject(ele,ents[j]->ele);
+            zblkAppend(zobj->ptr,&ele,ents[j]->score);
+        }
+    } else {
+        zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *znode;
+        unsigned int rank[ZSKIPLIST_MAXLEVEL];
+        zset *zs;
+
+        zobj = createZsetObject();
+        if (encoding == REDIS_ENCODING_BTREE)
+            zsetConvert(zobj,REDIS_ENCODING_BTREE);
+        zs = zobj->ptr;
+        dictExpand(zs->dict,count);
+        if (zobj->encoding == REDIS_ENCODING_SKIPLIST)
+            zslTailPath(zs->zsl,update,rank);
+
+        /* The members are sorted, so they are always appended at the tail
+         * of the skiplist or B+tree. */
+        for (j = 0; j < count; j++) {
+            robj *ele = createStringObject(ents[j]->ele,sdslen(ents[j]->ele));
+            double score = ents[j]->score;
+
+            if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+                znode = zslAppend(zs->zsl,update,rank,score,ele);
+                dictAdd(zs->dict,ele,&znode->score);
+            } else {
+                dictEntry *de;
+
+                zbtInsert(zs->zbt,score,ele);
+                de = dictAddRaw(zs->dict,ele);
+                dictSetDoubleVal(de,score);
             }
-        } else {
-            redisPanic("Unknown sorted set encoding");
+            incrRefCount(ele); /* Added to dictionary. */
         }
-    } else {
-        redisPanic("Unsupported type");
     }
+    zfree(ents);
+    return zobj;
 }
 
-int zuiCompareByCardinality(const void *s1, const void *s2) {
-    return zuiLength((zsetopsrc*)s1) - zuiLength((zsetopsrc*)s2);
+/* When the inputs of ZUNIONSTORE / ZINTERSTORE hold more than
+ * zset_parallel_threshold elements in total, the members are partitioned by
+ * hash across zset_parallel_threads threads: every thread scans the inputs
+ * with its own iterators, accumulating only the members of its partition
+ * in its own table. The partitions are disjoint, so merging the partials
+ * just means collecting the members of all the tables.
+ *
+ * The main thread waits for the workers, so no other command can modify
+ * the inputs while they are read. */
+
+// 工作线程的任务
+typedef struct zsetopJob {
+    zsetopsrc *src;     // 线程自己的输入迭代器
+    int setnum;         // 输入数量
+    int op;             // REDIS_OP_UNION 或者 REDIS_OP_INTER
+    int aggregate;      // 聚合方式
+    zacc acc;           // 线程负责的分区的累加表
+} zsetopJob;
+
+// 工作线程的入口
+static void *zunionInterWorker(void *arg) {
+    zsetopJob *job = arg;
+
+    if (job->op == REDIS_OP_INTER)
+        zaccInter(&job->acc,job->src,job->setnum,job->aggregate,0);
+    else
+        zaccUnion(&job->acc,job->src,job->setnum,job->aggregate);
+    return NULL;
 }
 
-#define REDIS_AGGR_SUM 1
-#define REDIS_AGGR_MIN 2
-#define REDIS_AGGR_MAX 3
-#define zunionInterDictValue(_e) (dictGetVal(_e) == NULL ? 1.0 : *(double*)dictGetVal(_e))
+/* Compute the result with 'threads' workers. The sources must be sorted by
+ * cardinality and 'hint' is the expected size of the result. */
+// 使用多个线程计算并集或交集，返回结果有序集合，结果为空时返回 NULL
+static robj *zunionInterParallel(zsetopsrc *src, int setnum, int op,
+                                 int aggregate, int threads,
+                                 unsigned long hint)
+{
+    zsetopJob *jobs = zmalloc(sizeof(zsetopJob)*threads);
+    pthread_t *tids = zmalloc(sizeof(pthread_t)*threads);
+    int *started = zcalloc(sizeof(int)*threads);
+    zacc *accs = zmalloc(sizeof(zacc)*threads);
+    robj *dstobj;
+    int k, i;
+
+    for (k = 0; k < threads; k++) {
+        jobs[k].src = zmalloc(sizeof(zsetopsrc)*setnum);
+        memcpy(jobs[k].src,src,sizeof(zsetopsrc)*setnum);
+        for (i = 0; i < setnum; i++) zuiInitIterator(&jobs[k].src[i]);
+        jobs[k].setnum = setnum;
+        jobs[k].op = op;
+        jobs[k].aggregate = aggregate;
+        zaccInit(&jobs[k].acc,hint/threads,k,threads);
+    }
 
-inline static void zunionInterAggregate(double *target, double val, int aggregate) {
-    if (aggregate == REDIS_AGGR_SUM) {
-        *target = *target + val;
-        /* The result of adding two doubles is NaN when one variable
-         * is +inf and the other is -inf. When these numbers are added,
-         * we maintain the convention of the result being 0.0. */
-        if (isnan(*target)) *target = 0.0;
-    } else if (aggregate == REDIS_AGGR_MIN) {
-        *target = val < *target ? val : *target;
-    } else if (aggregate == REDIS_AGGR_MAX) {
-        *target = val > *target ? val : *target;
-    } else {
-        /* safety net */
-        redisPanic("Unknown ZUNION/INTER aggregate type");
+    /* The first partition is computed by the main thread itself, as well
+     * as the partitions whose thread could not be created. */
+    for (k = 1; k < threads; k++)
+        started[k] = pthread_create(&tids[k],NULL,zunionInterWorker,
+                                    &jobs[k]) == 0;
+    zunionInterWorker(&jobs[0]);
+    for (k = 1; k < threads; k++) {
+        if (started[k])
+            pthread_join(tids[k],NULL);
+        else
+            zunionInterWorker(&jobs[k]);
+    }
+
+    /* Build the destination with the members of all the partitions. */
+    for (k = 0; k < threads; k++) {
+        for (i = 0; i < setnum; i++) zuiClearIterator(&jobs[k].src[i]);
+        zfree(jobs[k].src);
+        accs[k] = jobs[k].acc;
     }
+    dstobj = zaccCreateZset(accs,threads,op == REDIS_OP_INTER ? setnum : 1);
+    for (k = 0; k < threads; k++) zaccRelease(&accs[k]);
+
+    zfree(accs);
+    zfree(started);
+    zfree(tids);
+    zfree(jobs);
+    return dstobj;
 }
 
 void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
@@ -1553,12 +4201,9 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     long setnum;
     int aggregate = REDIS_AGGR_SUM;
     zsetopsrc *src;
-    zsetopval zval;
-    robj *tmp;
-    unsigned int maxelelen = 0;
+    zacc acc;
     robj *dstobj;
-    zset *dstzset;
-    zskiplistNode *znode;
+    unsigned long total = 0, hint;
     int touched = 0;
 
     /* expect setnum input keys to be given */
@@ -1582,7 +4227,8 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     for (i = 0, j = 3; i < setnum; i++, j++) {
         robj *obj = lookupKeyWrite(c->db,c->argv[j]);
         if (obj != NULL) {
-            if (obj->type != REDIS_ZSET && obj->type != REDIS_SET) {
+            if (objectType(obj) != REDIS_ZSET &&
+                objectType(obj) != REDIS_SET) {
                 zfree(src);
                 addReply(c,shared.wrongtypeerr);
                 return;
@@ -1643,92 +4289,37 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
 
-    dstobj = createZsetObject();
-    dstzset = dstobj->ptr;
-    memset(&zval, 0, sizeof(zval));
-
-    if (op == REDIS_OP_INTER) {
-        /* Skip everything if the smallest input is empty. */
-        if (zuiLength(&src[0]) > 0) {
-            /* Precondition: as src[0] is non-empty and the inputs are ordered
-             * by size, all src[i > 0] are non-empty too. */
-            while (zuiNext(&src[0],&zval)) {
-                double score, value;
-
-                score = src[0].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                for (j = 1; j < setnum; j++) {
-                    /* It is not safe to access the zset we are
-                     * iterating, so explicitly check for equal object. */
-                    if (src[j].subject == src[0].subject) {
-                        value = zval.score*src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else {
-                        break;
-                    }
-                }
-
-                /* Only continue when present in every input. */
-                if (j == setnum) {
-                    tmp = zuiObjectFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    incrRefCount(tmp); /* added to skiplist */
-                    dictAdd(dstzset->dict,tmp,&znode->score);
-                    incrRefCount(tmp); /* added to dictionary */
-
-                    if (tmp->encoding == REDIS_ENCODING_RAW)
-                        if (sdslen(tmp->ptr) > maxelelen)
-                            maxelelen = sdslen(tmp->ptr);
-                }
-            }
-        }
-    } else if (op == REDIS_OP_UNION) {
-        for (i = 0; i < setnum; i++) {
-            if (zuiLength(&src[i]) == 0)
-                continue;
-
-            while (zuiNext(&src[i],&zval)) {
-                double score, value;
-
-                /* Skip key when already processed */
-                if (dictFind(dstzset->dict,zuiObjectFromValue(&zval)) != NULL)
-                    continue;
-
-                /* Initialize score */
-                score = src[i].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                /* Because the inputs are sorted by size, it's only possible
-                 * for sets at larger indices to hold this element. */
-                for (j = (i+1); j < setnum; j++) {
-                    /* It is not safe to access the zset we are
-                     * iterating, so explicitly check for equal object. */
-                    if(src[j].subject == src[i].subject) {
-                        value = zval.score*src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    }
-                }
+    /* Count the elements of all the inputs, to select between the serial
+     * and the parallel execution. */
+    for (i = 0; i < setnum; i++) total += zuiLength(&src[i]);
 
-                tmp = zuiObjectFromValue(&zval);
-                znode = zslInsert(dstzset->zsl,score,tmp);
-                incrRefCount(zval.ele); /* added to skiplist */
-                dictAdd(dstzset->dict,tmp,&znode->score);
-                incrRefCount(zval.ele); /* added to dictionary */
+    if (op != REDIS_OP_INTER && op != REDIS_OP_UNION)
+        redisPanic("Unknown operator");
 
-                if (tmp->encoding == REDIS_ENCODING_RAW)
-                    if (sdslen(tmp->ptr) > maxelelen)
-                        maxelelen = sdslen(tmp->ptr);
-            }
-        }
+    /* Skip everything if the smallest input of an intersection is empty.
+     * The union result is at least as big as the largest input, that is
+     * the best guess for its size, while the intersection is at most as
+     * big as the smallest one. */
+    hint = (op == REDIS_OP_INTER) ? zuiLength(&src[0]) :
+                                    zuiLength(&src[setnum-1]);
+    if (op == REDIS_OP_INTER && hint == 0) {
+        dstobj = NULL;
+    } else if (server.zset_parallel_threshold &&
+               server.zset_parallel_threads > 1 &&
+               total > server.zset_parallel_threshold)
+    {
+        dstobj = zunionInterParallel(src,setnum,op,aggregate,
+                                     server.zset_parallel_threads,hint);
     } else {
-        redisPanic("Unknown operator");
+        zaccInit(&acc,hint,0,1);
+        if (op == REDIS_OP_INTER)
+            zaccInter(&acc,src,setnum,aggregate,1);
+        else
+            zaccUnion(&acc,src,setnum,aggregate);
+
+        /* Only keep members present in every input for intersections. */
+        dstobj = zaccCreateZset(&acc,1,op == REDIS_OP_INTER ? setnum : 1);
+        zaccRelease(&acc);
     }
 
     for (i = 0; i < setnum; i++)
@@ -1739,18 +4330,13 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
         touched = 1;
         server.dirty++;
     }
-    if (dstzset->zsl->length) {
-        /* Convert to ziplist when in limits. */
-        if (dstzset->zsl->length <= server.zset_max_ziplist_entries &&
-            maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(dstobj,REDIS_ENCODING_ZIPLIST);
-
+    if (dstobj != NULL) {
+        /* The encoding was already selected by zaccCreateZset(). */
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         if (!touched) signalModifiedKey(c->db,dstkey);
         server.dirty++;
     } else {
-        decrRefCount(dstobj);
         addReply(c,shared.czero);
     }
     zfree(src);
@@ -1764,6 +4350,170 @@ void zinterstoreCommand(redisClient *c) {
     zunionInterGenericCommand(c,c->argv[1], REDIS_OP_INTER);
 }
 
+/*-----------------------------------------------------------------------------
+ * Streamed range replies
+ *----------------------------------------------------------------------------*/
+
+/* Replies of ZRANGE and ZRANGEBYSCORE with at least zset_stream_threshold
+ * elements are not generated all at once: the command itself emits the
+ * first zset_stream_chunk elements, and every next chunk is emitted by
+ * zrangeStreamContinue() once the output buffer was written to the socket.
+ * While the client is flagged REDIS_ZSTREAM its following commands are not
+ * processed, so that the replies are not interleaved.
+ *
+ * The stream holds a reference to the sorted set object. The commands
+ * modifying a sorted set call dbUnshareZsetValue() first, which replaces a
+ * shared value with a copy, so the reply is a consistent snapshot of the
+ * sorted set as it was when the command was called. */
+
+/* Only the skiplist, B+tree and block directory encodings are streamed:
+ * they can seek by rank, so the length of the reply is known in advance.
+ * Clients without a socket, MULTI/EXEC and the master link always get the
+ * reply in a single call. */
+// 检查是否可以分批生成对有序集合 zobj 的范围回复
+static int zrangeStreamAllowed(redisClient *c, robj *zobj) {
+    return server.zset_stream_threshold &&
+           zobj->encoding != REDIS_ENCODING_ZIPLIST &&
+           zsetLength(zobj) >= server.zset_stream_threshold &&
+           c->fd != -1 &&
+           !(c->flags & (REDIS_MULTI|REDIS_MASTER));
+}
+
+// 将迭代器指向的接下来 count 个元素添加到回复中
+static void zrangeStreamEmit(redisClient *c, zrangeStream *zr, unsigned long count) {
+    robj *zobj = zr->zobj;
+
+    zr->remaining -= count;
+    if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        zskiplistNode *ln = zr->it.ln;
+
+        while (count--) {
+            redisAssertWithInfo(c,zobj,ln != NULL);
+            addReplyBulk(c,ln->obj);
+            if (zr->withscores)
+                addReplyDouble(c,ln->score);
+            ln = zr->reverse ? ln->backward : ln->level[0].forward;
+        }
+        zr->it.ln = ln;
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtreeIter *it = &zr->it.bt;
+
+        while (count--) {
+            redisAssertWithInfo(c,zobj,it->leaf != NULL);
+            addReplyBulk(c,zbtIterObj(it));
+            if (zr->withscores)
+                addReplyDouble(c,zbtIterScore(it));
+            if (zr->reverse) zbtPrev(it); else zbtNext(it);
+        }
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblkIter *it = &zr->it.blk;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        while (count--) {
+            redisAssertWithInfo(c,zobj,it->eptr != NULL);
+            redisAssertWithInfo(c,zobj,ziplistGet(it->eptr,&vstr,&vlen,&vlong));
+            if (vstr == NULL)
+                addReplyBulkLongLong(c,vlong);
+            else
+                addReplyBulkCBuffer(c,vstr,vlen);
+            if (zr->withscores)
+                addReplyDouble(c,zzlGetScore(it->sptr));
+            if (zr->reverse) zblkPrev(it); else zblkNext(it);
+        }
+    } else {
+        redisPanic("Unknown sorted set encoding");
+    }
+}
+
+// 释放客户端未完成的范围回复
+void zrangeStreamRelease(redisClient *c) {
+    if (c->zstream == NULL) return;
+    decrRefCount(c->zstream->zobj);
+    zfree(c->zstream);
+    c->zstream = NULL;
+    c->flags &= ~REDIS_ZSTREAM;
+}
+
+/* Emit the next chunk of the range reply of the client. Returns 1 when the
+ * reply is complete, 0 if more chunks are pending. */
+// 生成范围回复的下一批元素，回复已经完成时返回 1 ，否则返回 0
+int zrangeStreamContinue(redisClient *c) {
+    zrangeStream *zr = c->zstream;
+    unsigned long chunk = server.zset_stream_chunk ? server.zset_stream_chunk : 1;
+
+    if (zr == NULL) return 1;
+    zrangeStreamEmit(c,zr,zr->remaining < chunk ? zr->remaining : chunk);
+    if (zr->remaining) return 0;
+    zrangeStreamRelease(c);
+    return 1;
+}
+
+/* Reply with the 'count' elements starting at the 0-based 'rank', going
+ * backward if 'reverse' is true. */
+// 开始分批回复从排位 rank 开始的 count 个元素
+static void zrangeStreamStart(redisClient *c, robj *zobj, unsigned long rank,
+                              unsigned long count, int reverse, int withscores)
+{
+    zrangeStream *zr = zmalloc(sizeof(*zr));
+
+    if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        zr->it.ln = zslGetElementByRank(((zset*)zobj->ptr)->zsl,rank+1);
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtGetElementByRank(((zset*)zobj->ptr)->zbt,rank+1,&zr->it.bt);
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblkGetElementByRank(zobj->ptr,rank,&zr->it.blk);
+    } else {
+        redisPanic("Unknown sorted set encoding");
+    }
+    zr->zobj = zobj;
+    incrRefCount(zobj);
+    zr->remaining = count;
+    zr->reverse = reverse;
+    zr->withscores = withscores;
+    c->zstream = zr;
+    c->flags |= REDIS_ZSTREAM;
+
+    addReplyMultiBulkLen(c,withscores ? (count*2) : count);
+    zrangeStreamContinue(c);
+}
+
+/* Store in *first and *last the 0-based ranks of the first and the last
+ * element with score in range. Returns 0 when no element is in range. */
+// 计算给定分值范围内第一个和最后一个元素的排位，范围内没有元素时返回 0
+static int zsetRangeToRanks(robj *zobj, zrangespec *range,
+                            unsigned long *first, unsigned long *last)
+{
+    if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        zskiplist *zsl = ((zset*)zobj->ptr)->zsl;
+        zskiplistNode *ln;
+
+        if ((ln = zslFirstInRange(zsl,*range)) == NULL) return 0;
+        *first = zslGetRank(zsl,ln->score,ln->obj)-1;
+        ln = zslLastInRange(zsl,*range);
+        *last = zslGetRank(zsl,ln->score,ln->obj)-1;
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = ((zset*)zobj->ptr)->zbt;
+        zbtreeIter it;
+
+        if (!zbtFirstInRange(zbt,*range,&it)) return 0;
+        *first = zbtGetRank(zbt,zbtIterScore(&it),zbtIterObj(&it))-1;
+        zbtLastInRange(zbt,*range,&it);
+        *last = zbtGetRank(zbt,zbtIterScore(&it),zbtIterObj(&it))-1;
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblkIter it;
+
+        if (!zblkFirstInRange(zobj->ptr,*range,&it)) return 0;
+        *first = zblkGetRank(&it);
+        zblkLastInRange(zobj->ptr,*range,&it);
+        *last = zblkGetRank(&it);
+    } else {
+        redisPanic("Unknown sorted set encoding");
+    }
+    return 1;
+}
+
 void zrangeGenericCommand(redisClient *c, int reverse) {
     robj *key = c->argv[1];
     robj *zobj;
@@ -1801,6 +4551,16 @@ void zrangeGenericCommand(redisClient *c, int reverse) {
     if (end >= llen) end = llen-1;
     rangelen = (end-start)+1;
 
+    /* Long replies are generated in chunks. */
+    // 分批生成过长的回复
+    if (zrangeStreamAllowed(c,zobj) &&
+        (unsigned long)rangelen >= server.zset_stream_threshold)
+    {
+        zrangeStreamStart(c,zobj,reverse ? llen-start-1 : start,rangelen,
+                          reverse,withscores);
+        return;
+    }
+
     /* Return the result in form of a multi-bulk reply */
     addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
 
@@ -1861,6 +4621,46 @@ void zrangeGenericCommand(redisClient *c, int reverse) {
                 addReplyDouble(c,ln->score);
             ln = reverse ? ln->backward : ln->level[0].forward;
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+
+        // 直接按排位定位起始元素，之后沿叶子链表迭代
+        if (reverse)
+            redisAssertWithInfo(c,zobj,zbtGetElementByRank(zs->zbt,llen-start,&it));
+        else
+            redisAssertWithInfo(c,zobj,zbtGetElementByRank(zs->zbt,start+1,&it));
+
+        while(rangelen--) {
+            redisAssertWithInfo(c,zobj,it.leaf != NULL);
+            addReplyBulk(c,zbtIterObj(&it));
+            if (withscores)
+                addReplyDouble(c,zbtIterScore(&it));
+            if (reverse) zbtPrev(&it); else zbtNext(&it);
+        }
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblkIter it;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        // 通过块目录中的元素数量定位起始元素
+        redisAssertWithInfo(c,zobj,zblkGetElementByRank(zobj->ptr,
+            reverse ? llen-start-1 : start,&it));
+
+        while (rangelen--) {
+            redisAssertWithInfo(c,zobj,it.eptr != NULL);
+            redisAssertWithInfo(c,zobj,ziplistGet(it.eptr,&vstr,&vlen,&vlong));
+            if (vstr == NULL)
+                addReplyBulkLongLong(c,vlong);
+            else
+                addReplyBulkCBuffer(c,vstr,vlen);
+
+            if (withscores)
+                addReplyDouble(c,zzlGetScore(it.sptr));
+
+            if (reverse) zblkPrev(&it); else zblkNext(&it);
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1924,6 +4724,25 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
         checkType(c,zobj,REDIS_ZSET)) return;
 
+    /* Long replies are generated in chunks: the ranks of the range are
+     * looked up first, so the length of the reply is known in advance. */
+    // 分批生成过长的回复
+    if (zrangeStreamAllowed(c,zobj) && offset >= 0) {
+        unsigned long first, last, count;
+
+        if (zsetRangeToRanks(zobj,&range,&first,&last) &&
+            (unsigned long)offset <= last-first)
+        {
+            count = last-first+1-offset;
+            if (limit >= 0 && (unsigned long)limit < count) count = limit;
+            if (count >= server.zset_stream_threshold) {
+                zrangeStreamStart(c,zobj,reverse ? last-offset : first+offset,
+                                  count,reverse,withscores);
+                return;
+            }
+        }
+    }
+
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
@@ -2050,6 +4869,137 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        int found;
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            found = zbtLastInRange(zs->zbt,range,&it);
+        } else {
+            found = zbtFirstInRange(zs->zbt,range,&it);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!found) {
+            addReply(c, shared.emptymultibulk);
+            return;
+        }
+
+        /* We don't know in advance how many matching elements there are in the
+         * list, so we push this object that will represent the multi-bulk
+         * length in the output buffer, and will "fix" it later */
+        replylen = addDeferredMultiBulkLength(c);
+
+        /* If there is an offset, just traverse the number of elements without
+         * checking the score because that is done in the next loop. */
+        while (it.leaf && offset--) {
+            if (reverse) {
+                zbtPrev(&it);
+            } else {
+                zbtNext(&it);
+            }
+        }
+
+        while (it.leaf && limit--) {
+            double score = zbtIterScore(&it);
+
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!zslValueGteMin(score,&range)) break;
+            } else {
+                if (!zslValueLteMax(score,&range)) break;
+            }
+
+            rangelen++;
+            addReplyBulk(c,zbtIterObj(&it));
+
+            if (withscores) {
+                addReplyDouble(c,score);
+            }
+
+            /* Move to next node */
+            if (reverse) {
+                zbtPrev(&it);
+            } else {
+                zbtNext(&it);
+            }
+        }
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblocks *zb = zobj->ptr;
+        zblkIter it;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+        double score;
+        int found;
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            found = zblkLastInRange(zb,range,&it);
+        } else {
+            found = zblkFirstInRange(zb,range,&it);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!found) {
+            addReply(c, shared.emptymultibulk);
+            return;
+        }
+
+        /* We don't know in advance how many matching elements there are in the
+         * list, so we push this object that will represent the multi-bulk
+         * length in the output buffer, and will "fix" it later */
+        replylen = addDeferredMultiBulkLength(c);
+
+        /* The offset is skipped with a rank lookup, walking the block
+         * counts instead of the elements. */
+        // 使用排位跳过 offset 个元素
+        if (offset > 0) {
+            unsigned long rank = zblkGetRank(&it);
+
+            if (!reverse)
+                zblkGetElementByRank(zb,rank+offset,&it);
+            else if ((unsigned long)offset <= rank)
+                zblkGetElementByRank(zb,rank-offset,&it);
+            else
+                it.eptr = NULL;
+        } else if (offset < 0) {
+            it.eptr = NULL;
+        }
+
+        while (it.eptr && limit--) {
+            score = zzlGetScore(it.sptr);
+
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!zslValueGteMin(score,&range)) break;
+            } else {
+                if (!zslValueLteMax(score,&range)) break;
+            }
+
+            /* We know the element exists, so ziplistGet should always succeed */
+            redisAssertWithInfo(c,zobj,ziplistGet(it.eptr,&vstr,&vlen,&vlong));
+
+            rangelen++;
+            if (vstr == NULL) {
+                addReplyBulkLongLong(c,vlong);
+            } else {
+                addReplyBulkCBuffer(c,vstr,vlen);
+            }
+
+            if (withscores) {
+                addReplyDouble(c,score);
+            }
+
+            /* Move to next node */
+            if (reverse) {
+                zblkPrev(&it);
+            } else {
+                zblkNext(&it);
+            }
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -2139,6 +5089,28 @@ void zcountCommand(redisClient *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtree *zbt = zs->zbt;
+        zbtreeIter first, last;
+
+        /* The count is the distance between the ranks of the first and
+         * the last element in range. */
+        if (zbtFirstInRange(zbt,range,&first) &&
+            zbtLastInRange(zbt,range,&last))
+        {
+            count = zbtGetRank(zbt,zbtIterScore(&last),zbtIterObj(&last)) -
+                    zbtGetRank(zbt,zbtIterScore(&first),zbtIterObj(&first)) + 1;
+        }
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblkIter first, last;
+
+        /* Same as above, the ranks are computed from the block counts. */
+        if (zblkFirstInRange(zobj->ptr,range,&first) &&
+            zblkLastInRange(zobj->ptr,range,&last))
+        {
+            count = zblkGetRank(&last) - zblkGetRank(&first) + 1;
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -2169,14 +5141,23 @@ void zscoreCommand(redisClient *c) {
             addReplyDouble(c,score);
         else
             addReply(c,shared.nullbulk);
-    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblkIter it;
+
+        if (zblkFind(zobj->ptr,c->argv[2],&score,&it))
+            addReplyDouble(c,score);
+        else
+            addReply(c,shared.nullbulk);
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST ||
+               zobj->encoding == REDIS_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
         dictEntry *de;
 
         c->argv[2] = tryObjectEncoding(c->argv[2]);
         de = dictFind(zs->dict,c->argv[2]);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
+            score = zsetDictScore(zobj->encoding,de);
             addReplyDouble(c,score);
         } else {
             addReply(c,shared.nullbulk);
@@ -2197,7 +5178,7 @@ void zrankGenericCommand(redisClient *c, int reverse) {
         checkType(c,zobj,REDIS_ZSET)) return;
     llen = zsetLength(zobj);
 
-    redisAssertWithInfo(c,ele,ele->encoding == REDIS_ENCODING_RAW);
+    redisAssertWithInfo(c,ele,sdsEncodedObject(ele));
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
@@ -2223,17 +5204,34 @@ void zrankGenericCommand(redisClient *c, int reverse) {
         } else {
             addReply(c,shared.nullbulk);
         }
-    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == REDIS_ENCODING_BLOCKS) {
+        zblkIter it;
+        double score;
+
+        if (zblkFind(zobj->ptr,ele,&score,&it)) {
+            rank = zblkGetRank(&it);
+            if (reverse)
+                addReplyLongLong(c,llen-1-rank);
+            else
+                addReplyLongLong(c,rank);
+        } else {
+            addReply(c,shared.nullbulk);
+        }
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST ||
+               zobj->encoding == REDIS_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
         dictEntry *de;
         double score;
 
         ele = c->argv[2] = tryObjectEncoding(c->argv[2]);
         de = dictFind(zs->dict,ele);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
-            rank = zslGetRank(zsl,score,ele);
+            score = zsetDictScore(zobj->encoding,de);
+            if (zobj->encoding == REDIS_ENCODING_SKIPLIST)
+                rank = zslGetRank(zs->zsl,score,ele);
+            else
+                rank = zbtGetRank(zs->zbt,score,ele);
             redisAssertWithInfo(c,ele,rank); /* Existing elements always have a rank. */
             if (reverse)
                 addReplyLongLong(c,llen-rank);